@@ -1,5 +1,9 @@
 #include "ControlPanel.h"
 
+#include <QtConcurrent/QtConcurrent>
+
+#include <algorithm>
+
 
 QGroupBox *MSDScriptControlPanel::createExecModeRadioButtonGroup()
 {
@@ -22,6 +26,37 @@ QGroupBox *MSDScriptControlPanel::createExecModeRadioButtonGroup()
     return groupBox;
 }
 
+QWidget *MSDScriptControlPanel::createLimitsRow()
+{
+    QWidget *row = new QWidget();
+
+    maxStepsSpinBox = new QSpinBox();
+    maxStepsSpinBox->setRange(0, 1000000);
+    maxStepsSpinBox->setSuffix(" M calls");
+    maxDepthSpinBox = new QSpinBox();
+    maxDepthSpinBox->setRange(0, 100000000);
+    maxDepthSpinBox->setSuffix(" deep");
+    timeoutSpinBox = new QSpinBox();
+    timeoutSpinBox->setRange(0, 86400);
+    timeoutSpinBox->setSuffix(" s");
+    maxAllocationsSpinBox = new QSpinBox();
+    maxAllocationsSpinBox->setRange(0, 1000000);
+    maxAllocationsSpinBox->setSuffix(" M allocations");
+    for (QSpinBox *spinBox : {maxStepsSpinBox, maxDepthSpinBox, timeoutSpinBox, maxAllocationsSpinBox}) {
+        spinBox->setSpecialValueText("no limit");
+    }
+
+    QHBoxLayout *hBoxLayout = new QHBoxLayout;
+    hBoxLayout->setContentsMargins(0, 0, 0, 0);
+    hBoxLayout->addWidget(maxStepsSpinBox);
+    hBoxLayout->addWidget(maxDepthSpinBox);
+    hBoxLayout->addWidget(timeoutSpinBox);
+    hBoxLayout->addWidget(maxAllocationsSpinBox);
+    row->setLayout(hBoxLayout);
+
+    return row;
+}
+
 MSDScriptControlPanel::MSDScriptControlPanel(QWidget *parent)
     : QWidget{parent}
 {
@@ -36,19 +71,70 @@ MSDScriptControlPanel::MSDScriptControlPanel(QWidget *parent)
 
     execModeLabel = new QLabel("Execution Mode : ");
 
+    engineLabel = new QLabel("Engine : ");
+    engineComboBox = new QComboBox();
+    engineComboBox->addItem("Tree Interpreter", engine_tree_interp);
+    engineComboBox->addItem("Resolved Tree Interpreter", engine_resolved_interp);
+    engineComboBox->addItem("Flat AST Interpreter", engine_flat_interp);
+    engineComboBox->addItem("CEK Machine (tail calls, no stack overflow)", engine_cek_machine);
+    engineComboBox->addItem("Bytecode VM", engine_bytecode_vm);
+    engineComboBox->addItem("Parallel Tree Interpreter (all cores)", engine_parallel);
+
+    parserLabel = new QLabel("Parser : ");
+    parserComboBox = new QComboBox();
+    parserComboBox->addItem("Recursive Descent", parser_recursive_descent);
+    parserComboBox->addItem("Iterative (no nesting limit)", parser_iterative);
+
+    memoCheckBox = new QCheckBox("Memoize function calls");
+    hashConsCheckBox = new QCheckBox("Share repeated subexpressions");
+    optimizeCheckBox = new QCheckBox("Optimize before running");
+    liveCheckBox = new QCheckBox("Evaluate as you type");
+    profileCheckBox = new QCheckBox("Profile (slower, times every node)");
+    astCacheCheckBox = new QCheckBox(
+        QString("Cache parsed scripts on disk (up to %1 MB)").arg((qulonglong) (AstCache::default_max_bytes >> 20)));
+
+    limitsLabel = new QLabel("Limits : ");
+
     submitButton = new QPushButton("Submit");
+    cancelButton = new QPushButton("Cancel");
+    cancelButton->setEnabled(false);
+    progressLabel = new QLabel();
 
     resultLabel = new QLabel("Result : ");
     resultTextEdit = new QTextEdit();
 
+    profileGroupBox = new QGroupBox("Hot spots");
+    hotSpotTable = new QTableWidget(0, 6);
+    hotSpotTable->setHorizontalHeaderLabels(
+        {"Node", "Location", "Count", "Inclusive (ms)", "Exclusive (ms)", "Allocations"});
+    hotSpotTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    hotSpotTable->setMaximumHeight(150);
+    exportProfileButton = new QPushButton("Export Flame Graph Stacks");
+    QVBoxLayout *profileLayout = new QVBoxLayout;
+    profileLayout->addWidget(hotSpotTable);
+    profileLayout->addWidget(exportProfileButton);
+    profileGroupBox->setLayout(profileLayout);
+    profileGroupBox->setVisible(false);
+
     resetButton = new QPushButton("Reset");
 
     formLayout = new QFormLayout(parent);
     formLayout->addRow(expressionLabel, expressionTextEdit);
     formLayout->addRow(importExpressionFromFileButton);
     formLayout->addRow(execModeLabel, createExecModeRadioButtonGroup());
+    formLayout->addRow(engineLabel, engineComboBox);
+    formLayout->addRow(parserLabel, parserComboBox);
+    formLayout->addRow(memoCheckBox);
+    formLayout->addRow(hashConsCheckBox);
+    formLayout->addRow(optimizeCheckBox);
+    formLayout->addRow(liveCheckBox);
+    formLayout->addRow(profileCheckBox);
+    formLayout->addRow(astCacheCheckBox);
+    formLayout->addRow(limitsLabel, createLimitsRow());
     formLayout->addRow(submitButton);
+    formLayout->addRow(cancelButton, progressLabel);
     formLayout->addRow(resultLabel, resultTextEdit);
+    formLayout->addRow(profileGroupBox);
     formLayout->addRow(resetButton);
 
     connect(importExpressionFromFileButton, &QPushButton::released, this, &MSDScriptControlPanel::importExpressionFromFile);
@@ -57,11 +143,38 @@ MSDScriptControlPanel::MSDScriptControlPanel(QWidget *parent)
 
     connect(submitButton, &QPushButton::released, this, &MSDScriptControlPanel::handleSubmit);
 
+    connect(cancelButton, &QPushButton::released, this, &MSDScriptControlPanel::handleCancel);
+
+    connect(exportProfileButton, &QPushButton::released, this, &MSDScriptControlPanel::exportProfile);
+
+    evalWatcher = new QFutureWatcher<EvalOutcome>(this);
+    connect(evalWatcher, &QFutureWatcher<EvalOutcome>::finished, this, &MSDScriptControlPanel::handleEvaluationFinished);
+
+    progressTimer = new QTimer(this);
+    progressTimer->setInterval(100);
+    connect(progressTimer, &QTimer::timeout, this, &MSDScriptControlPanel::updateProgress);
+
+    astCache = std::make_shared<AstCache>(
+        (QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/ast").toStdString());
+
+    liveTimer = new QTimer(this);
+    liveTimer->setSingleShot(true);
+    liveTimer->setInterval(30);
+    connect(liveTimer, &QTimer::timeout, this, &MSDScriptControlPanel::startLiveEvaluation);
+    connect(expressionTextEdit, &QTextEdit::textChanged, this, &MSDScriptControlPanel::scheduleLiveEvaluation);
+    connect(liveCheckBox, &QCheckBox::toggled, this, &MSDScriptControlPanel::scheduleLiveEvaluation);
+
     formLayout->setAlignment(Qt::AlignHCenter | Qt::AlignVCenter);
 
     setLayout(formLayout);
 }
 
+MSDScriptControlPanel::~MSDScriptControlPanel() {
+    // the worker must not outlive the widgets it reports to
+    handleCancel();
+    evalWatcher->waitForFinished();
+}
+
 
 void MSDScriptControlPanel::clearExecModeButtonGroup() {
     execModeButtonGroup->setExclusive(false);
@@ -77,9 +190,23 @@ void MSDScriptControlPanel::handleReset() {
 
     // Check if the user clicked Yes
     if (confirmation == QMessageBox::Yes) {
+        handleCancel();
         expressionTextEdit->clear();
         clearExecModeButtonGroup();
+        engineComboBox->setCurrentIndex(0);
+        parserComboBox->setCurrentIndex(0);
+        memoCheckBox->setChecked(false);
+        hashConsCheckBox->setChecked(false);
+        optimizeCheckBox->setChecked(false);
+        liveCheckBox->setChecked(false);
+        profileCheckBox->setChecked(false);
+        astCacheCheckBox->setChecked(false);
+        maxStepsSpinBox->setValue(0);
+        maxDepthSpinBox->setValue(0);
+        timeoutSpinBox->setValue(0);
+        maxAllocationsSpinBox->setValue(0);
         resultTextEdit->clear();
+        showProfile(nullptr);
     }
 }
 
@@ -101,32 +228,242 @@ void MSDScriptControlPanel::importExpressionFromFile() {
 }
 
 
+// runs on a worker thread, so it only touches its arguments
+static EvalOutcome run_script(const EvalRequest &request, const std::shared_ptr<EvalContext> &context) {
+    MemoCache memo;
+    if (request.memoize) {
+        context->memo = &memo;
+    }
+    context->set_limits(request.limits);
+    EvalScope scope(context.get());
+    EvalOutcome outcome;
+    try {
+        ExprFactory factory;
+        PTR(Expr) expr;
+        if (request.profile && !request.pretty_print) {
+            // the profile needs source positions, which reused and cached trees do not have
+            expr = parse_expression_str(request.script, request.parser, request.hash_cons ? &factory : nullptr);
+        } else if (request.incremental != nullptr) {
+            expr = request.incremental->parse(request.script);
+            outcome.parse_stats = QString("parse: %1 subtrees reused").arg(request.incremental->reused());
+        } else if (request.ast_cache != nullptr) {
+            uint64_t hits = request.ast_cache->hits();
+            expr = request.ast_cache->parse(request.script, request.parser, request.hash_cons ? &factory : nullptr);
+            if (request.ast_cache->hits() != hits) {
+                outcome.parse_stats = "parse: loaded from cache";
+            }
+        } else {
+            expr = parse_expression_str(request.script, request.parser, request.hash_cons ? &factory : nullptr);
+        }
+        if (request.optimize) {
+            OptimizeStats stats;
+            expr = optimize(expr, OptimizeOptions(), &stats);
+            outcome.optimize_stats = QString("optimizer: %1 folded, %2 branches pruned, %3 lets inlined, %4 dead lets removed")
+                                         .arg(stats.folded).arg(stats.branches_pruned)
+                                         .arg(stats.lets_inlined).arg(stats.dead_lets_removed);
+        }
+        std::string result;
+        if (request.pretty_print) {
+            result = expr->to_pretty_string();
+        } else if (request.profile) {
+            outcome.profiler = std::make_shared<Profiler>(request.script);
+            result = outcome.profiler->interp(expr).to_string();
+        } else {
+            result = interp_with(expr, request.engine).to_string();
+        }
+        outcome.result = QString::fromStdString(result);
+    } catch (const EvalCancelled &) {
+        outcome.cancelled = true;
+    } catch (const std::exception &e) {
+        // anything that escaped would be lost in the future, with no error shown
+        outcome.error = QString::fromStdString(e.what());
+    }
+    if (request.memoize) {
+        MemoStats stats = memo.stats();
+        outcome.memo_stats = QString("memo: %1 hits, %2 misses, %3 evictions")
+                                 .arg(stats.hits).arg(stats.misses).arg(stats.evictions);
+        context->memo = nullptr;
+    }
+    return outcome;
+}
+
+EvalRequest MSDScriptControlPanel::currentRequest(bool pretty_print) {
+    EvalRequest request;
+    request.pretty_print = pretty_print;
+    request.script = expressionTextEdit->toPlainText().toStdString();
+    request.engine = (engine_t) engineComboBox->currentData().toInt();
+    request.parser = (parser_t) parserComboBox->currentData().toInt();
+    request.memoize = memoCheckBox->isChecked();
+    request.hash_cons = hashConsCheckBox->isChecked();
+    request.optimize = optimizeCheckBox->isChecked();
+    request.profile = profileCheckBox->isChecked();
+    request.limits.max_steps = (uint64_t) maxStepsSpinBox->value() * 1000000;
+    request.limits.max_depth = maxDepthSpinBox->value();
+    request.limits.timeout = std::chrono::seconds(timeoutSpinBox->value());
+    request.limits.max_allocations = (uint64_t) maxAllocationsSpinBox->value() * 1000000;
+    if (astCacheCheckBox->isChecked()) {
+        request.ast_cache = astCache;
+    }
+    return request;
+}
+
+void MSDScriptControlPanel::startEvaluation(const EvalRequest &request) {
+    evalContext = std::make_shared<EvalContext>();
+    std::shared_ptr<EvalContext> context = evalContext;
+    evalWatcher->setFuture(QtConcurrent::run([request, context]() {
+        return run_script(request, context);
+    }));
+
+    submitButton->setEnabled(false);
+    cancelButton->setEnabled(true);
+    evalElapsed.start();
+    updateProgress();
+    progressTimer->start();
+}
+
 void MSDScriptControlPanel::handleSubmit() {
+    if (evalWatcher->isRunning()) {
+        return;
+    }
+
     // clear the last result
     resultTextEdit->clear();
+    showProfile(nullptr);
 
     if (execModeButtonGroup->checkedButton() == nullptr) {
         QMessageBox::warning(this, "Execution Mode Required", "Please select an execution mode before submitting.");
         return;
     }
 
+    liveRunning = false;
+    startEvaluation(currentRequest(execModeButtonGroup->checkedButton() == prettyPrintRadioButton));
+}
 
-    QString execMode = execModeButtonGroup->checkedButton()->text();
+void MSDScriptControlPanel::scheduleLiveEvaluation() {
+    if (liveCheckBox->isChecked()) {
+        liveTimer->start();
+    }
+}
 
+void MSDScriptControlPanel::startLiveEvaluation() {
+    if (!liveCheckBox->isChecked()) {
+        return;
+    }
+    // the running evaluation is for older text: stop it and start again once it has finished
+    if (evalWatcher->isRunning()) {
+        livePending = true;
+        handleCancel();
+        return;
+    }
+    if (liveParser == nullptr) {
+        liveParser = std::make_shared<IncrementalParser>();
+    }
+    // without a mode chosen, live mode calculates
+    EvalRequest request = currentRequest(execModeButtonGroup->checkedButton() == prettyPrintRadioButton);
+    request.incremental = liveParser;
+    liveRunning = true;
+    startEvaluation(request);
+}
 
-    QString scriptExpression = expressionTextEdit->toPlainText();
+void MSDScriptControlPanel::handleCancel() {
+    if (evalContext != nullptr) {
+        evalContext->cancel();
+    }
+}
 
-    try {
-        auto expr = parse_expression_str(scriptExpression.toStdString());
-        std::string result;
-        if (execMode == interpRadioButton->text()) {
-            result = expr->interp()->to_string();
-        } else if (execMode == prettyPrintRadioButton->text()) {
-            result = expr->to_pretty_string();
+void MSDScriptControlPanel::updateProgress() {
+    if (evalContext == nullptr) {
+        return;
+    }
+    progressLabel->setText(QString("%1 s, %2 calls")
+                               .arg(evalElapsed.elapsed() / 1000.0, 0, 'f', 1)
+                               .arg(evalContext->steps()));
+}
+
+void MSDScriptControlPanel::handleEvaluationFinished() {
+    progressTimer->stop();
+    updateProgress();
+    submitButton->setEnabled(true);
+    cancelButton->setEnabled(false);
+
+    EvalOutcome outcome = evalWatcher->result();
+    if (!outcome.parse_stats.isEmpty()) {
+        progressLabel->setText(progressLabel->text() + ", " + outcome.parse_stats);
+    }
+    if (!outcome.optimize_stats.isEmpty()) {
+        progressLabel->setText(progressLabel->text() + ", " + outcome.optimize_stats);
+    }
+    if (!outcome.memo_stats.isEmpty()) {
+        progressLabel->setText(progressLabel->text() + ", " + outcome.memo_stats);
+    }
+    if (outcome.cancelled) {
+        progressLabel->setText(progressLabel->text() + " (cancelled)");
+    } else if (!outcome.error.isEmpty() && liveRunning) {
+        // half-typed input fails all the time, a dialog per keystroke would be unusable
+        resultTextEdit->setText("error: " + outcome.error);
+    } else if (!outcome.error.isEmpty()) {
+        QMessageBox::warning(this, "Runtime Error", outcome.error);
+    } else {
+        resultTextEdit->setText(outcome.result);
+    }
+    // a failed evaluation still shows where its time went
+    if (outcome.profiler != nullptr) {
+        showProfile(outcome.profiler);
+    }
+
+    liveRunning = false;
+    if (livePending) {
+        livePending = false;
+        startLiveEvaluation();
+    }
+}
+
+void MSDScriptControlPanel::showProfile(const std::shared_ptr<Profiler> &profiler) {
+    lastProfile = profiler;
+    hotSpotTable->setSortingEnabled(false);
+    hotSpotTable->setRowCount(0);
+    profileGroupBox->setVisible(profiler != nullptr);
+    if (profiler == nullptr) {
+        return;
+    }
+    // a long script has a row per node; the slowest few hundred are the interesting ones
+    std::vector<ProfileEntry> entries = profiler->entries();
+    int rows = (int) std::min<size_t>(entries.size(), 500);
+    hotSpotTable->setRowCount(rows);
+    for (int row = 0; row < rows; row++) {
+        const ProfileEntry &entry = entries[row];
+        QVariant values[] = {
+            QString::fromStdString(entry.label),
+            QString::fromStdString(entry.location),
+            QVariant::fromValue<qulonglong>(entry.count),
+            entry.inclusive_ns / 1e6,
+            entry.exclusive_ns / 1e6,
+            QVariant::fromValue<qulonglong>(entry.allocations),
+        };
+        for (int column = 0; column < 6; column++) {
+            // numbers as data rather than text, so the columns sort by value
+            QTableWidgetItem *item = new QTableWidgetItem;
+            item->setData(Qt::DisplayRole, values[column]);
+            hotSpotTable->setItem(row, column, item);
         }
-        resultTextEdit->setText(QString::fromStdString(result));
-    } catch (const std::runtime_error& e) {
-        QMessageBox::warning(this, "Runtime Error", QString::fromStdString(e.what()));
     }
+    hotSpotTable->setSortingEnabled(true);
+    hotSpotTable->sortByColumn(4, Qt::DescendingOrder);
 }
 
+void MSDScriptControlPanel::exportProfile() {
+    if (lastProfile == nullptr) {
+        return;
+    }
+    QString filePath = QFileDialog::getSaveFileName(this, tr("Export Flame Graph Stacks"), "profile.folded",
+                                                    tr("Collapsed Stacks (*.folded *.txt)"));
+    if (filePath.isEmpty()) {
+        return;
+    }
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        QMessageBox::warning(this, tr("Error"), tr("Failed to open file for writing"));
+        return;
+    }
+    file.write(QByteArray::fromStdString(lastProfile->collapsed_stacks()));
+}
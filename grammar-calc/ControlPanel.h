@@ -2,6 +2,7 @@
 #define CONTROLPANEL_H
 
 #include <QButtonGroup>
+#include <QComboBox>
 #include <QFormLayout>
 #include <QGroupBox>
 #include <QLabel>
@@ -12,11 +13,57 @@
 #include <QFileDialog>
 #include <QFile>
 #include <QMessageBox>
+#include <QCheckBox>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QStandardPaths>
+#include <QTableWidget>
+#include <QSpinBox>
+
+#include <memory>
 
 #include "parse.h"
 #include "expr.hpp"
 #include "val.hpp"
 #include "env.h"
+#include "engine.h"
+#include "eval_context.h"
+#include "memo.h"
+#include "hash_cons.h"
+#include "optimize.h"
+#include "incremental_parse.h"
+#include "ast_cache.h"
+#include "profile.h"
+
+// what the panel asks a background evaluation to do
+struct EvalRequest {
+    std::string script;
+    bool pretty_print = false;
+    engine_t engine = engine_tree_interp;
+    parser_t parser = parser_recursive_descent;
+    bool memoize = false;
+    bool hash_cons = false;
+    bool optimize = false;
+    // evaluate with a Profiler instead of the chosen engine
+    bool profile = false;
+    EvalLimits limits;
+    // live mode: parse with this instead of from scratch, errors are shown in place
+    std::shared_ptr<IncrementalParser> incremental;
+    // otherwise: load the tree from here when this script was parsed before
+    std::shared_ptr<AstCache> ast_cache;
+};
+
+// what a background evaluation hands back to the panel
+struct EvalOutcome {
+    QString result;
+    QString error;
+    bool cancelled = false;
+    QString memo_stats;
+    QString optimize_stats;
+    QString parse_stats;
+    std::shared_ptr<Profiler> profiler;
+};
 
 class MSDScriptControlPanel : public QWidget
 {
@@ -24,6 +71,8 @@ class MSDScriptControlPanel : public QWidget
 public:
     explicit MSDScriptControlPanel(QWidget *parent = nullptr);
 
+    ~MSDScriptControlPanel();
+
 private:
     QLabel* expressionLabel;
     QTextEdit* expressionTextEdit;
@@ -36,11 +85,59 @@ private:
     QRadioButton* prettyPrintRadioButton;
     QGroupBox* createExecModeRadioButtonGroup();
 
+    QLabel* engineLabel;
+    QComboBox* engineComboBox;
+
+    QLabel* parserLabel;
+    QComboBox* parserComboBox;
+
+    QCheckBox* memoCheckBox;
+    QCheckBox* hashConsCheckBox;
+    QCheckBox* optimizeCheckBox;
+    QCheckBox* liveCheckBox;
+    QCheckBox* profileCheckBox;
+    QCheckBox* astCacheCheckBox;
+
+    // evaluation budgets, 0 for none
+    QLabel* limitsLabel;
+    QSpinBox* maxStepsSpinBox;
+    QSpinBox* maxDepthSpinBox;
+    QSpinBox* timeoutSpinBox;
+    QSpinBox* maxAllocationsSpinBox;
+    QWidget* createLimitsRow();
+
     QPushButton* submitButton;
+    QPushButton* cancelButton;
+    QLabel* progressLabel;
+
+    QFutureWatcher<EvalOutcome>* evalWatcher;
+    std::shared_ptr<EvalContext> evalContext;
+    QTimer* progressTimer;
+    QElapsedTimer evalElapsed;
+
+    // parsed scripts, kept across runs of the program while astCacheCheckBox is ticked
+    std::shared_ptr<AstCache> astCache;
+
+    // evaluate-as-you-type: edits restart liveTimer, which starts an evaluation
+    // when typing pauses; one arriving while another runs cancels it and waits
+    QTimer* liveTimer;
+    std::shared_ptr<IncrementalParser> liveParser;
+    bool liveRunning = false;
+    bool livePending = false;
+
+    EvalRequest currentRequest(bool pretty_print);
+    void startEvaluation(const EvalRequest &request);
 
     QLabel* resultLabel;
     QTextEdit* resultTextEdit;
 
+    // hot spots of the last profiled evaluation, hidden until there is one
+    QGroupBox* profileGroupBox;
+    QTableWidget* hotSpotTable;
+    QPushButton* exportProfileButton;
+    std::shared_ptr<Profiler> lastProfile;
+    void showProfile(const std::shared_ptr<Profiler> &profiler);
+
     QPushButton* resetButton;
 
     QFormLayout *formLayout;
@@ -50,6 +147,12 @@ private slots:
     void handleReset();
     void importExpressionFromFile();
     void handleSubmit();
+    void handleCancel();
+    void updateProgress();
+    void handleEvaluationFinished();
+    void scheduleLiveEvaluation();
+    void startLiveEvaluation();
+    void exportProfile();
 };
 
 #endif // CONTROLPANEL_H
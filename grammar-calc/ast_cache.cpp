@@ -0,0 +1,394 @@
+#include "ast_cache.h"
+#include "expr.hpp"
+#include "hash_cons.h"
+#include "big_num.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <system_error>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define AST_CACHE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char ast_magic[8] = {'G', 'C', 'A', 'L', 'C', 'A', 'S', 'T'};
+
+// reads back differently on a host with the other byte order
+const uint32_t ast_byte_order = 0x01020304;
+
+// followed by first, second and third (uint32_t per node), the end offset of
+// each name and of each big number's text (uint32_t), kinds (uint8_t per
+// node), the name bytes, the big numbers' decimal digits and the source text
+struct AstHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t source_hash;
+    uint64_t source_size;
+    uint32_t node_count;
+    uint32_t name_count;
+    uint32_t names_size;
+    uint32_t root;
+    uint32_t number_count;
+    uint32_t numbers_size;
+    // see checksum below
+    uint64_t checksum;
+};
+
+// covers the header too: the hash of the header with its checksum field set to
+// the hash of everything after it
+uint64_t checksum(AstHeader header, const char *payload, size_t size) {
+    header.checksum = hash_bytes(payload, size);
+    return hash_bytes((const char *) &header, sizeof(header));
+}
+
+uint64_t payload_size(const AstHeader &header) {
+    return (uint64_t) header.node_count * (3 * sizeof(uint32_t) + sizeof(uint8_t))
+           + ((uint64_t) header.name_count + header.number_count) * sizeof(uint32_t) + header.names_size
+           + header.numbers_size + header.source_size;
+}
+
+// the strings ends delimits in text, nullptr when an end is out of order or past size
+template<typename F>
+const char *read_strings(const char *text, uint32_t size, const std::vector<uint32_t> &ends, F add) {
+    uint32_t begin = 0;
+    for (uint32_t end : ends) {
+        if (end < begin || end > size) {
+            return nullptr;
+        }
+        add(std::string_view(text + begin, end - begin));
+        begin = end;
+    }
+    return text + size;
+}
+
+template<typename T>
+const char *read_array(const char *data, std::vector<T> &out, size_t count) {
+    out.resize(count);
+    std::memcpy(out.data(), data, count * sizeof(T));
+    return data + count * sizeof(T);
+}
+
+// the operands that are node indices, as in the table in flat_ast.h
+bool has_node_first(node_kind_t kind) {
+    return kind != node_num && kind != node_bool && kind != node_var && kind != node_let && kind != node_fun;
+}
+
+bool has_node_second(node_kind_t kind) {
+    return kind != node_num && kind != node_bool && kind != node_var;
+}
+
+bool has_node_third(node_kind_t kind) {
+    return kind == node_let || kind == node_if;
+}
+
+bool has_name(node_kind_t kind) {
+    return kind == node_var || kind == node_let || kind == node_fun;
+}
+
+// everything interp and to_expr rely on: known kinds, names in range and
+// children before their parent, so no entry can make them loop or read past the arrays
+bool well_formed(const FlatAst &ast) {
+    for (node_t node = 0; node < ast.size(); node++) {
+        if (ast.kinds[node] > node_call) {
+            return false;
+        }
+        node_kind_t kind = ast.kind(node);
+        if (has_name(kind) && ast.first[node] >= ast.names.size()) {
+            return false;
+        }
+        if (kind == node_num && ast.third[node] > ast.big_numbers.size()) {
+            return false;
+        }
+        if ((has_node_first(kind) && ast.first[node] >= node) || (has_node_second(kind) && ast.second[node] >= node)
+            || (has_node_third(kind) && ast.third[node] >= node)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+PTR(FlatAst) deserialize(const char *data, size_t size, uint64_t source_hash, std::string_view source) {
+    AstHeader header;
+    if (size < sizeof(header)) {
+        return nullptr;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, ast_magic, sizeof(ast_magic)) != 0 || header.version != ast_format_version
+        || header.byte_order != ast_byte_order || header.source_hash != source_hash
+        || header.source_size != source.size() || header.node_count == 0 || header.root >= header.node_count
+        || size - sizeof(header) != payload_size(header)
+        || checksum(header, data + sizeof(header), size - sizeof(header)) != header.checksum) {
+        return nullptr;
+    }
+
+    PTR(FlatAst) ast = NEW(FlatAst)();
+    const char *at = data + sizeof(header);
+    at = read_array(at, ast->first, header.node_count);
+    at = read_array(at, ast->second, header.node_count);
+    at = read_array(at, ast->third, header.node_count);
+    std::vector<uint32_t> name_ends;
+    std::vector<uint32_t> number_ends;
+    at = read_array(at, name_ends, header.name_count);
+    at = read_array(at, number_ends, header.number_count);
+    at = read_array(at, ast->kinds, header.node_count);
+    ast->names.reserve(header.name_count);
+    at = read_strings(at, header.names_size, name_ends, [&](std::string_view name) {
+        ast->names.emplace_back(name);
+    });
+    if (at == nullptr) {
+        return nullptr;
+    }
+    try {
+        at = read_strings(at, header.numbers_size, number_ends, [&](std::string_view number) {
+            ast->big_numbers.push_back(parse_number(number));
+        });
+    } catch (const std::runtime_error &) {
+        return nullptr;
+    }
+    // the hash only names the entry: two texts may share it, so compare the text itself
+    if (at == nullptr || std::memcmp(at, source.data(), source.size()) != 0) {
+        return nullptr;
+    }
+    ast->root = header.root;
+    return well_formed(*ast) ? ast : nullptr;
+}
+
+}
+
+uint64_t hash_bytes(const char *data, size_t size) {
+    const uint64_t multiplier = 0xff51afd7ed558ccdULL;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (size * multiplier);
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 32;
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, size - i);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 32;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+std::string serialize_ast(const FlatAst &ast, std::string_view source) {
+    std::vector<uint32_t> name_ends;
+    uint32_t names_size = 0;
+    for (const std::string &name : ast.names) {
+        names_size += (uint32_t) name.size();
+        name_ends.push_back(names_size);
+    }
+    std::vector<std::string> numbers;
+    std::vector<uint32_t> number_ends;
+    uint32_t numbers_size = 0;
+    for (const Value &number : ast.big_numbers) {
+        numbers.push_back(number.to_string());
+        numbers_size += (uint32_t) numbers.back().size();
+        number_ends.push_back(numbers_size);
+    }
+
+    AstHeader header;
+    std::memcpy(header.magic, ast_magic, sizeof(ast_magic));
+    header.version = ast_format_version;
+    header.byte_order = ast_byte_order;
+    header.source_hash = hash_bytes(source.data(), source.size());
+    header.source_size = source.size();
+    header.node_count = (uint32_t) ast.size();
+    header.name_count = (uint32_t) ast.names.size();
+    header.names_size = names_size;
+    header.root = ast.root;
+    header.number_count = (uint32_t) numbers.size();
+    header.numbers_size = numbers_size;
+
+    std::string out(sizeof(header), '\0');
+    out.reserve(sizeof(header) + payload_size(header));
+    out.append((const char *) ast.first.data(), ast.size() * sizeof(uint32_t));
+    out.append((const char *) ast.second.data(), ast.size() * sizeof(uint32_t));
+    out.append((const char *) ast.third.data(), ast.size() * sizeof(uint32_t));
+    out.append((const char *) name_ends.data(), name_ends.size() * sizeof(uint32_t));
+    out.append((const char *) number_ends.data(), number_ends.size() * sizeof(uint32_t));
+    out.append((const char *) ast.kinds.data(), ast.size());
+    for (const std::string &name : ast.names) {
+        out.append(name);
+    }
+    for (const std::string &number : numbers) {
+        out.append(number);
+    }
+    out.append(source);
+    header.checksum = checksum(header, out.data() + sizeof(header), out.size() - sizeof(header));
+    std::memcpy(&out[0], &header, sizeof(header));
+    return out;
+}
+
+PTR(FlatAst) deserialize_ast(const char *data, size_t size, std::string_view source) {
+    return deserialize(data, size, hash_bytes(source.data(), source.size()), source);
+}
+
+AstCache::AstCache(std::string directory, size_t min_source_size, uint64_t max_bytes)
+    : directory(std::move(directory)), min_source_size(min_source_size), max_bytes(max_bytes) {
+}
+
+std::string AstCache::path_for(uint64_t hash) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.ast", (unsigned long long) hash);
+    return (std::filesystem::path(this->directory) / name).string();
+}
+
+PTR(FlatAst) AstCache::load(std::string_view str) {
+    uint64_t hash = hash_bytes(str.data(), str.size());
+    std::string path = this->path_for(hash);
+    PTR(FlatAst) ast;
+#ifdef AST_CACHE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                ast = deserialize((const char *) mapped, info.st_size, hash, str);
+                munmap(mapped, info.st_size);
+            }
+        }
+        close(fd);
+    }
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (in) {
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        ast = deserialize(data.data(), data.size(), hash, str);
+    }
+#endif
+    if (ast != nullptr) {
+        // the modification time doubles as the last use, which evict() goes by
+        std::error_code error;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+    }
+    (ast != nullptr ? this->hit_count : this->miss_count).fetch_add(1, std::memory_order_relaxed);
+    return ast;
+}
+
+void AstCache::store(std::string_view str, const FlatAst &ast) {
+    std::error_code error;
+    std::filesystem::create_directories(this->directory, error);
+    std::string path = this->path_for(hash_bytes(str.data(), str.size()));
+    // unique per writer, so concurrent stores of one entry never interleave
+    std::string temporary = path + ".tmp" + std::to_string(std::random_device()());
+    uint64_t size;
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        std::string data = serialize_ast(ast, str);
+        size = data.size();
+        out.write(data.data(), data.size());
+        out.flush();
+        if (!out.good()) {
+            out.close();
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+        return;
+    }
+    if (this->max_bytes == 0) {
+        return;
+    }
+    // a replaced entry is counted twice, which only brings the next scan forward
+    uint64_t estimate = this->estimated_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    if (!this->scanned.load(std::memory_order_relaxed) || estimate > this->max_bytes) {
+        this->evict();
+    }
+}
+
+void AstCache::evict() {
+    std::unique_lock<std::mutex> lock(this->evicting, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    // stores made while scanning stay counted on top of what the scan finds
+    uint64_t counted = this->estimated_bytes.load(std::memory_order_relaxed);
+    struct Entry {
+        std::filesystem::file_time_type used;
+        uint64_t size;
+        std::filesystem::path path;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    std::error_code error;
+    for (std::filesystem::directory_iterator it(this->directory, error), end; !error && it != end; it.increment(error)) {
+        std::error_code entry_error;
+        if (it->path().extension() != ".ast" || !it->is_regular_file(entry_error)) {
+            continue;
+        }
+        uint64_t size = it->file_size(entry_error);
+        std::filesystem::file_time_type used = it->last_write_time(entry_error);
+        if (!entry_error) {
+            entries.push_back(Entry{used, size, it->path()});
+            total += size;
+        }
+    }
+    this->scanned.store(true, std::memory_order_relaxed);
+    if (total <= this->max_bytes) {
+        this->estimated_bytes.fetch_add(total - counted, std::memory_order_relaxed);
+        return;
+    }
+    // down to three quarters, so the next scan is that many stores away
+    uint64_t target = this->max_bytes - this->max_bytes / 4;
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+    for (const Entry &entry : entries) {
+        if (total <= target) {
+            break;
+        }
+        // another process may have deleted or replaced it already; either way it stops counting here
+        std::filesystem::remove(entry.path, error);
+        total -= entry.size;
+    }
+    // wraps around when total < counted, which is what subtracting takes
+    this->estimated_bytes.fetch_add(total - counted, std::memory_order_relaxed);
+}
+
+PTR(Expr) AstCache::parse(std::string_view str, parser_t parser, ExprFactory *factory) {
+    if (str.size() < this->min_source_size) {
+        return parse_expression_str(str, parser, factory);
+    }
+    PTR(FlatAst) ast = this->load(str);
+    if (ast != nullptr) {
+        ExprFactoryScope scope(factory);
+        return ast->to_expr();
+    }
+    PTR(Expr) expr = parse_expression_str(str, parser, factory);
+    this->store(str, *flatten(expr));
+    return expr;
+}
+
+PTR(FlatAst) AstCache::parse_flat(std::string_view str, parser_t parser) {
+    if (str.size() < this->min_source_size) {
+        return flatten(parse_expression_str(str, parser));
+    }
+    PTR(FlatAst) ast = this->load(str);
+    if (ast == nullptr) {
+        ast = flatten(parse_expression_str(str, parser));
+        this->store(str, *ast);
+    }
+    return ast;
+}
@@ -0,0 +1,96 @@
+#ifndef AST_CACHE_H
+#define AST_CACHE_H
+
+class Expr;
+class ExprFactory;
+
+#include "flat_ast.h"
+#include "parse.h"
+#include "pointer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Bumped whenever the file layout, or the tree the parsers build from some
+// text, changes: entries written by other versions are ignored and reparsed.
+const uint32_t ast_format_version = 3;
+
+// A FlatAst as bytes: a fixed header, then the node arrays, the names, the
+// big numbers (as decimal text) and the text the tree was parsed from, in the
+// host's byte order. The header records the hash and length of that text and
+// a checksum of everything after it. An entry is only used for the exact text
+// it stores; the hash just names the file.
+std::string serialize_ast(const FlatAst &ast, std::string_view source);
+
+// the tree stored in data when it is intact, in this version's format and was
+// parsed from source; nullptr otherwise
+PTR(FlatAst) deserialize_ast(const char *data, size_t size, std::string_view source);
+
+// 64-bit hash of some bytes, used to name cache entries and checksum them
+uint64_t hash_bytes(const char *data, size_t size);
+
+// Parsed trees kept on disk in a directory, one file per distinct source text
+// named after its hash, so a text seen before is loaded instead of parsed.
+// Entries are mapped and checked before use; any that is stale, truncated or
+// corrupt counts as a miss and is rewritten. Writes go through a temporary
+// file and a rename, so one cache can be shared by threads and processes.
+// Past max_bytes of entries, the least recently used ones are deleted.
+class AstCache {
+public:
+    static const size_t default_min_source_size = 4096;
+
+    static const uint64_t default_max_bytes = 256ull << 20;
+
+    // the directory is created on first store; texts shorter than
+    // min_source_size are always parsed, as that is quicker than opening a
+    // file; max_bytes 0 never deletes entries
+    explicit AstCache(std::string directory, size_t min_source_size = default_min_source_size,
+                      uint64_t max_bytes = default_max_bytes);
+
+    // the tree for str, loaded from its entry or else parsed (parse errors are
+    // thrown as usual) and stored; with a factory the loaded tree is shared
+    // like a parsed one would be
+    PTR(Expr) parse(std::string_view str, parser_t parser = parser_recursive_descent,
+                    ExprFactory *factory = nullptr);
+
+    // like parse, but hands back the flat form, which the flat engine runs as is
+    PTR(FlatAst) parse_flat(std::string_view str, parser_t parser = parser_recursive_descent);
+
+    // the stored tree for str, or nullptr
+    PTR(FlatAst) load(std::string_view str);
+
+    // best effort: a cache that cannot be written to only stops saving time
+    void store(std::string_view str, const FlatAst &ast);
+
+    uint64_t hits() const {
+        return this->hit_count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t misses() const {
+        return this->miss_count.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::string directory;
+    size_t min_source_size;
+    uint64_t max_bytes;
+    std::atomic<uint64_t> hit_count{0};
+    std::atomic<uint64_t> miss_count{0};
+    // the entries' total size at the last scan plus what was stored since,
+    // so stores only scan the directory once it may be over max_bytes
+    std::atomic<uint64_t> estimated_bytes{0};
+    std::atomic<bool> scanned{false};
+    // held by the one thread scanning; the others skip it
+    std::mutex evicting;
+
+    std::string path_for(uint64_t hash) const;
+
+    // once the entries are over max_bytes, deletes the least recently used
+    // until they fill three quarters of it, unless another thread is at it
+    void evict();
+};
+
+#endif // AST_CACHE_H
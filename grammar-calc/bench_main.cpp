@@ -0,0 +1,349 @@
+#include "engine.h"
+#include "parse.h"
+#include "expr.hpp"
+#include "ast_cache.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Benchmarks parse_expression_str, loading the same tree from its cached form
+// (see ast_cache.h), interp, to_string and to_pretty_string over generated
+// workloads. Each benchmark is calibrated to run for at least --min-time
+// seconds per sample; the best of three samples is reported.
+
+static std::atomic<uint64_t> allocation_count{0};
+
+#if defined(__GNUC__) && __GNUC__ >= 11
+// the replacement operator new is malloc-backed, so free is its matching release
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+namespace {
+
+struct Workload {
+    std::string name;
+    int n;
+    std::string source;
+};
+
+struct Result {
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    long peak_rss_kb;
+};
+
+struct Options {
+    engine_t engine = engine_tree_interp;
+    double min_time = 0.2;
+    std::string filter;
+    std::string json_path;
+    std::string baseline_path;
+    double threshold = 10;
+};
+
+std::string fib_source(int n) {
+    return "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else "
+           "fib(fib)(x + -2) + fib(fib)(x + -1) _in fib(fib)(" + std::to_string(n) + ")";
+}
+
+std::string chain_source(int n, const char *op) {
+    std::string source = "1";
+    for (int i = 1; i < n; i++) {
+        source += op;
+        source += "1";
+    }
+    return source;
+}
+
+// variables are letters only: a, b, ..., z, ba, bb, ...
+std::string variable_name(int i) {
+    std::string name;
+    do {
+        name.insert(name.begin(), (char) ('a' + i % 26));
+        i /= 26;
+    } while (i > 0);
+    return name;
+}
+
+std::string nested_let_source(int n) {
+    std::string source = "_let a = 0 _in ";
+    for (int i = 1; i <= n; i++) {
+        source += "_let " + variable_name(i) + " = " + variable_name(i - 1) + " + 1 _in ";
+    }
+    return source + variable_name(n);
+}
+
+// n _lets, then n reads of the outermost variable, each of which walks past
+// every binding unless the engine resolves variables to slots
+std::string deep_lookup_source(int n) {
+    std::string source;
+    for (int i = 0; i < n; i++) {
+        source += "_let " + variable_name(i) + " = " + std::to_string(i) + " _in ";
+    }
+    source += "a";
+    for (int i = 1; i < n; i++) {
+        source += " + a";
+    }
+    return source;
+}
+
+std::string closures_source(int n) {
+    std::string source = "_let add = _fun (x) _fun (y) x + y _in add(0)(1)";
+    for (int i = 1; i < n; i++) {
+        source += " + add(" + std::to_string(i) + ")(1)";
+    }
+    return source;
+}
+
+std::vector<Workload> workloads() {
+    std::vector<Workload> all;
+    for (int n : {10, 15, 20}) {
+        all.push_back({"fib", n, fib_source(n)});
+    }
+    for (int n : {1000, 10000}) {
+        all.push_back({"add_chain", n, chain_source(n, " + ")});
+        all.push_back({"mult_chain", n, chain_source(n, " * ")});
+    }
+    for (int n : {100, 1000}) {
+        all.push_back({"nested_let", n, nested_let_source(n)});
+        all.push_back({"deep_lookup", n, deep_lookup_source(n)});
+    }
+    for (int n : {100, 1000}) {
+        all.push_back({"closures", n, closures_source(n)});
+    }
+    return all;
+}
+
+long peak_rss_kb() {
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+Result measure(const std::string &name, const std::function<size_t()> &op, double min_time) {
+    volatile size_t sink = 0;
+
+    // one run to warm up and size the samples
+    auto start = std::chrono::steady_clock::now();
+    sink = sink + op();
+    double once = std::max(seconds_since(start), 1e-9);
+    uint64_t iterations = std::max<uint64_t>(1, (uint64_t) (min_time / once));
+
+    Result result{name, iterations, 0, 0, 0};
+    double best = -1;
+    for (int sample = 0; sample < 3; sample++) {
+        uint64_t allocations_before = allocation_count.load(std::memory_order_relaxed);
+        start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; i++) {
+            sink = sink + op();
+        }
+        double ns_per_op = seconds_since(start) * 1e9 / iterations;
+        if (best < 0 || ns_per_op < best) {
+            best = ns_per_op;
+        }
+        result.allocs_per_op = (double) (allocation_count.load(std::memory_order_relaxed) - allocations_before) / iterations;
+    }
+    result.ns_per_op = best;
+    result.peak_rss_kb = peak_rss_kb();
+    return result;
+}
+
+std::vector<Result> run(const Options &options) {
+    std::vector<Result> results;
+    for (const Workload &workload : workloads()) {
+        std::string suffix = "/" + workload.name + "/" + std::to_string(workload.n);
+        PTR(Expr) expr = parse_expression_str(workload.source);
+        std::string cached = serialize_ast(*flatten(expr), workload.source);
+        std::vector<std::pair<std::string, std::function<size_t()>>> ops = {
+            {"parse" + suffix, [&] { return (size_t) parse_expression_str(workload.source).use_count(); }},
+            {"load_cached" + suffix, [&] {
+                return (size_t) deserialize_ast(cached.data(), cached.size(), workload.source)->to_expr().use_count();
+            }},
+            {"interp" + suffix, [&] { return (size_t) interp_with(expr, options.engine).is_num(); }},
+            {"to_string" + suffix, [&] { return expr->to_string().size(); }},
+            {"to_pretty_string" + suffix, [&] { return expr->to_pretty_string().size(); }},
+        };
+        for (const auto &op : ops) {
+            if (op.first.find(options.filter) == std::string::npos) {
+                continue;
+            }
+            results.push_back(measure(op.first, op.second, options.min_time));
+            const Result &result = results.back();
+            std::cout << std::left << std::setw(36) << result.name << std::right
+                      << std::setw(14) << std::fixed << std::setprecision(1) << result.ns_per_op << " ns/op"
+                      << std::setw(12) << std::setprecision(1) << result.allocs_per_op << " allocs/op"
+                      << std::setw(10) << result.peak_rss_kb << " KB peak RSS\n";
+        }
+    }
+    return results;
+}
+
+// one benchmark object per line, which is also what read_json expects
+void write_json(std::ostream &out, const std::vector<Result> &results) {
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &result = results[i];
+        out << "    {\"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+            << ", \"ns_per_op\": " << std::fixed << std::setprecision(2) << result.ns_per_op
+            << ", \"allocs_per_op\": " << result.allocs_per_op
+            << ", \"peak_rss_kb\": " << result.peak_rss_kb << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+double json_number(const std::string &line, const std::string &key) {
+    size_t at = line.find("\"" + key + "\": ");
+    if (at == std::string::npos) {
+        throw std::runtime_error("baseline entry without " + key);
+    }
+    return std::strtod(line.c_str() + at + key.size() + 4, nullptr);
+}
+
+std::map<std::string, Result> read_json(std::istream &in) {
+    std::map<std::string, Result> results;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t at = line.find("\"name\": \"");
+        if (at == std::string::npos) {
+            continue;
+        }
+        size_t begin = at + 9;
+        std::string name = line.substr(begin, line.find('"', begin) - begin);
+        results[name] = Result{name, (uint64_t) json_number(line, "iterations"), json_number(line, "ns_per_op"),
+                               json_number(line, "allocs_per_op"), (long) json_number(line, "peak_rss_kb")};
+    }
+    return results;
+}
+
+// a benchmark regresses when it got slower than the threshold allows or allocates more
+int compare(const std::vector<Result> &results, const std::map<std::string, Result> &baseline, double threshold) {
+    int regressions = 0;
+    std::cout << "\ncompared with baseline (threshold " << threshold << "%):\n";
+    for (const Result &result : results) {
+        auto found = baseline.find(result.name);
+        if (found == baseline.end()) {
+            continue;
+        }
+        const Result &before = found->second;
+        double change = (result.ns_per_op / before.ns_per_op - 1) * 100;
+        bool slower = change > threshold;
+        bool allocates_more = result.allocs_per_op > before.allocs_per_op + 0.5;
+        if (slower || allocates_more) {
+            regressions++;
+        }
+        std::cout << std::left << std::setw(36) << result.name << std::right << std::showpos
+                  << std::setw(9) << std::fixed << std::setprecision(1) << change << "%" << std::noshowpos
+                  << (slower ? "  SLOWER" : "") << (allocates_more ? "  MORE ALLOCATIONS" : "") << "\n";
+    }
+    std::cout << regressions << " regression(s)\n";
+    return regressions;
+}
+
+void usage(std::ostream &out) {
+    out << "usage: grammar-calc-bench [--engine tree|resolved|flat|cek|vm|parallel] [--filter TEXT] [--min-time SECONDS]\n"
+           "                          [--json FILE] [--baseline FILE] [--threshold PERCENT]\n";
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+    const std::pair<const char *, engine_t> engines[] = {
+        {"tree", engine_tree_interp},
+        {"resolved", engine_resolved_interp},
+        {"flat", engine_flat_interp},
+        {"cek", engine_cek_machine},
+        {"vm", engine_bytecode_vm},
+        {"parallel", engine_parallel},
+    };
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--engine") {
+            auto found = std::find_if(std::begin(engines), std::end(engines),
+                                      [&](const auto &entry) { return value == entry.first; });
+            if (found == std::end(engines)) {
+                return false;
+            }
+            options.engine = found->second;
+        } else if (arg == "--filter") {
+            options.filter = value;
+        } else if (arg == "--min-time") {
+            options.min_time = std::atof(value.c_str());
+        } else if (arg == "--json") {
+            options.json_path = value;
+        } else if (arg == "--baseline") {
+            options.baseline_path = value;
+        } else if (arg == "--threshold") {
+            options.threshold = std::atof(value.c_str());
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage(std::cerr);
+        return 2;
+    }
+
+    std::vector<Result> results = run(options);
+
+    if (!options.json_path.empty()) {
+        std::ofstream out(options.json_path);
+        write_json(out, results);
+    }
+    if (!options.baseline_path.empty()) {
+        std::ifstream in(options.baseline_path);
+        if (!in) {
+            std::cerr << "cannot open " << options.baseline_path << "\n";
+            return 2;
+        }
+        if (compare(results, read_json(in), options.threshold) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
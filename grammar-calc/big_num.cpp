@@ -0,0 +1,327 @@
+#include "big_num.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+typedef std::vector<uint32_t> Limbs;
+
+// below this many limbs in the shorter operand, schoolbook multiplication beats Karatsuba
+const size_t karatsuba_threshold = 32;
+
+// a number's sign and magnitude, without copying a BigNumVal's limbs or
+// allocating for an immediate
+class Magnitude {
+public:
+    bool negative;
+    const uint32_t *limbs;
+    size_t size;
+
+    explicit Magnitude(const Value &value) {
+        if (value.is_num()) {
+            int64_t num = value.as_num();
+            uint64_t magnitude = num < 0 ? 0 - (uint64_t) num : (uint64_t) num;
+            this->negative = num < 0;
+            this->buffer[0] = (uint32_t) magnitude;
+            this->buffer[1] = (uint32_t) (magnitude >> 32);
+            this->limbs = this->buffer;
+            this->size = this->buffer[1] != 0 ? 2 : this->buffer[0] != 0 ? 1 : 0;
+            return;
+        }
+        auto *big = val_cast<BigNumVal>(value);
+        this->negative = big->negative;
+        this->limbs = big->limbs.data();
+        this->size = big->limbs.size();
+    }
+
+    Magnitude(const Magnitude &) = delete;
+
+    Magnitude &operator=(const Magnitude &) = delete;
+
+private:
+    uint32_t buffer[2];
+};
+
+size_t trimmed(const uint32_t *limbs, size_t size) {
+    while (size > 0 && limbs[size - 1] == 0) {
+        size--;
+    }
+    return size;
+}
+
+int compare_magnitudes(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size) {
+    a_size = trimmed(a, a_size);
+    b_size = trimmed(b, b_size);
+    if (a_size != b_size) {
+        return a_size < b_size ? -1 : 1;
+    }
+    for (size_t i = a_size; i-- > 0;) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// result += addend shifted up by shift limbs; result must be long enough for the sum
+void add_shifted(Limbs &result, const uint32_t *addend, size_t size, size_t shift) {
+    size = trimmed(addend, size);
+    uint64_t carry = 0;
+    size_t i = shift;
+    for (size_t j = 0; j < size; i++, j++) {
+        uint64_t sum = (uint64_t) result[i] + addend[j] + carry;
+        result[i] = (uint32_t) sum;
+        carry = sum >> 32;
+    }
+    for (; carry != 0; i++) {
+        uint64_t sum = (uint64_t) result[i] + carry;
+        result[i] = (uint32_t) sum;
+        carry = sum >> 32;
+    }
+}
+
+// result -= subtrahend, which must not be the larger of the two
+void subtract_in_place(Limbs &result, const uint32_t *subtrahend, size_t size) {
+    size = trimmed(subtrahend, size);
+    uint64_t borrow = 0;
+    size_t i = 0;
+    for (; i < size; i++) {
+        uint64_t difference = (uint64_t) result[i] - subtrahend[i] - borrow;
+        result[i] = (uint32_t) difference;
+        borrow = difference >> 63;
+    }
+    for (; borrow != 0; i++) {
+        uint64_t difference = (uint64_t) result[i] - borrow;
+        result[i] = (uint32_t) difference;
+        borrow = difference >> 63;
+    }
+}
+
+Limbs add_magnitudes(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size) {
+    if (a_size < b_size) {
+        std::swap(a, b);
+        std::swap(a_size, b_size);
+    }
+    Limbs result(a, a + a_size);
+    result.push_back(0);
+    add_shifted(result, b, b_size, 0);
+    return result;
+}
+
+void multiply_schoolbook(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size, uint32_t *result) {
+    for (size_t i = 0; i < a_size; i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < b_size; j++) {
+            // at most (2^32 - 1)^2 + 2 * (2^32 - 1), which still fits
+            uint64_t product = (uint64_t) a[i] * b[j] + result[i + j] + carry;
+            result[i + j] = (uint32_t) product;
+            carry = product >> 32;
+        }
+        result[i + b_size] = (uint32_t) carry;
+    }
+}
+
+Limbs multiply_magnitudes(const uint32_t *a, size_t a_size, const uint32_t *b, size_t b_size) {
+    a_size = trimmed(a, a_size);
+    b_size = trimmed(b, b_size);
+    if (a_size < b_size) {
+        std::swap(a, b);
+        std::swap(a_size, b_size);
+    }
+    if (b_size == 0) {
+        return Limbs();
+    }
+    Limbs result(a_size + b_size, 0);
+    if (b_size < karatsuba_threshold) {
+        multiply_schoolbook(a, a_size, b, b_size, result.data());
+        return result;
+    }
+    size_t half = (a_size + 1) / 2;
+    if (b_size <= half) {
+        // b is too short to split: a * b = a_low * b + (a_high * b << half)
+        Limbs low = multiply_magnitudes(a, half, b, b_size);
+        Limbs high = multiply_magnitudes(a + half, a_size - half, b, b_size);
+        add_shifted(result, low.data(), low.size(), 0);
+        add_shifted(result, high.data(), high.size(), half);
+        return result;
+    }
+    // three half-size products instead of four:
+    // (a_low + a_high) * (b_low + b_high) - low - high is the middle term
+    Limbs low = multiply_magnitudes(a, half, b, half);
+    Limbs high = multiply_magnitudes(a + half, a_size - half, b + half, b_size - half);
+    Limbs a_sum = add_magnitudes(a, half, a + half, a_size - half);
+    Limbs b_sum = add_magnitudes(b, half, b + half, b_size - half);
+    Limbs middle = multiply_magnitudes(a_sum.data(), a_sum.size(), b_sum.data(), b_sum.size());
+    subtract_in_place(middle, low.data(), low.size());
+    subtract_in_place(middle, high.data(), high.size());
+    add_shifted(result, low.data(), low.size(), 0);
+    add_shifted(result, middle.data(), middle.size(), half);
+    add_shifted(result, high.data(), high.size(), 2 * half);
+    return result;
+}
+
+// an immediate when the number fits in one, so equal numbers have one form
+Value make_number(bool negative, Limbs limbs) {
+    limbs.resize(trimmed(limbs.data(), limbs.size()));
+    if (limbs.size() <= 2) {
+        uint64_t magnitude = limbs.empty() ? 0 : limbs[0];
+        if (limbs.size() == 2) {
+            magnitude |= (uint64_t) limbs[1] << 32;
+        }
+        const uint64_t max = std::numeric_limits<int64_t>::max();
+        if (!negative && magnitude <= max) {
+            return Value::from_num((int64_t) magnitude);
+        }
+        if (negative && magnitude <= max + 1) {
+            return Value::from_num((int64_t) (0 - magnitude));
+        }
+    }
+    return Value(NEW(BigNumVal)(negative, std::move(limbs)));
+}
+
+// limbs = limbs * multiplier + addend
+void multiply_add(Limbs &limbs, uint32_t multiplier, uint32_t addend) {
+    uint64_t carry = addend;
+    for (uint32_t &limb : limbs) {
+        uint64_t product = (uint64_t) limb * multiplier + carry;
+        limb = (uint32_t) product;
+        carry = product >> 32;
+    }
+    if (carry != 0) {
+        limbs.push_back((uint32_t) carry);
+    }
+}
+
+}
+
+BigNumVal::BigNumVal(bool negative, std::vector<uint32_t> limbs) : Val(static_kind) {
+    this->negative = negative;
+    this->limbs = std::move(limbs);
+}
+
+Value BigNumVal::add_to(const Value &other_val) {
+    if (!is_number(other_val)) {
+        throw std::runtime_error("add to non-number");
+    }
+    return big_add(Value(THIS), other_val);
+}
+
+Value BigNumVal::mult_with(const Value &other_val) {
+    if (!is_number(other_val)) {
+        throw std::runtime_error("mult with non-number");
+    }
+    return big_mult(Value(THIS), other_val);
+}
+
+bool BigNumVal::equals(const Value &other_val) {
+    auto other_num = val_cast<BigNumVal>(other_val);
+    return other_num != nullptr && this->negative == other_num->negative && this->limbs == other_num->limbs;
+}
+
+// peels off nine decimal digits at a time by dividing by 10^9
+std::string BigNumVal::to_string() {
+    const uint32_t chunk = 1000000000;
+    Limbs rest = this->limbs;
+    std::vector<uint32_t> chunks;
+    while (!rest.empty()) {
+        uint64_t remainder = 0;
+        for (size_t i = rest.size(); i-- > 0;) {
+            uint64_t current = (remainder << 32) | rest[i];
+            rest[i] = (uint32_t) (current / chunk);
+            remainder = current % chunk;
+        }
+        chunks.push_back((uint32_t) remainder);
+        rest.resize(trimmed(rest.data(), rest.size()));
+    }
+    std::string out = this->negative ? "-" : "";
+    out += std::to_string(chunks.back());
+    for (size_t i = chunks.size() - 1; i-- > 0;) {
+        std::string digits = std::to_string(chunks[i]);
+        out.append(9 - digits.size(), '0');
+        out += digits;
+    }
+    return out;
+}
+
+bool BigNumVal::is_true() {
+    throw std::runtime_error("a num val cannot be interpreted as a bool val");
+}
+
+Value BigNumVal::call(const Value &actual_arg) {
+    throw std::runtime_error("cannot call on a num val");
+}
+
+bool is_number(const Value &value) {
+    return value.is_num() || val_cast<BigNumVal>(value) != nullptr;
+}
+
+Value big_add(const Value &a, const Value &b) {
+    Magnitude lhs(a);
+    Magnitude rhs(b);
+    if (lhs.negative == rhs.negative) {
+        return make_number(lhs.negative, add_magnitudes(lhs.limbs, lhs.size, rhs.limbs, rhs.size));
+    }
+    // opposite signs: the smaller magnitude comes off the larger, whose sign wins
+    const Magnitude *larger = &lhs;
+    const Magnitude *smaller = &rhs;
+    if (compare_magnitudes(lhs.limbs, lhs.size, rhs.limbs, rhs.size) < 0) {
+        std::swap(larger, smaller);
+    }
+    Limbs difference(larger->limbs, larger->limbs + larger->size);
+    subtract_in_place(difference, smaller->limbs, smaller->size);
+    return make_number(larger->negative, std::move(difference));
+}
+
+Value big_mult(const Value &a, const Value &b) {
+    Magnitude lhs(a);
+    Magnitude rhs(b);
+    return make_number(lhs.negative != rhs.negative, multiply_magnitudes(lhs.limbs, lhs.size, rhs.limbs, rhs.size));
+}
+
+size_t hash_number(const Value &number) {
+    if (number.is_num()) {
+        return std::hash<int64_t>()(number.as_num());
+    }
+    auto *big = val_cast<BigNumVal>(number);
+    size_t seed = big->negative ? 0x7f4a7c15u : 0x9e3779b9u;
+    for (uint32_t limb : big->limbs) {
+        seed ^= limb + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+}
+
+Value parse_number(std::string_view text) {
+    bool negative = !text.empty() && text[0] == '-';
+    std::string_view digits = negative ? text.substr(1) : text;
+    if (digits.empty() || !std::all_of(digits.begin(), digits.end(), [](char d) { return d >= '0' && d <= '9'; })) {
+        throw std::runtime_error("invalid number: " + std::string(text));
+    }
+    // 18 digits always fit in an immediate
+    if (digits.size() <= 18) {
+        int64_t num = 0;
+        for (char d : digits) {
+            num = num * 10 + (d - '0');
+        }
+        return Value::from_num(negative ? -num : num);
+    }
+    // nine digits at a time, the most 10^k that fits in a limb
+    Limbs limbs;
+    size_t at = 0;
+    size_t chunk_size = digits.size() % 9 == 0 ? 9 : digits.size() % 9;
+    while (at < digits.size()) {
+        uint32_t chunk = 0;
+        uint32_t scale = 1;
+        for (size_t i = 0; i < chunk_size; i++) {
+            chunk = chunk * 10 + (digits[at + i] - '0');
+            scale *= 10;
+        }
+        multiply_add(limbs, scale, chunk);
+        at += chunk_size;
+        chunk_size = 9;
+    }
+    return make_number(negative, std::move(limbs));
+}
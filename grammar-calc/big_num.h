@@ -0,0 +1,74 @@
+#ifndef BIG_NUM_H
+#define BIG_NUM_H
+
+#include "pointer.h"
+#include "val.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// a + b and a * b into result, true when the exact result does not fit; on
+// GCC and Clang this is the add/imul and the overflow flag of the hardware
+constexpr bool add_overflow(int64_t a, int64_t b, int64_t &result) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_add_overflow(a, b, &result);
+#else
+    result = (int64_t) ((uint64_t) a + (uint64_t) b);
+    return (a >= 0) == (b >= 0) && (result >= 0) != (a >= 0);
+#endif
+}
+
+constexpr bool mult_overflow(int64_t a, int64_t b, int64_t &result) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_mul_overflow(a, b, &result);
+#else
+    result = (int64_t) ((uint64_t) a * (uint64_t) b);
+    return a != 0 && (result / a != b || (a == -1 && b == INT64_MIN));
+#endif
+}
+
+// A number outside the range of int64_t, where Value's immediate numbers stop:
+// a sign and a magnitude in 32-bit limbs, least significant first, with no
+// leading zero limbs. Arithmetic only makes one when a result does not fit and
+// goes back to an immediate as soon as one does, so equal numbers always have
+// the same form.
+class BigNumVal : public Val {
+public:
+    static const val_kind_t static_kind = val_big_num;
+
+    bool negative;
+    std::vector<uint32_t> limbs;
+
+    BigNumVal(bool negative, std::vector<uint32_t> limbs);
+
+    Value add_to(const Value &other_val);
+
+    Value mult_with(const Value &other_val);
+
+    bool equals(const Value &other_val);
+
+    std::string to_string();
+
+    bool is_true();
+
+    Value call(const Value &actual_arg);
+};
+
+// an immediate or a BigNumVal
+bool is_number(const Value &value);
+
+// the exact sum and product of two numbers, whichever form they are in
+Value big_add(const Value &a, const Value &b);
+
+Value big_mult(const Value &a, const Value &b);
+
+// a number's hash, equal for equal numbers
+size_t hash_number(const Value &number);
+
+// decimal digits with an optional leading -, as the lexer scans them
+Value parse_number(std::string_view text);
+
+#endif // BIG_NUM_H
@@ -0,0 +1,205 @@
+#include "bytecode.h"
+#include "visitor.h"
+
+#include <ostream>
+#include <utility>
+
+namespace {
+
+struct Scope {
+    std::vector<std::pair<std::string, int>> bindings;
+    int frame_size = 0;
+};
+
+class Compiler : public ExprVisitor<Compiler, void> {
+public:
+    PTR(Program) program = NEW(Program)();
+    std::vector<Scope> scopes;
+
+    void emit(int32_t word) {
+        program->code.push_back(word);
+    }
+
+    size_t emit_jump(opcode_t op) {
+        emit(op);
+        emit(-1);
+        return program->code.size() - 1;
+    }
+
+    void patch_jump(size_t at) {
+        program->code[at] = (int32_t) program->code.size();
+    }
+
+    // slots are never reused within a frame, so a closure that captured the frame keeps seeing its bindings
+    int bind(const std::string &name) {
+        Scope &scope = scopes.back();
+        int slot = scope.frame_size++;
+        scope.bindings.emplace_back(name, slot);
+        return slot;
+    }
+
+    void emit_variable(const std::string &name) {
+        for (int depth = 0; depth < (int) scopes.size(); depth++) {
+            const Scope &scope = scopes[scopes.size() - 1 - depth];
+            for (auto it = scope.bindings.rbegin(); it != scope.bindings.rend(); ++it) {
+                if (it->first == name) {
+                    emit(op_load);
+                    emit(depth);
+                    emit(it->second);
+                    return;
+                }
+            }
+        }
+        // interp only reports a free variable once it is reached, keep that behavior
+        emit(op_free);
+        emit((int32_t) program->names.size());
+        program->names.push_back(name);
+    }
+
+    void visit_num(NumExpr *num) {
+        const Value &val = num->val;
+        if (val.is_num() && val.as_num() >= INT32_MIN && val.as_num() <= INT32_MAX) {
+            emit(op_num);
+            emit((int32_t) val.as_num());
+            return;
+        }
+        emit(op_const);
+        emit((int32_t) program->constants.size());
+        program->constants.push_back(val);
+    }
+
+    void visit_bool(BoolExpr *boolean) {
+        emit(op_bool);
+        emit(boolean->rep ? 1 : 0);
+    }
+
+    void visit_add(AddExpr *add) {
+        visit(add->lhs);
+        visit(add->rhs);
+        emit(op_add);
+    }
+
+    void visit_mult(MultExpr *mult) {
+        visit(mult->lhs);
+        visit(mult->rhs);
+        emit(op_mult);
+    }
+
+    void visit_eq(EqExpr *eq) {
+        visit(eq->lhs);
+        visit(eq->rhs);
+        emit(op_eq);
+    }
+
+    void visit_var(VarExpr *var) {
+        emit_variable(var->variable);
+    }
+
+    void visit_let(LetExpr *let) {
+        visit(let->rhs);
+        size_t bindings_before = scopes.back().bindings.size();
+        emit(op_store);
+        emit(bind(let->lhs));
+        visit(let->body);
+        scopes.back().bindings.resize(bindings_before);
+    }
+
+    void visit_if(IfExpr *if_expr) {
+        visit(if_expr->condition);
+        size_t to_else = emit_jump(op_jump_if_false);
+        visit(if_expr->then_expr);
+        size_t to_end = emit_jump(op_jump);
+        patch_jump(to_else);
+        visit(if_expr->else_expr);
+        patch_jump(to_end);
+    }
+
+    void visit_call(CallExpr *call) {
+        visit(call->to_be_called);
+        visit(call->actual_arg);
+        emit(op_call);
+    }
+
+    void visit_fun(FunExpr *fun) {
+        size_t skip_body = emit_jump(op_jump);
+        size_t proto_index = program->protos.size();
+        program->protos.push_back(FunProto{fun->formal_arg, fun->body, 0, program->code.size()});
+
+        scopes.emplace_back();
+        bind(fun->formal_arg);
+        visit(fun->body);
+        emit(op_return);
+        program->protos[proto_index].frame_size = scopes.back().frame_size;
+        scopes.pop_back();
+
+        patch_jump(skip_body);
+        emit(op_closure);
+        emit((int32_t) proto_index);
+    }
+};
+
+}
+
+PTR(Program) compile(PTR(Expr) expr) {
+    Compiler compiler;
+    compiler.scopes.emplace_back();
+    compiler.visit(expr);
+    compiler.emit(op_return);
+    compiler.program->main_frame_size = compiler.scopes.back().frame_size;
+    return compiler.program;
+}
+
+void Program::disassemble(std::ostream &out) {
+    size_t pc = 0;
+    while (pc < this->code.size()) {
+        out << pc << "\t";
+        switch (this->code[pc++]) {
+            case op_num:
+                out << "num " << this->code[pc++];
+                break;
+            case op_const:
+                out << "const " << this->constants[this->code[pc++]].to_string();
+                break;
+            case op_bool:
+                out << "bool " << (this->code[pc++] ? "_true" : "_false");
+                break;
+            case op_load:
+                out << "load " << this->code[pc] << " " << this->code[pc + 1];
+                pc += 2;
+                break;
+            case op_free:
+                out << "free " << this->names[this->code[pc++]];
+                break;
+            case op_store:
+                out << "store " << this->code[pc++];
+                break;
+            case op_add:
+                out << "add";
+                break;
+            case op_mult:
+                out << "mult";
+                break;
+            case op_eq:
+                out << "eq";
+                break;
+            case op_jump:
+                out << "jump " << this->code[pc++];
+                break;
+            case op_jump_if_false:
+                out << "jump_if_false " << this->code[pc++];
+                break;
+            case op_closure:
+                out << "closure " << this->protos[this->code[pc++]].formal_arg;
+                break;
+            case op_call:
+                out << "call";
+                break;
+            case op_return:
+                out << "return";
+                break;
+            default:
+                out << "???";
+        }
+        out << "\n";
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+class Expr;
+
+#include "pointer.h"
+#include "val.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// every instruction is an opcode followed by its operands, all stored as int32_t
+enum opcode_t : int32_t {
+    op_num,            // value, for numbers that fit in an int32_t
+    op_const,          // constant index, for the other numbers
+    op_bool,           // 0 | 1
+    op_load,           // depth slot
+    op_free,           // name index, throws when reached
+    op_store,          // slot
+    op_add,
+    op_mult,
+    op_eq,
+    op_jump,           // target
+    op_jump_if_false,  // target
+    op_closure,        // proto index
+    op_call,
+    op_return,
+};
+
+struct FunProto {
+    std::string formal_arg;
+    PTR(Expr) body;
+    int frame_size;
+    size_t entry;
+};
+
+CLASS(Program) {
+public:
+    std::vector<int32_t> code;
+    std::vector<FunProto> protos;
+    std::vector<std::string> names;
+    std::vector<Value> constants;
+    int main_frame_size = 0;
+
+    void disassemble(std::ostream &out);
+};
+
+PTR(Program) compile(PTR(Expr) expr);
+
+#endif // BYTECODE_H
@@ -0,0 +1,188 @@
+#include "cek.h"
+#include "expr.hpp"
+#include "env.h"
+#include "eval_context.h"
+
+#include <utility>
+#include <vector>
+
+namespace {
+
+enum continuation_kind_t : uint8_t {
+    then_add_rhs,
+    then_add,
+    then_mult_rhs,
+    then_mult,
+    then_eq_rhs,
+    then_eq,
+    then_let_body,
+    then_if_branch,
+    then_call_arg,
+    then_call,
+};
+
+// expr is a raw pointer: every body we can reach is owned by the root
+// expression or by a closure reachable from the initial env, both of
+// which outlive the evaluation
+struct Continuation {
+    continuation_kind_t kind;
+    Expr *expr;
+    PTR(Env) env;
+    Value val;
+};
+
+}
+
+Value cek_interp(PTR(Expr) expr, PTR(Env) env, size_t memory_budget) {
+    if (env == nullptr) {
+        env = Env::empty;
+    }
+    const size_t max_continuations = memory_budget / sizeof(Continuation);
+    std::vector<Continuation> continuations;
+
+    Expr *control = expr.get();
+    Value val;
+
+    auto push = [&](continuation_kind_t kind, Expr *next, const PTR(Env) &next_env, Value pending) {
+        if (continuations.size() >= max_continuations) {
+            throw std::runtime_error("evaluation exceeded its memory budget");
+        }
+        continuations.push_back(Continuation{kind, next, next_env, std::move(pending)});
+    };
+
+    while (true) {
+        // evaluate control in env until it produces a value
+        bool evaluating = true;
+        while (evaluating) {
+            switch (control->kind) {
+                case expr_add: {
+                    auto *add = static_cast<AddExpr *>(control);
+                    push(then_add_rhs, add->rhs.get(), env, Value());
+                    control = add->lhs.get();
+                    break;
+                }
+                case expr_mult: {
+                    auto *mult = static_cast<MultExpr *>(control);
+                    push(then_mult_rhs, mult->rhs.get(), env, Value());
+                    control = mult->lhs.get();
+                    break;
+                }
+                case expr_eq: {
+                    auto *eq = static_cast<EqExpr *>(control);
+                    push(then_eq_rhs, eq->rhs.get(), env, Value());
+                    control = eq->lhs.get();
+                    break;
+                }
+                case expr_let: {
+                    auto *let = static_cast<LetExpr *>(control);
+                    push(then_let_body, let, env, Value());
+                    control = let->rhs.get();
+                    break;
+                }
+                case expr_if: {
+                    auto *if_expr = static_cast<IfExpr *>(control);
+                    push(then_if_branch, if_expr, env, Value());
+                    control = if_expr->condition.get();
+                    break;
+                }
+                case expr_call: {
+                    auto *call = static_cast<CallExpr *>(control);
+                    push(then_call_arg, call->actual_arg.get(), env, Value());
+                    control = call->to_be_called.get();
+                    break;
+                }
+                default:
+                    // numbers, booleans, variables and functions never recurse
+                    val = control->interp(env);
+                    evaluating = false;
+            }
+        }
+
+        // hand val to the innermost continuation until one of them needs more evaluation
+        while (evaluating == false) {
+            if (continuations.empty()) {
+                return val;
+            }
+            Continuation k = std::move(continuations.back());
+            continuations.pop_back();
+            switch (k.kind) {
+                case then_add_rhs:
+                    push(then_add, nullptr, nullptr, std::move(val));
+                    control = k.expr;
+                    env = std::move(k.env);
+                    evaluating = true;
+                    break;
+                case then_add:
+                    val = k.val.add_to(val);
+                    break;
+                case then_mult_rhs:
+                    push(then_mult, nullptr, nullptr, std::move(val));
+                    control = k.expr;
+                    env = std::move(k.env);
+                    evaluating = true;
+                    break;
+                case then_mult:
+                    val = k.val.mult_with(val);
+                    break;
+                case then_eq_rhs:
+                    push(then_eq, nullptr, nullptr, std::move(val));
+                    control = k.expr;
+                    env = std::move(k.env);
+                    evaluating = true;
+                    break;
+                case then_eq:
+                    val = Value::from_bool(k.val.equals(val));
+                    break;
+                case then_let_body: {
+                    auto *let = static_cast<LetExpr *>(k.expr);
+                    if (let->slot >= 0) {
+                        static_cast<FrameEnv *>(k.env.get())->slots[let->slot] = std::move(val);
+                        env = std::move(k.env);
+                    } else {
+                        env = NEW(ExtendedEnv)(let->lhs, std::move(val), std::move(k.env));
+                    }
+                    control = let->body.get();
+                    evaluating = true;
+                    break;
+                }
+                case then_if_branch: {
+                    auto *if_expr = static_cast<IfExpr *>(k.expr);
+                    control = val.is_true() ? if_expr->then_expr.get() : if_expr->else_expr.get();
+                    env = std::move(k.env);
+                    evaluating = true;
+                    break;
+                }
+                case then_call_arg:
+                    push(then_call, nullptr, nullptr, std::move(val));
+                    control = k.expr;
+                    env = std::move(k.env);
+                    evaluating = true;
+                    break;
+                case then_call: {
+                    auto *fun = val_cast<FunVal>(k.val);
+                    if (fun == nullptr) {
+                        // numbers and booleans throw here, other closure kinds run their own evaluator
+                        val = k.val.call(val);
+                        break;
+                    }
+                    if (EvalContext *context = EvalContext::current()) {
+                        context->tick();
+                        context->check_depth(continuations.size());
+                    }
+                    // the body replaces the call without pushing anything: tail calls run in constant space
+                    if (fun->frame_size >= 0) {
+                        PTR(FrameEnv) frame = NEW(FrameEnv)(fun->frame_size,
+                                                            std::static_pointer_cast<FrameEnv>(fun->env));
+                        frame->slots[0] = std::move(val);
+                        env = frame;
+                    } else {
+                        env = NEW(ExtendedEnv)(fun->formal_arg, std::move(val), fun->env);
+                    }
+                    control = fun->body.get();
+                    evaluating = true;
+                    break;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef CEK_H
+#define CEK_H
+
+class Expr;
+class Env;
+
+#include "pointer.h"
+#include "val.hpp"
+#include <cstddef>
+
+const size_t cek_default_memory_budget = 256 * 1024 * 1024;
+
+// Evaluates like expr->interp(env), but keeps the continuation on the heap
+// instead of the C++ stack. Calls in tail position (the branches of an
+// _if, the body of a _let, a function body) don't grow the continuation,
+// so iterative scripts run in constant space. Deep non-tail recursion
+// throws a runtime_error once the continuation would exceed memory_budget
+// bytes.
+Value cek_interp(PTR(Expr) expr, PTR(Env) env = nullptr, size_t memory_budget = cek_default_memory_budget);
+
+#endif // CEK_H
@@ -0,0 +1,382 @@
+#include "engine.h"
+#include "ast_cache.h"
+#include "parse.h"
+#include "expr.hpp"
+#include "eval_context.h"
+#include "jit.h"
+#include "memo.h"
+#include "hash_cons.h"
+#include "optimize.h"
+#include "expr_stream.h"
+#include "pretty_print.h"
+#include "profile.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Headless batch evaluator: every non-blank input line (or delimited record) is
+// one expression. Input is streamed a batch of records at a time; each batch is
+// evaluated (or pretty printed) by a pool of worker threads and the results are
+// written one per line, in input order, as soon as each is ready.
+
+namespace {
+
+struct Options {
+    bool pretty_print = false;
+    // 0 for the classic layout
+    size_t max_width = 0;
+    engine_t engine = engine_tree_interp;
+    parser_t parser = parser_recursive_descent;
+    unsigned jobs = 0;
+    // 0 leaves memoization off, otherwise the number of cached calls per expression
+    size_t memo_entries = 0;
+    bool hash_cons = false;
+    bool optimize = false;
+    char delimiter = '\n';
+    // --ast-cache DIR and --ast-cache-size MB; the cache is made from them once the options are read
+    std::string ast_cache_dir;
+    uint64_t ast_cache_max_bytes = AstCache::default_max_bytes;
+    std::shared_ptr<AstCache> ast_cache;
+    // --profile FILE: collapsed stacks of every expression go there
+    std::string profile_path;
+    // per expression
+    EvalLimits limits;
+    // calls before a function body is compiled to native code, 0 for never
+    uint32_t jit_threshold = ::jit_threshold();
+    std::vector<std::string> files;
+};
+
+// lines are handed out in chunks so workers rarely touch the shared counter
+const size_t chunk_size = 16;
+
+// records held in memory at once, whatever the size of the input
+const size_t batch_size = 1 << 16;
+
+void usage(std::ostream &out) {
+    out << "usage: grammar-calc-cli [--interp | --pretty-print] [--engine tree|resolved|flat|cek|vm|parallel]\n"
+           "                        [--parser recursive|iterative] [--jobs N] [--memo ENTRIES] [--hash-cons]\n"
+           "                        [--optimize] [--delimiter CHAR] [--max-width N] [--ast-cache DIR]\n"
+           "                        [--ast-cache-size MB] [--profile FILE] [--max-steps N] [--max-depth N]\n"
+           "                        [--timeout MS] [--max-allocations N] [--jit-threshold N] [file ...]\n"
+           "reads one expression per line (or per CHAR-terminated record) from the files,\n"
+           "or from stdin when none (or -) is given\n";
+}
+
+bool parse_engine(const std::string &name, engine_t &engine) {
+    const std::pair<const char *, engine_t> engines[] = {
+        {"tree", engine_tree_interp},
+        {"resolved", engine_resolved_interp},
+        {"flat", engine_flat_interp},
+        {"cek", engine_cek_machine},
+        {"vm", engine_bytecode_vm},
+        {"parallel", engine_parallel},
+    };
+    for (const auto &entry : engines) {
+        if (name == entry.first) {
+            engine = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--interp") {
+            options.pretty_print = false;
+        } else if (arg == "--pretty-print") {
+            options.pretty_print = true;
+        } else if (arg == "--engine" && has_value) {
+            if (!parse_engine(argv[++i], options.engine)) {
+                return false;
+            }
+        } else if (arg == "--parser" && has_value) {
+            std::string parser = argv[++i];
+            if (parser == "recursive") {
+                options.parser = parser_recursive_descent;
+            } else if (parser == "iterative") {
+                options.parser = parser_iterative;
+            } else {
+                return false;
+            }
+        } else if (arg == "--jobs" && has_value) {
+            int jobs = std::atoi(argv[++i]);
+            if (jobs <= 0) {
+                return false;
+            }
+            options.jobs = jobs;
+        } else if (arg == "--optimize") {
+            options.optimize = true;
+        } else if (arg == "--hash-cons") {
+            options.hash_cons = true;
+        } else if (arg == "--max-width" && has_value) {
+            long width = std::atol(argv[++i]);
+            if (width <= 0) {
+                return false;
+            }
+            options.max_width = width;
+        } else if (arg == "--delimiter" && has_value) {
+            std::string delimiter = argv[++i];
+            if (delimiter.size() != 1) {
+                return false;
+            }
+            options.delimiter = delimiter[0];
+        } else if (arg == "--ast-cache" && has_value) {
+            options.ast_cache_dir = argv[++i];
+        } else if (arg == "--ast-cache-size" && has_value) {
+            options.ast_cache_max_bytes = std::strtoull(argv[++i], nullptr, 10) << 20;
+        } else if (arg == "--max-steps" && has_value) {
+            options.limits.max_steps = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--max-depth" && has_value) {
+            options.limits.max_depth = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--timeout" && has_value) {
+            options.limits.timeout = std::chrono::milliseconds(std::strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--max-allocations" && has_value) {
+            options.limits.max_allocations = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--jit-threshold" && has_value) {
+            options.jit_threshold = (uint32_t) std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--profile" && has_value) {
+            options.profile_path = argv[++i];
+        } else if (arg == "--memo" && has_value) {
+            long entries = std::atol(argv[++i]);
+            if (entries <= 0) {
+                return false;
+            }
+            options.memo_entries = entries;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;
+        } else {
+            options.files.push_back(arg);
+        }
+    }
+    return true;
+}
+
+// filled by any worker, drained strictly in input order by one writer
+class OrderedOutput {
+public:
+    explicit OrderedOutput(size_t count) : results(count), ready(count, false) {}
+
+    void put(size_t index, std::string result) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->results[index] = std::move(result);
+        this->ready[index] = true;
+        if (index == this->next) {
+            this->became_ready.notify_one();
+        }
+    }
+
+    void drain(std::ostream &out) {
+        for (size_t index = 0; index < this->results.size(); index++) {
+            std::string result;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->next = index;
+                this->became_ready.wait(lock, [&] { return this->ready[index]; });
+                result = std::move(this->results[index]);
+            }
+            out << result << '\n';
+        }
+        out.flush();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable became_ready;
+    std::vector<std::string> results;
+    std::vector<bool> ready;
+    size_t next = 0;
+};
+
+// memo is cleared before each line: a cache only lives as long as one expression's trees;
+// with a profiler the expression is evaluated by it instead of the chosen engine
+std::string run_line(const std::string &line, const Options &options, MemoCache *memo, Profiler *profiler,
+                     OptimizeStats &optimized, bool &failed) {
+    EvalContext context;
+    context.set_limits(options.limits);
+    if (memo != nullptr) {
+        memo->clear();
+        context.memo = memo;
+    }
+    EvalScope scope(&context);
+    try {
+        if (options.ast_cache != nullptr && options.engine == engine_flat_interp && !options.optimize
+            && !options.pretty_print && profiler == nullptr) {
+            // the flat engine runs the cached arrays as they are, no tree is built
+            return options.ast_cache->parse_flat(line, options.parser)->interp().to_string();
+        }
+        ExprFactory factory;
+        ExprFactory *shared = options.hash_cons ? &factory : nullptr;
+        // cached trees have no source positions, which the profile needs
+        PTR(Expr) expr = options.ast_cache != nullptr && profiler == nullptr
+                             ? options.ast_cache->parse(line, options.parser, shared)
+                             : parse_expression_str(line, options.parser, shared);
+        if (options.optimize) {
+            expr = optimize(expr, OptimizeOptions(), &optimized);
+        }
+        if (options.pretty_print) {
+            return pretty_print_to_string(expr, PrettyPrintOptions{options.max_width});
+        }
+        if (profiler != nullptr) {
+            return profiler->interp(expr).to_string();
+        }
+        return interp_with(expr, options.engine).to_string();
+    } catch (const std::exception &e) {
+        // not only runtime_error: this runs on a worker thread, where anything
+        // uncaught (bad_alloc, length_error, ...) would end the whole batch
+        failed = true;
+        return std::string("error: ") + e.what();
+    }
+}
+
+// what the batches add up to, reported at the end
+struct Totals {
+    std::mutex mutex;
+    MemoStats memo;
+    OptimizeStats optimized;
+    std::atomic<bool> any_failed{false};
+    // open when profiling, written under mutex
+    std::ofstream profile;
+    // records in the batches before this one
+    size_t records = 0;
+};
+
+// evaluates lines on jobs threads and writes their results in input order
+void run_batch(const std::vector<std::string> &lines, const Options &options, unsigned jobs, Totals &totals,
+               std::ostream &out) {
+    OrderedOutput output(lines.size());
+    std::atomic<size_t> next_line{0};
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; i++) {
+        workers.emplace_back([&] {
+            std::unique_ptr<MemoCache> memo;
+            if (options.memo_entries > 0) {
+                memo.reset(new MemoCache(options.memo_entries));
+            }
+            MemoStats stats;
+            OptimizeStats optimized;
+            while (true) {
+                size_t begin = next_line.fetch_add(chunk_size, std::memory_order_relaxed);
+                if (begin >= lines.size()) {
+                    break;
+                }
+                size_t end = std::min(begin + chunk_size, lines.size());
+                for (size_t index = begin; index < end; index++) {
+                    bool failed = false;
+                    std::unique_ptr<Profiler> profiler;
+                    if (!options.profile_path.empty()) {
+                        profiler.reset(new Profiler(lines[index]));
+                    }
+                    output.put(index, run_line(lines[index], options, memo.get(), profiler.get(), optimized, failed));
+                    if (profiler != nullptr) {
+                        std::string root = "expression " + std::to_string(totals.records + index + 1);
+                        std::string stacks = profiler->collapsed_stacks(root);
+                        std::lock_guard<std::mutex> lock(totals.mutex);
+                        totals.profile << stacks;
+                    }
+                    if (memo != nullptr) {
+                        MemoStats line_stats = memo->stats();
+                        stats.hits += line_stats.hits;
+                        stats.misses += line_stats.misses;
+                        stats.evictions += line_stats.evictions;
+                    }
+                    if (failed) {
+                        totals.any_failed.store(true, std::memory_order_relaxed);
+                    }
+                }
+            }
+            std::lock_guard<std::mutex> lock(totals.mutex);
+            totals.memo.hits += stats.hits;
+            totals.memo.misses += stats.misses;
+            totals.memo.evictions += stats.evictions;
+            totals.optimized.folded += optimized.folded;
+            totals.optimized.branches_pruned += optimized.branches_pruned;
+            totals.optimized.lets_inlined += optimized.lets_inlined;
+            totals.optimized.dead_lets_removed += optimized.dead_lets_removed;
+        });
+    }
+
+    output.drain(out);
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    totals.records += lines.size();
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage(std::cerr);
+        return 2;
+    }
+
+    set_jit_threshold(options.jit_threshold);
+    if (!options.ast_cache_dir.empty()) {
+        options.ast_cache = std::make_shared<AstCache>(options.ast_cache_dir, AstCache::default_min_source_size,
+                                                       options.ast_cache_max_bytes);
+    }
+    if (options.files.empty()) {
+        options.files.push_back("-");
+    }
+    unsigned jobs = options.jobs;
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::ios::sync_with_stdio(false);
+    Totals totals;
+    if (!options.profile_path.empty()) {
+        totals.profile.open(options.profile_path);
+        if (!totals.profile) {
+            std::cerr << "cannot open " << options.profile_path << "\n";
+            return 2;
+        }
+    }
+    std::vector<std::string> batch;
+    for (const std::string &file : options.files) {
+        std::unique_ptr<ExprReader> reader;
+        try {
+            reader.reset(file == "-" ? new ExprReader(std::cin, options.delimiter)
+                                     : new ExprReader(file, options.delimiter));
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << "\n";
+            return 2;
+        }
+        std::string_view record;
+        while (reader->next(record)) {
+            batch.emplace_back(record);
+            if (batch.size() == batch_size) {
+                run_batch(batch, options, jobs, totals, std::cout);
+                batch.clear();
+            }
+        }
+    }
+    run_batch(batch, options, jobs, totals, std::cout);
+
+    if (options.memo_entries > 0) {
+        std::cerr << "memo: " << totals.memo.hits << " hits, " << totals.memo.misses << " misses, "
+                  << totals.memo.evictions << " evictions\n";
+    }
+    if (options.ast_cache != nullptr) {
+        std::cerr << "ast cache: " << options.ast_cache->hits() << " hits, " << options.ast_cache->misses()
+                  << " misses\n";
+    }
+    if (options.optimize) {
+        std::cerr << "optimizer: " << totals.optimized.folded << " folded, " << totals.optimized.branches_pruned
+                  << " branches pruned, " << totals.optimized.lets_inlined << " lets inlined, "
+                  << totals.optimized.dead_lets_removed << " dead lets removed\n";
+    }
+    return totals.any_failed ? 1 : 0;
+}
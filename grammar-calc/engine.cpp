@@ -0,0 +1,24 @@
+#include "engine.h"
+#include "expr.hpp"
+#include "vm.h"
+#include "resolve.h"
+#include "flat_ast.h"
+#include "cek.h"
+#include "parallel.h"
+
+Value interp_with(const PTR(Expr) &expr, engine_t engine) {
+    switch (engine) {
+        case engine_bytecode_vm:
+            return vm_interp(expr);
+        case engine_resolved_interp:
+            return resolve(expr)->interp();
+        case engine_flat_interp:
+            return flatten(expr)->interp();
+        case engine_cek_machine:
+            return cek_interp(expr);
+        case engine_parallel:
+            return parallel_interp(expr);
+        default:
+            return expr->interp();
+    }
+}
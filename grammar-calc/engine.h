@@ -0,0 +1,21 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+class Expr;
+
+#include "pointer.h"
+#include "val.hpp"
+
+enum engine_t {
+    engine_tree_interp,
+    engine_resolved_interp,
+    engine_flat_interp,
+    engine_cek_machine,
+    engine_bytecode_vm,
+    engine_parallel,
+};
+
+// evaluates expr with the given engine; expr is only read, so one tree can be run from several threads
+Value interp_with(const PTR(Expr) &expr, engine_t engine);
+
+#endif // ENGINE_H
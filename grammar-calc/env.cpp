@@ -1,26 +1,80 @@
 #include <utility>
 #include "val.hpp"
 #include "env.h"
+#include "eval_context.h"
 
-PTR(Env) Env::empty = NEW(EmptyEnv)();
+static EmptyEnv empty_env;
 
+const PTR(Env) Env::empty = PTR(Env)(PTR(Env)(), &empty_env);
 
-PTR(Val) EmptyEnv::lookup(std::string matcher) {
+
+Value EmptyEnv::lookup(const std::string &matcher) {
     throw std::runtime_error("free variable: "
                              + matcher);
 }
 
+const Value *EmptyEnv::find(const std::string &matcher) {
+    return nullptr;
+}
+
 
-ExtendedEnv::ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) rest) {
+ExtendedEnv::ExtendedEnv(std::string name, Value val, PTR(Env) rest) {
+    eval_allocate();
     this->name = std::move(name);
     this->val = std::move(val);
     this->rest = std::move(rest);
 }
 
-PTR(Val) ExtendedEnv::lookup(std::string matcher) {
+Value ExtendedEnv::lookup(const std::string &matcher) {
     if (matcher == this->name) {
         return this->val;
     } else {
         return this->rest->lookup(matcher);
     }
 }
+
+const Value *ExtendedEnv::find(const std::string &matcher) {
+    if (matcher == this->name) {
+        return &this->val;
+    } else {
+        return this->rest->find(matcher);
+    }
+}
+
+
+ClosureEnv::ClosureEnv(PTR(const std::vector<std::string>) names) : vals(names->size()) {
+    eval_allocate();
+    this->names = std::move(names);
+}
+
+Value ClosureEnv::lookup(const std::string &matcher) {
+    const Value *val = this->find(matcher);
+    if (val == nullptr) {
+        throw std::runtime_error("free variable: " + matcher);
+    }
+    return *val;
+}
+
+const Value *ClosureEnv::find(const std::string &matcher) {
+    for (size_t i = 0; i < this->vals.size(); i++) {
+        if ((*this->names)[i] == matcher) {
+            return &this->vals[i];
+        }
+    }
+    return nullptr;
+}
+
+
+FrameEnv::FrameEnv(int size, PTR(FrameEnv) parent) : slots(size) {
+    eval_allocate();
+    this->parent = std::move(parent);
+}
+
+Value FrameEnv::lookup(const std::string &matcher) {
+    throw std::runtime_error("unresolved variable: "
+                             + matcher);
+}
+
+const Value *FrameEnv::find(const std::string &matcher) {
+    return nullptr;
+}
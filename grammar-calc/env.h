@@ -5,14 +5,43 @@
 #pragma once
 
 #include "pointer.h"
+#include "val.hpp"
 #include <string>
+#include <vector>
 
-class Val;
+// A fixed number of Values, the first few stored in the object itself, so the
+// small frames and closures most programs make cost one allocation, not two
+class ValueArray {
+public:
+    explicit ValueArray(size_t size) : count(size) {
+        if (size > inline_capacity) {
+            this->more.resize(size - inline_capacity);
+        }
+    }
+
+    Value &operator[](size_t i) {
+        return i < inline_capacity ? this->inline_vals[i] : this->more[i - inline_capacity];
+    }
+
+    size_t size() const {
+        return this->count;
+    }
+
+private:
+    static const size_t inline_capacity = 3;
+
+    size_t count;
+    Value inline_vals[inline_capacity];
+    std::vector<Value> more;
+};
 
 CLASS(Env) {
 public:
-    static PTR(Env) empty;
-    virtual PTR(Val) lookup(std::string find_name) = 0;
+    // shared by every thread; it owns no reference count, so copying it never contends
+    static const PTR(Env) empty;
+    virtual Value lookup(const std::string &find_name) = 0;
+    // the value bound to find_name, or nullptr when there is none
+    virtual const Value *find(const std::string &find_name) = 0;
     virtual ~Env() = default;
 };
 
@@ -20,18 +49,59 @@ class EmptyEnv : public Env {
 public:
     EmptyEnv() = default;
 
-    PTR(Val) lookup(std::string matcher);
+    Value lookup(const std::string &matcher);
+
+    const Value *find(const std::string &matcher);
 };
 
 class ExtendedEnv : public Env {
 public:
     std::string name;
-    PTR(Val) val;
+    Value val;
     PTR(Env) rest;
 
-    ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) rest);
+    ExtendedEnv(std::string name, Value val, PTR(Env) rest);
+
+    Value lookup(const std::string &matcher);
+
+    const Value *find(const std::string &matcher);
+};
+
+// what a closure keeps of the environment it was created in: the values of
+// only the variables its body reads, side by side (see FunExpr::interp)
+class ClosureEnv : public Env {
+public:
+    // shared by the closures of one FunExpr
+    PTR(const std::vector<std::string>) names;
+    ValueArray vals;
+
+    // vals starts out as 0s, to be filled in
+    explicit ClosureEnv(PTR(const std::vector<std::string>) names);
+
+    Value lookup(const std::string &matcher);
+
+    const Value *find(const std::string &matcher);
+};
+
+// environment for resolved expressions: one frame per call, variables addressed by (depth, slot)
+class FrameEnv : public Env {
+public:
+    PTR(FrameEnv) parent;
+    ValueArray slots;
+
+    FrameEnv(int size, PTR(FrameEnv) parent);
+
+    Value lookup(const std::string &matcher);
+
+    const Value *find(const std::string &matcher);
 
-    PTR(Val) lookup(std::string matcher);
+    Value lookup(int depth, int slot) {
+        FrameEnv *frame = this;
+        for (; depth > 0; depth--) {
+            frame = frame->parent.get();
+        }
+        return frame->slots[slot];
+    }
 };
 
 #endif // ENV_H
@@ -0,0 +1,246 @@
+#ifndef EVAL_CONTEXT_H
+#define EVAL_CONTEXT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+class MemoCache;
+
+// thrown out of an evaluation whose context has been cancelled
+class EvalCancelled : public std::runtime_error {
+public:
+    EvalCancelled() : std::runtime_error("evaluation cancelled") {}
+};
+
+// thrown out of an evaluation that went over one of its context's EvalLimits
+class EvalLimitError : public std::runtime_error {
+public:
+    explicit EvalLimitError(const std::string &message) : std::runtime_error(message) {}
+};
+
+// what one evaluation may use; 0 leaves that resource unlimited
+struct EvalLimits {
+    // function calls, as counted by EvalContext::steps()
+    uint64_t max_steps = 0;
+    // function calls in progress at once on one thread (for the CEK machine,
+    // which runs tail calls in constant space, pending continuations instead)
+    uint64_t max_depth = 0;
+    // wall-clock time from set_limits on, checked every clock_interval steps
+    std::chrono::milliseconds timeout{0};
+    // environments, closures and other heap values created
+    uint64_t max_allocations = 0;
+};
+
+// Shared between the thread running an evaluation and whoever is watching it.
+// Every engine ticks once per function call: the tick counts a step and is
+// where a cancel request, the step budget and the deadline take effect.
+// Call depth and allocations are checked where calls start and heap values
+// and environments are made. With no limits set each check is one compare.
+class EvalContext {
+public:
+    // when set, FunVal calls are answered from and recorded in this cache
+    MemoCache *memo = nullptr;
+
+    // steps between two looks at the clock when there is a deadline
+    static const uint64_t clock_interval = 1024;
+
+    // call before the evaluation starts; the timeout counts from here
+    void set_limits(const EvalLimits &limits) {
+        this->limits = limits;
+        this->step_limit = limits.max_steps > 0 ? limits.max_steps : unlimited;
+        this->depth_limit = limits.max_depth > 0 ? limits.max_depth : unlimited;
+        this->allocation_limit = limits.max_allocations > 0 ? limits.max_allocations : unlimited;
+        this->deadline = std::chrono::steady_clock::now() + limits.timeout;
+        this->next_check.store(this->next_check_after(this->steps()), std::memory_order_relaxed);
+    }
+
+
+    void cancel() {
+        this->cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    bool is_cancelled() const {
+        return this->cancelled.load(std::memory_order_relaxed);
+    }
+
+    uint64_t steps() const {
+        return this->step_count.load(std::memory_order_relaxed);
+    }
+
+    void tick() {
+        // only the evaluating thread writes, so no read-modify-write is needed
+        uint64_t steps = this->step_count.load(std::memory_order_relaxed) + 1;
+        this->step_count.store(steps, std::memory_order_relaxed);
+        if (steps >= this->next_check.load(std::memory_order_relaxed) || this->is_cancelled()) {
+            this->check(steps);
+        }
+    }
+
+    // for evaluations that tick from several threads at once
+    void tick_shared() {
+        uint64_t steps = this->step_count.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (steps >= this->next_check.load(std::memory_order_relaxed) || this->is_cancelled()) {
+            this->check(steps);
+        }
+    }
+
+    // for engines that keep their own call stack: throws if depth calls, on top
+    // of those CallDepth counts on this thread, would be too many
+    void check_depth(uint64_t depth) const {
+        if (call_depth + depth > this->depth_limit) {
+            throw EvalLimitError("call depth limit of " + std::to_string(this->limits.max_depth) + " exceeded");
+        }
+    }
+
+    // counts one heap value or environment, only when there is a limit to
+    // enforce; may be called from several threads
+    void allocate() {
+        if (this->allocation_limit == unlimited) {
+            return;
+        }
+        if (this->allocation_count.fetch_add(1, std::memory_order_relaxed) >= this->allocation_limit) {
+            throw EvalLimitError("allocation limit of " + std::to_string(this->limits.max_allocations)
+                                 + " exceeded");
+        }
+    }
+
+    // the context of the evaluation running on this thread, or nullptr
+    static EvalContext *current() {
+        return current_context;
+    }
+
+private:
+    static const uint64_t unlimited = std::numeric_limits<uint64_t>::max();
+
+    std::atomic<bool> cancelled{false};
+    std::atomic<uint64_t> step_count{0};
+    std::atomic<uint64_t> allocation_count{0};
+
+    EvalLimits limits;
+    uint64_t step_limit = unlimited;
+    uint64_t depth_limit = unlimited;
+    uint64_t allocation_limit = unlimited;
+    std::chrono::steady_clock::time_point deadline;
+    // the step at which tick looks at the limits again
+    std::atomic<uint64_t> next_check{unlimited};
+
+    static inline thread_local EvalContext *current_context = nullptr;
+    // calls in progress on this thread, kept by CallDepth
+    static inline thread_local uint64_t call_depth = 0;
+
+    uint64_t next_check_after(uint64_t steps) const {
+        if (this->limits.timeout.count() > 0 && this->step_limit - steps > clock_interval) {
+            return steps + clock_interval;
+        }
+        return this->step_limit == unlimited ? unlimited : this->step_limit + 1;
+    }
+
+    // the slow path of tick, taken when cancelled or at next_check
+    void check(uint64_t steps) {
+        if (this->is_cancelled()) {
+            throw EvalCancelled();
+        }
+        if (steps > this->step_limit) {
+            throw EvalLimitError("step limit of " + std::to_string(this->limits.max_steps) + " exceeded");
+        }
+        if (this->limits.timeout.count() > 0 && std::chrono::steady_clock::now() > this->deadline) {
+            throw EvalLimitError("time limit of " + std::to_string(this->limits.timeout.count())
+                                 + " ms exceeded");
+        }
+        this->next_check.store(this->next_check_after(steps), std::memory_order_relaxed);
+    }
+
+    friend class EvalScope;
+    friend class CallDepth;
+    friend class DepthScope;
+};
+
+// makes context current on this thread for as long as the scope lives
+class EvalScope {
+public:
+    explicit EvalScope(EvalContext *context) : previous(EvalContext::current_context) {
+        EvalContext::current_context = context;
+    }
+
+    ~EvalScope() {
+        EvalContext::current_context = this->previous;
+    }
+
+    EvalScope(const EvalScope &) = delete;
+
+    EvalScope &operator=(const EvalScope &) = delete;
+
+private:
+    EvalContext *previous;
+};
+
+// counts a function call in progress on this thread for as long as it lives,
+// throwing on entry if that makes more than the context's max_depth
+class CallDepth {
+public:
+    explicit CallDepth(EvalContext *context) : context(context) {
+        if (context != nullptr) {
+            context->check_depth(1);
+            EvalContext::call_depth++;
+        }
+    }
+
+    ~CallDepth() {
+        if (this->context != nullptr) {
+            EvalContext::call_depth--;
+        }
+    }
+
+    // calls in progress on this thread
+    static uint64_t current() {
+        return EvalContext::call_depth;
+    }
+
+    CallDepth(const CallDepth &) = delete;
+
+    CallDepth &operator=(const CallDepth &) = delete;
+
+private:
+    EvalContext *context;
+};
+
+// sets this thread's call depth for as long as the scope lives, for work
+// handed over from a thread that was that deep in calls
+class DepthScope {
+public:
+    explicit DepthScope(uint64_t depth) : previous(EvalContext::call_depth) {
+        EvalContext::call_depth = depth;
+    }
+
+    ~DepthScope() {
+        EvalContext::call_depth = this->previous;
+    }
+
+    DepthScope(const DepthScope &) = delete;
+
+    DepthScope &operator=(const DepthScope &) = delete;
+
+private:
+    uint64_t previous;
+};
+
+inline void eval_tick() {
+    EvalContext *context = EvalContext::current();
+    if (context != nullptr) {
+        context->tick();
+    }
+}
+
+// called wherever a heap value or environment is made
+inline void eval_allocate() {
+    EvalContext *context = EvalContext::current();
+    if (context != nullptr) {
+        context->allocate();
+    }
+}
+
+#endif // EVAL_CONTEXT_H
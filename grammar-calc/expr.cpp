@@ -1,52 +1,110 @@
 #include "expr.hpp"
 #include "val.hpp"
 #include "env.h"
+#include "big_num.h"
+#include "eval_context.h"
+#include "free_vars.h"
+#include "jit.h"
+#include "pretty_print.h"
+#include <functional>
 #include <utility>
+#include <vector>
 
-NumExpr::NumExpr(int val) {
-    this->val = val;
+// Dropping the last reference to a very deep tree (say a 200k-term sum) would
+// recurse once per level through the destructors, so children about to be
+// freed are queued and released one at a time by the outermost destructor.
+static thread_local std::vector<PTR(Expr)> *pending_release = nullptr;
+
+static void release_child(PTR(Expr) &child) {
+    if (child == nullptr || child.use_count() > 1) {
+        child.reset();
+        return;
+    }
+    if (pending_release != nullptr) {
+        pending_release->push_back(std::move(child));
+        return;
+    }
+    std::vector<PTR(Expr)> queue;
+    pending_release = &queue;
+    queue.push_back(std::move(child));
+    while (!queue.empty()) {
+        PTR(Expr) next = std::move(queue.back());
+        queue.pop_back();
+        next.reset();
+    }
+    pending_release = nullptr;
+}
+
+static size_t mix_hash(size_t seed, size_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+static size_t child_hash(const PTR(Expr) &child) {
+    return child == nullptr ? 0 : child->hash;
+}
+
+static uint32_t child_offset(const PTR(Expr) &child) {
+    return child == nullptr ? Expr::unknown_offset : child->offset;
+}
+
+std::string Expr::to_pretty_string() {
+    return pretty_print_to_string(THIS);
+}
+
+void Expr::pretty_print(std::ostream &out) {
+    PrettyPrinter(out).print(THIS);
+}
+
+NumExpr::NumExpr(int64_t val) : NumExpr(Value::from_num(val)) {
+}
+
+NumExpr::NumExpr(Value val) : Expr(NumExpr::static_kind) {
+    this->val = std::move(val);
+    this->hash = mix_hash(this->kind, hash_number(this->val));
 }
 
-bool NumExpr::equals(PTR(Expr) e) {
-    auto other = CAST(NumExpr)(e);
+bool NumExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<NumExpr>(e);
     if (other == nullptr) {
         return false;
     }
-    return this->val == other->val;
+    return this->val.equals(other->val);
 }
 
-PTR(Val)NumExpr::interp(PTR(Env) env) {
-    return NEW(NumVal)(this->val);
+Value NumExpr::interp(PTR(Env) env) {
+    return this->val;
 }
 
 void NumExpr::print(std::ostream &out) {
-    out << std::to_string(val);
+    out << this->val.to_string();
 }
 
-void
-NumExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                         int prev_stop_at) {
-    out << std::to_string(val);
-}
 
-AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
+AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) : Expr(AddExpr::static_kind) {
     this->lhs = std::move(lhs);
     this->rhs = std::move(rhs);
+    this->offset = child_offset(this->lhs);
+    this->hash = mix_hash(mix_hash(this->kind, child_hash(this->lhs)), child_hash(this->rhs));
+}
+
+AddExpr::~AddExpr() {
+    release_child(this->lhs);
+    release_child(this->rhs);
 }
 
-bool AddExpr::equals(PTR(Expr) e) {
-    auto other = CAST(AddExpr)(e);
+bool AddExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<AddExpr>(e);
     if (other == nullptr) {
         return false;
     }
     return this->lhs->equals(other->lhs) && this->rhs->equals(other->rhs);
 }
 
-PTR(Val)AddExpr::interp(PTR(Env) env) {
+Value AddExpr::interp(PTR(Env) env) {
     if(env == nullptr) {
         env = Env::empty;
     }
-    return this->lhs->interp(env)->add_to(this->rhs->interp(env));
+    return this->lhs->interp(env).add_to(this->rhs->interp(env));
 }
 
 void AddExpr::print(std::ostream &out) {
@@ -57,37 +115,32 @@ void AddExpr::print(std::ostream &out) {
     out << ")";
 }
 
-void AddExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                              int prev_stop_at) {
-    if (precedence >= precedence_add) {
-        out << "(";
-    }
-    this->lhs->pretty_print_at(out, precedence_add, true, true, prev_stop_at);
-    out << " + ";
-    this->rhs->pretty_print_at(out, precedence_none, false, true, prev_stop_at);
-    if (precedence >= precedence_add) {
-        out << ")";
-    }
-}
 
-MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
+MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs) : Expr(MultExpr::static_kind) {
     this->lhs = std::move(lhs);
     this->rhs = std::move(rhs);
+    this->offset = child_offset(this->lhs);
+    this->hash = mix_hash(mix_hash(this->kind, child_hash(this->lhs)), child_hash(this->rhs));
+}
+
+MultExpr::~MultExpr() {
+    release_child(this->lhs);
+    release_child(this->rhs);
 }
 
-bool MultExpr::equals(PTR(Expr) e) {
-    auto other = CAST(MultExpr)(e);
+bool MultExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<MultExpr>(e);
     if (other == nullptr) {
         return false;
     }
     return this->lhs->equals(other->lhs) && this->rhs->equals(other->rhs);
 }
 
-PTR(Val)MultExpr::interp(PTR(Env) env) {
+Value MultExpr::interp(PTR(Env) env) {
     if(env == nullptr) {
         env = Env::empty;
     }
-    return this->lhs->interp(env)->mult_with(this->rhs->interp(env));
+    return this->lhs->interp(env).mult_with(this->rhs->interp(env));
 }
 
 void MultExpr::print(std::ostream &out) {
@@ -98,33 +151,24 @@ void MultExpr::print(std::ostream &out) {
     out << ")";
 }
 
-void MultExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                               int prev_stop_at) {
-    bool mult_add_parentheses = precedence >= precedence_mult;
-    if (mult_add_parentheses) {
-        out << "(";
-    }
-    this->lhs->pretty_print_at(out, precedence_mult, true, true, prev_stop_at);
-    out << " * ";
-    this->rhs->pretty_print_at(out, precedence_add, !mult_add_parentheses && wrap_let_or_fun, true, prev_stop_at);
-    if (mult_add_parentheses) {
-        out << ")";
-    }
-}
 
-VarExpr::VarExpr(std::string variable) {
+VarExpr::VarExpr(std::string variable) : Expr(VarExpr::static_kind) {
     this->variable = std::move(variable);
+    this->hash = mix_hash(this->kind, std::hash<std::string>()(this->variable));
 }
 
-bool VarExpr::equals(PTR(Expr) e) {
-    auto other = CAST(VarExpr)(e);
+bool VarExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<VarExpr>(e);
     if (other == nullptr) {
         return false;
     }
     return this->variable == other->variable;
 }
 
-PTR(Val)VarExpr::interp(PTR(Env) env) {
+Value VarExpr::interp(PTR(Env) env) {
+    if (this->slot >= 0) {
+        return static_cast<FrameEnv *>(env.get())->lookup(this->depth, this->slot);
+    }
     if(env == nullptr) {
         env = Env::empty;
     }
@@ -135,31 +179,37 @@ void VarExpr::print(std::ostream &out) {
     out << this->variable;
 }
 
-void
-VarExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                         int prev_stop_at) {
-    out << this->variable;
-}
 
-LetExpr::LetExpr(std::string lhs, PTR(Expr) rhs, PTR(Expr) body) {
+LetExpr::LetExpr(std::string lhs, PTR(Expr) rhs, PTR(Expr) body) : Expr(LetExpr::static_kind) {
     this->lhs = std::move(lhs);
     this->rhs = std::move(rhs);
     this->body = std::move(body);
+    this->hash = mix_hash(mix_hash(mix_hash(this->kind, std::hash<std::string>()(this->lhs)), child_hash(this->rhs)),
+                          child_hash(this->body));
 }
 
-bool LetExpr::equals(PTR(Expr) e) {
-    auto other = CAST(LetExpr)(e);
+LetExpr::~LetExpr() {
+    release_child(this->rhs);
+    release_child(this->body);
+}
+
+bool LetExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<LetExpr>(e);
     if (other == nullptr) {
         return false;
     }
     return this->lhs == other->lhs && this->rhs->equals(other->rhs) && this->body->equals(other->body);
 }
 
-PTR(Val)LetExpr::interp(PTR(Env) env) {
+Value LetExpr::interp(PTR(Env) env) {
     if(env == nullptr) {
         env = Env::empty;
     }
-    PTR(Val) rhs_val = this->rhs->interp(env);
+    Value rhs_val = this->rhs->interp(env);
+    if (this->slot >= 0) {
+        static_cast<FrameEnv *>(env.get())->slots[this->slot] = rhs_val;
+        return body->interp(env);
+    }
     PTR(Env) new_env = NEW(ExtendedEnv)(lhs, rhs_val, env);
     return body->interp(new_env);
 }
@@ -172,38 +222,22 @@ void LetExpr::print(std::ostream &out) {
     out << ")";
 }
 
-void
-LetExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                         int prev_stop_at) {
-    if (wrap_let_or_fun) {
-        out << "(";
-    }
-    int blank_spaces_backoff = (int) out.tellp() - prev_stop_at;
-    out << "_let " << this->lhs << " = ";
-    this->rhs->pretty_print_at(out, precedence_none, false, false, prev_stop_at);
-    out << "\n";
-    prev_stop_at = out.tellp();
-    out << std::string(blank_spaces_backoff, ' ') << "_in  ";
-    this->body->pretty_print_at(out, precedence_none, false, false, prev_stop_at);
-    if (wrap_let_or_fun) {
-        out << ")";
-    }
-}
 
-BoolExpr::BoolExpr(bool rep) {
+BoolExpr::BoolExpr(bool rep) : Expr(BoolExpr::static_kind) {
     this->rep = rep;
+    this->hash = mix_hash(this->kind, this->rep);
 }
 
-bool BoolExpr::equals(PTR(Expr) e) {
-    auto other = CAST(BoolExpr)(e);
+bool BoolExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<BoolExpr>(e);
     if (other == nullptr) {
         return false;
     }
     return this->rep == other->rep;
 }
 
-PTR(Val)BoolExpr::interp(PTR(Env) env) {
-    return NEW(BoolVal)(this->rep);
+Value BoolExpr::interp(PTR(Env) env) {
+    return Value::from_bool(this->rep);
 }
 
 void BoolExpr::print(std::ostream &out) {
@@ -214,24 +248,23 @@ void BoolExpr::print(std::ostream &out) {
     }
 }
 
-void
-BoolExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                          int prev_stop_at) {
-    if (this->rep) {
-        out << "_true";
-    } else {
-        out << "_false";
-    }
-}
 
-IfExpr::IfExpr(PTR(Expr) condition, PTR(Expr) then_expr, PTR(Expr) else_expr) {
+IfExpr::IfExpr(PTR(Expr) condition, PTR(Expr) then_expr, PTR(Expr) else_expr) : Expr(IfExpr::static_kind) {
     this->condition = std::move(condition);
     this->then_expr = std::move(then_expr);
     this->else_expr = std::move(else_expr);
+    this->hash = mix_hash(mix_hash(mix_hash(this->kind, child_hash(this->condition)), child_hash(this->then_expr)),
+                          child_hash(this->else_expr));
+}
+
+IfExpr::~IfExpr() {
+    release_child(this->condition);
+    release_child(this->then_expr);
+    release_child(this->else_expr);
 }
 
-bool IfExpr::equals(PTR(Expr) e) {
-    auto other = CAST(IfExpr)(e);
+bool IfExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<IfExpr>(e);
     if (other == nullptr) {
         return false;
     }
@@ -239,12 +272,12 @@ bool IfExpr::equals(PTR(Expr) e) {
            this->else_expr->equals(other->else_expr);
 }
 
-PTR(Val)IfExpr::interp(PTR(Env) env) {
+Value IfExpr::interp(PTR(Env) env) {
     if(env == nullptr) {
         env = Env::empty;
     }
-    PTR(Val) condition_val = this->condition->interp(env);
-    if (condition_val->is_true()) {
+    Value condition_val = this->condition->interp(env);
+    if (condition_val.is_true()) {
         return this->then_expr->interp(env);
     } else {
         return this->else_expr->interp(env);
@@ -261,43 +294,35 @@ void IfExpr::print(std::ostream &out) {
     out << ")";
 }
 
-void
-IfExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                        int prev_stop_at) {
-    int blank_spaces_backoff = (int) out.tellp() - prev_stop_at;
-    out << "_if ";
-    this->condition->pretty_print_at(out, precedence_none, false, false, prev_stop_at);
-    out << "\n";
-    prev_stop_at = out.tellp();
-    out << std::string(blank_spaces_backoff, ' ') << "_then ";
-    this->then_expr->pretty_print_at(out, precedence_none, false, false, prev_stop_at);
-    out << "\n";
-    prev_stop_at = out.tellp();
-    out << std::string(blank_spaces_backoff, ' ') << "_else ";
-    this->else_expr->pretty_print_at(out, precedence_none, false, false, prev_stop_at);
-}
 
-EqExpr::EqExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
+EqExpr::EqExpr(PTR(Expr) lhs, PTR(Expr) rhs) : Expr(EqExpr::static_kind) {
     this->lhs = std::move(lhs);
     this->rhs = std::move(rhs);
+    this->offset = child_offset(this->lhs);
+    this->hash = mix_hash(mix_hash(this->kind, child_hash(this->lhs)), child_hash(this->rhs));
 }
 
-bool EqExpr::equals(PTR(Expr) e) {
-    auto other = CAST(EqExpr)(e);
+EqExpr::~EqExpr() {
+    release_child(this->lhs);
+    release_child(this->rhs);
+}
+
+bool EqExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<EqExpr>(e);
     if (other == nullptr) {
         return false;
     }
     return this->lhs->equals(other->lhs) && this->rhs->equals(other->rhs);
 }
 
-PTR(Val)EqExpr::interp(PTR(Env) env) {
+Value EqExpr::interp(PTR(Env) env) {
     if(env == nullptr) {
         env = Env::empty;
     }
-    PTR(Val) lhs_val = this->lhs->interp(env);
-    PTR(Val) rhs_val = this->rhs->interp(env);
-    bool result = lhs_val->equals(rhs_val);
-    return NEW(BoolVal)(result);
+    Value lhs_val = this->lhs->interp(env);
+    Value rhs_val = this->rhs->interp(env);
+    bool result = lhs_val.equals(rhs_val);
+    return Value::from_bool(result);
 }
 
 void EqExpr::print(std::ostream &out) {
@@ -308,38 +333,91 @@ void EqExpr::print(std::ostream &out) {
     out << ")";
 }
 
-void
-EqExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                        int prev_stop_at) {
-    if (wrap_eq) {
-        out << "(";
-    }
-    this->lhs->pretty_print_at(out, precedence_none, true, true, prev_stop_at);
-    out << " == ";
-    this->rhs->pretty_print_at(out, precedence_none, false, false, prev_stop_at);
-    if (wrap_eq) {
-        out << ")";
-    }
-}
 
-FunExpr::FunExpr(std::string formal_arg, PTR(Expr) body) {
+struct FunExpr::Closure {
+    // unresolved only: the variables the body reads from outside, in ClosureEnv order
+    PTR(const std::vector<std::string>) names;
+    // a FunVal when the body reads nothing from outside
+    Value lifted;
+    // the body in native code once it gets hot, for every closure but those on the unbound fallback below
+    PTR(JitFunction) jit;
+};
+
+FunExpr::FunExpr(std::string formal_arg, PTR(Expr) body) : Expr(FunExpr::static_kind) {
     this->formal_arg = std::move(formal_arg);
     this->body = std::move(body);
+    this->hash = mix_hash(mix_hash(this->kind, std::hash<std::string>()(this->formal_arg)), child_hash(this->body));
+}
+
+FunExpr::~FunExpr() {
+    delete this->closure.load(std::memory_order_acquire);
+    release_child(this->body);
 }
 
-bool FunExpr::equals(PTR(Expr) e) {
-    auto other = CAST(FunExpr)(e);
+bool FunExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<FunExpr>(e);
     if (other == nullptr) {
         return false;
     }
     return this->formal_arg == other->formal_arg && this->body->equals(other->body);
 }
 
-PTR(Val) FunExpr::interp(PTR(Env) env) {
+const FunExpr::Closure &FunExpr::closure_info() {
+    Closure *closure = this->closure.load(std::memory_order_acquire);
+    if (closure != nullptr) {
+        return *closure;
+    }
+    // built once for every evaluation to come, so not counted against this one's limits
+    EvalScope none(nullptr);
+    Closure *made = new Closure();
+    if (this->frame_size >= 0) {
+        made->jit = JitFunction::make(*this, nullptr);
+        if (this->captures.empty()) {
+            made->lifted = Value(NEW(FunVal)(this->formal_arg, this->body, NEW(FrameEnv)(0, nullptr), this->frame_size,
+                                             made->jit));
+        }
+    } else {
+        made->names = NEW(const std::vector<std::string>)(free_variables(this->body, this->formal_arg));
+        made->jit = JitFunction::make(*this, made->names);
+        if (made->names->empty()) {
+            made->lifted = Value(NEW(FunVal)(this->formal_arg, this->body, Env::empty, -1, made->jit));
+        }
+    }
+    // another thread may have got there first; its result is just as good
+    if (!this->closure.compare_exchange_strong(closure, made, std::memory_order_acq_rel)) {
+        delete made;
+        return *closure;
+    }
+    return *made;
+}
+
+Value FunExpr::interp(PTR(Env) env) {
     if(env == nullptr) {
         env = Env::empty;
     }
-    return NEW(FunVal)(this->formal_arg, this->body, env);
+    const Closure &closure = this->closure_info();
+    if (closure.lifted.is_heap()) {
+        return closure.lifted;
+    }
+    if (this->frame_size >= 0) {
+        auto *frame = static_cast<FrameEnv *>(env.get());
+        PTR(FrameEnv) captured = NEW(FrameEnv)((int) this->captures.size(), nullptr);
+        for (size_t i = 0; i < this->captures.size(); i++) {
+            captured->slots[i] = frame->lookup(this->captures[i].first, this->captures[i].second);
+        }
+        return Value(NEW(FunVal)(this->formal_arg, this->body, captured, this->frame_size, closure.jit));
+    }
+    PTR(ClosureEnv) captured = NEW(ClosureEnv)(closure.names);
+    for (size_t i = 0; i < closure.names->size(); i++) {
+        const Value *val = env->find((*closure.names)[i]);
+        if (val == nullptr) {
+            // an unbound variable is only an error once the body reaches it, so keep all of env;
+            // compiled code only reads a ClosureEnv, so this closure is always interpreted
+            return Value(NEW(FunVal)(this->formal_arg, this->body, env));
+        }
+        captured->vals[i] = *val;
+    }
+    return Value(NEW(FunVal)(this->formal_arg, this->body, captured, -1, closure.jit));
 }
 
 void FunExpr::print(std::ostream &out) {
@@ -348,41 +426,33 @@ void FunExpr::print(std::ostream &out) {
     out << ")";
 }
 
-void
-FunExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                         int prev_stop_at) {
-    if (wrap_let_or_fun) {
-        out << "(";
-    }
-    int blank_spaces_backoff = (int) out.tellp() - prev_stop_at + 2;
-    out << "_fun (" << this->formal_arg << ")\n";
-    prev_stop_at = out.tellp();
-    out << std::string(blank_spaces_backoff, ' ');
-    this->body->pretty_print_at(out, precedence_none, false, false, prev_stop_at);
-    if (wrap_let_or_fun) {
-        out << ")";
-    }
-}
 
-CallExpr::CallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg) {
+CallExpr::CallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg) : Expr(CallExpr::static_kind) {
     this->to_be_called = std::move(to_be_called);
     this->actual_arg = std::move(actual_arg);
+    this->offset = child_offset(this->to_be_called);
+    this->hash = mix_hash(mix_hash(this->kind, child_hash(this->to_be_called)), child_hash(this->actual_arg));
 }
 
-bool CallExpr::equals(PTR(Expr) e) {
-    auto other = CAST(CallExpr)(e);
+CallExpr::~CallExpr() {
+    release_child(this->to_be_called);
+    release_child(this->actual_arg);
+}
+
+bool CallExpr::same_structure(const PTR(Expr) &e) {
+    auto other = expr_cast<CallExpr>(e);
     if (other == nullptr) {
         return false;
     }
     return this->to_be_called->equals(other->to_be_called) && this->actual_arg->equals(other->actual_arg);
 }
 
-PTR(Val)CallExpr::interp(PTR(Env) env) {
+Value CallExpr::interp(PTR(Env) env) {
     if(env == nullptr) {
         env = Env::empty;
     }
     return this->to_be_called->interp(env)
-        ->call(this->actual_arg->interp(env));
+        .call(this->actual_arg->interp(env));
 }
 
 void CallExpr::print(std::ostream &out) {
@@ -394,10 +464,3 @@ void CallExpr::print(std::ostream &out) {
 }
 
 
-void CallExpr::pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                               int prev_stop_at) {
-    this->to_be_called->pretty_print_at(out, precedence_none, true, false, prev_stop_at);
-    out << "(";
-    this->actual_arg->pretty_print_at(out, precedence_none, false, false, prev_stop_at);
-    out << ")";
-}
@@ -1,12 +1,16 @@
 #ifndef EXPR_HPP
 #define EXPR_HPP
 
-class Val;
 class Env;
 
 #include "pointer.h"
+#include "val.hpp"
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 enum precedence_t {
     precedence_none = 0,
@@ -14,11 +18,51 @@ enum precedence_t {
     precedence_mult = 3,
 };
 
+enum expr_kind_t : uint8_t {
+    expr_num,
+    expr_add,
+    expr_mult,
+    expr_var,
+    expr_let,
+    expr_bool,
+    expr_if,
+    expr_eq,
+    expr_fun,
+    expr_call,
+};
+
 CLASS(Expr) {
 public:
-    virtual bool equals(PTR(Expr) e) = 0;
+    const expr_kind_t kind;
+
+    static const uint32_t unknown_offset = UINT32_MAX;
+
+    // where the node starts in the text it was parsed from (see located() in
+    // parse.h), unknown_offset for nodes built otherwise; operators and calls
+    // start where their lhs does. Not part of the structure.
+    uint32_t offset = unknown_offset;
+
+    explicit Expr(expr_kind_t kind) : kind(kind) {}
+
+    // structural hash over kind, names, literals and children, fixed at construction;
+    // lexical addresses added by resolve() are not part of it
+    size_t hash = 0;
+
+    // O(1) for the same node (always the case for equal hash-consed trees) or a
+    // hash mismatch; otherwise falls back to comparing structure
+    bool equals(const PTR(Expr) &e) {
+        if (e.get() == this) {
+            return true;
+        }
+        if (e == nullptr || e->hash != this->hash) {
+            return false;
+        }
+        return this->same_structure(e);
+    }
+
+    virtual bool same_structure(const PTR(Expr) &e) = 0;
 
-    virtual PTR(Val) interp(PTR(Env) env = nullptr) = 0;
+    virtual Value interp(PTR(Env) env = nullptr) = 0;
 
     std::string to_string() {
         std::stringstream st("");
@@ -28,191 +72,228 @@ public:
 
     virtual void print(std::ostream &out) = 0;
 
-    std::string to_pretty_string() {
-        std::stringstream st("");
-        this->pretty_print(st);
-        return st.str();
-    }
-
-    void pretty_print(std::ostream &out) {
-        this->pretty_print_at(out, precedence_none, false, false, out.tellp());
-    };
+    // the layout of pretty_print.h
+    std::string to_pretty_string();
 
-    virtual void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
-                    int prev_stop_at) = 0;
+    void pretty_print(std::ostream &out);
 
     virtual ~Expr() = default;;
 };
 
 class NumExpr : public Expr {
 public:
-    int val;
+    static const expr_kind_t static_kind = expr_num;
 
-    explicit NumExpr(int val);
+    // an immediate, or a BigNumVal for literals too long for one
+    Value val;
 
-    bool equals(PTR(Expr) e);
+    explicit NumExpr(int64_t val);
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    explicit NumExpr(Value val);
+
+    bool same_structure(const PTR(Expr) &e);
+
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 class AddExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_add;
+
     PTR(Expr) lhs;
     PTR(Expr) rhs;
 
     AddExpr(PTR(Expr) lhs, PTR(Expr) rhs);
 
-    bool equals(PTR(Expr) e);
+    ~AddExpr();
+
+    bool same_structure(const PTR(Expr) &e);
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 class MultExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_mult;
+
     PTR(Expr) lhs;
     PTR(Expr) rhs;
 
     MultExpr(PTR(Expr) lhs, PTR(Expr) rhs);
 
-    bool equals(PTR(Expr) e);
+    ~MultExpr();
+
+    bool same_structure(const PTR(Expr) &e);
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 class VarExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_var;
+
     std::string variable;
+    // lexical address filled in by resolve(), -1 while unresolved
+    int depth = -1;
+    int slot = -1;
 
     VarExpr(std::string);
 
-    bool equals(PTR(Expr) e);
+    bool same_structure(const PTR(Expr) &e);
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 class LetExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_let;
+
     std::string lhs;
     PTR(Expr) rhs;
     PTR(Expr) body;
+    int slot = -1;
 
     LetExpr(std::string lhs, PTR(Expr) rhs, PTR(Expr) body);
 
-    bool equals(PTR(Expr) e);
+    ~LetExpr();
+
+    bool same_structure(const PTR(Expr) &e);
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 class BoolExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_bool;
+
     bool rep;
 
     BoolExpr(bool rep);
 
-    bool equals(PTR(Expr) e);
+    bool same_structure(const PTR(Expr) &e);
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 class IfExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_if;
+
     PTR(Expr) condition;
     PTR(Expr) then_expr;
     PTR(Expr) else_expr;
 
     IfExpr(PTR(Expr) condition, PTR(Expr) then_expr, PTR(Expr) else_expr);
 
-    bool equals(PTR(Expr) e);
+    ~IfExpr();
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    bool same_structure(const PTR(Expr) &e);
+
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 class EqExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_eq;
+
     PTR(Expr) lhs;
     PTR(Expr) rhs;
 
     EqExpr(PTR(Expr) lhs, PTR(Expr) rhs);
 
-    bool equals(PTR(Expr) e);
+    ~EqExpr();
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    bool same_structure(const PTR(Expr) &e);
+
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 class FunExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_fun;
+
     std::string formal_arg;
     PTR(Expr) body;
+    int frame_size = -1;
+    // filled in by resolve(): the address, in the frame a closure is created
+    // in, of each variable the body reads from outside; they are copied into
+    // the slots of the closure's own FrameEnv
+    std::vector<std::pair<int, int>> captures;
 
     FunExpr(std::string formal_arg, PTR(Expr) body);
 
-    bool equals(PTR(Expr) e);
+    ~FunExpr();
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    bool same_structure(const PTR(Expr) &e);
+
+    // a closure holding only the variables the body reads, or, when it reads
+    // none, the same closure every time
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
+private:
+    struct Closure;
+
+    // worked out by the first interp, which any thread may run
+    std::atomic<Closure *> closure{nullptr};
+
+    const Closure &closure_info();
 };
 
 class CallExpr : public Expr {
 public:
+    static const expr_kind_t static_kind = expr_call;
+
     PTR(Expr) to_be_called;
     PTR(Expr) actual_arg;
 
     CallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg);
 
-    bool equals(PTR(Expr) e);
+    ~CallExpr();
 
-    PTR(Val) interp(PTR(Env) env = nullptr);
+    bool same_structure(const PTR(Expr) &e);
+
+    Value interp(PTR(Env) env = nullptr);
 
     void print(std::ostream &out);
 
-    void
-    pretty_print_at(std::ostream &out, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, int prev_stop_at);
 };
 
 
+// downcast by kind tag: no RTTI lookup and no refcount bump, nullptr on mismatch
+template<typename T>
+T *expr_cast(Expr *e) {
+    return e->kind == T::static_kind ? static_cast<T *>(e) : nullptr;
+}
+
+template<typename T>
+T *expr_cast(const PTR(Expr) &e) {
+    return expr_cast<T>(e.get());
+}
+
 #endif // EXPR_HPP
@@ -0,0 +1,185 @@
+#include "expr_stream.h"
+#include "expr.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define EXPR_STREAM_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// bytes mapped at once; a record longer than this makes its window grow to fit
+const size_t window_bytes = 64 << 20;
+
+// bytes read at a time from a stream
+const size_t chunk_bytes = 1 << 20;
+
+}
+
+bool is_blank(std::string_view record) {
+    return record.find_first_not_of(" \t\r\n") == std::string_view::npos;
+}
+
+ExprReader::ExprReader(std::istream &in, char delimiter) : delimiter(delimiter), in(&in) {
+}
+
+ExprReader::ExprReader(const std::string &path, char delimiter) : delimiter(delimiter) {
+#ifdef EXPR_STREAM_MMAP
+    this->fd = open(path.c_str(), O_RDONLY);
+    if (this->fd < 0) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    struct stat info;
+    if (fstat(this->fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        this->file_size = info.st_size;
+        return;
+    }
+    // pipes and devices cannot be mapped, they are read like any stream
+    close(this->fd);
+    this->fd = -1;
+#endif
+    this->owned.reset(new std::ifstream(path, std::ios::binary));
+    if (!*this->owned) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    this->in = this->owned.get();
+}
+
+ExprReader::~ExprReader() {
+    this->unmap_window();
+#ifdef EXPR_STREAM_MMAP
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+#endif
+}
+
+bool ExprReader::next(std::string_view &record) {
+    do {
+        bool found = this->in != nullptr ? this->next_streamed(record) : this->next_mapped(record);
+        if (!found) {
+            return false;
+        }
+    } while (is_blank(record));
+    return true;
+}
+
+bool ExprReader::next_streamed(std::string_view &record) {
+    size_t searched = this->buffer_begin;
+    while (true) {
+        size_t found = this->buffer.find(this->delimiter, searched);
+        if (found != std::string::npos) {
+            record = std::string_view(this->buffer).substr(this->buffer_begin, found - this->buffer_begin);
+            this->buffer_begin = found + 1;
+            return true;
+        }
+        if (!*this->in) {
+            if (this->buffer_begin >= this->buffer.size()) {
+                return false;
+            }
+            record = std::string_view(this->buffer).substr(this->buffer_begin);
+            this->buffer_begin = this->buffer.size();
+            return true;
+        }
+        // drop what was already returned before reading more, so the buffer stays one record plus a chunk
+        this->buffer.erase(0, this->buffer_begin);
+        this->buffer_begin = 0;
+        searched = this->buffer.size();
+        this->buffer.resize(searched + chunk_bytes);
+        this->in->read(&this->buffer[searched], chunk_bytes);
+        this->buffer.resize(searched + this->in->gcount());
+    }
+}
+
+#ifdef EXPR_STREAM_MMAP
+
+bool ExprReader::next_mapped(std::string_view &record) {
+    if (this->position >= this->file_size) {
+        this->unmap_window();
+        return false;
+    }
+    size_t size = window_bytes;
+    while (true) {
+        size_t window_end = this->window_offset + this->window_size;
+        if (this->window == nullptr || this->position < this->window_offset || this->position >= window_end) {
+            this->map_window(this->position, size);
+            window_end = this->window_offset + this->window_size;
+        }
+        const char *begin = this->window + (this->position - this->window_offset);
+        const char *end = this->window + this->window_size;
+        const char *found = std::find(begin, end, this->delimiter);
+        if (found != end || window_end == this->file_size) {
+            record = std::string_view(begin, found - begin);
+            this->position += record.size() + 1;
+            return true;
+        }
+        // the record runs past the window: map one starting at the record, bigger if it already did
+        if (this->position - this->window_offset < size_t(sysconf(_SC_PAGESIZE))) {
+            size *= 2;
+        }
+        this->map_window(this->position, size);
+    }
+}
+
+void ExprReader::map_window(size_t offset, size_t size) {
+    this->unmap_window();
+    // mappings have to start on a page boundary
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t aligned = offset - offset % page;
+    size = std::min(size + (offset - aligned), this->file_size - aligned);
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, this->fd, aligned);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("cannot map input");
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    this->window = static_cast<const char *>(mapped);
+    this->window_offset = aligned;
+    this->window_size = size;
+}
+
+void ExprReader::unmap_window() {
+    if (this->window != nullptr) {
+        munmap(const_cast<char *>(this->window), this->window_size);
+        this->window = nullptr;
+        this->window_size = 0;
+    }
+}
+
+#else
+
+bool ExprReader::next_mapped(std::string_view &record) {
+    return false;
+}
+
+void ExprReader::map_window(size_t offset, size_t size) {
+}
+
+void ExprReader::unmap_window() {
+}
+
+#endif
+
+size_t for_each_expr(ExprReader &reader, parser_t parser,
+                     const std::function<void(size_t index, const PTR(Expr) &expr)> &on_expr,
+                     const std::function<void(size_t index, const std::string &error)> &on_error) {
+    size_t index = 0;
+    std::string_view record;
+    while (reader.next(record)) {
+        PTR(Expr) expr;
+        try {
+            expr = parse_expression_str(record, parser);
+        } catch (const std::runtime_error &e) {
+            on_error(index++, e.what());
+            continue;
+        }
+        on_expr(index++, expr);
+    }
+    return index;
+}
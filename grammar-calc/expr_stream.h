@@ -0,0 +1,74 @@
+#ifndef EXPR_STREAM_H
+#define EXPR_STREAM_H
+
+class Expr;
+
+#include "parse.h"
+#include "pointer.h"
+
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Splits a file (or stream) into delimiter-separated records without loading
+// it whole. Regular files are memory-mapped a window at a time and other
+// input is read in chunks, so memory stays bounded by the window or chunk
+// size plus the longest record. Records with nothing but whitespace are skipped.
+class ExprReader {
+public:
+    // throws std::runtime_error if path cannot be opened
+    explicit ExprReader(const std::string &path, char delimiter = '\n');
+
+    explicit ExprReader(std::istream &in, char delimiter = '\n');
+
+    ~ExprReader();
+
+    ExprReader(const ExprReader &) = delete;
+
+    ExprReader &operator=(const ExprReader &) = delete;
+
+    // the next record, valid until the following call; false at the end of the input
+    bool next(std::string_view &record);
+
+private:
+    char delimiter;
+    std::istream *in = nullptr;
+    // set when the reader opened the stream itself
+    std::unique_ptr<std::istream> owned;
+
+    // mapped input: the window [window_offset, window_offset + window_size) of the file
+    int fd = -1;
+    size_t file_size = 0;
+    const char *window = nullptr;
+    size_t window_offset = 0;
+    size_t window_size = 0;
+    // file offset of the first byte not yet returned
+    size_t position = 0;
+
+    // streamed input: unread bytes are buffer[buffer_begin, buffer.size())
+    std::string buffer;
+    size_t buffer_begin = 0;
+
+    bool next_mapped(std::string_view &record);
+
+    bool next_streamed(std::string_view &record);
+
+    void map_window(size_t offset, size_t size);
+
+    void unmap_window();
+};
+
+// Parses the reader's records one at a time. on_expr gets each tree with its
+// record index (blank records are not counted); a record that does not parse
+// goes to on_error with the message instead. Returns the number of records.
+size_t for_each_expr(ExprReader &reader, parser_t parser,
+                     const std::function<void(size_t index, const PTR(Expr) &expr)> &on_expr,
+                     const std::function<void(size_t index, const std::string &error)> &on_error);
+
+// whether a record is worth parsing
+bool is_blank(std::string_view record);
+
+#endif // EXPR_STREAM_H
@@ -0,0 +1,381 @@
+#include "flat_ast.h"
+#include "env.h"
+#include "eval_context.h"
+#include "visitor.h"
+#include "hash_cons.h"
+#include "pretty_print.h"
+
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
+node_t FlatAst::add_node(node_kind_t kind, uint32_t first, uint32_t second, uint32_t third) {
+    this->kinds.push_back(kind);
+    this->first.push_back(first);
+    this->second.push_back(second);
+    this->third.push_back(third);
+    return (node_t) (this->kinds.size() - 1);
+}
+
+node_t FlatAst::add_number(const Value &number) {
+    if (!number.is_num()) {
+        this->big_numbers.push_back(number);
+        return this->add_node(node_num, 0, 0, (uint32_t) this->big_numbers.size());
+    }
+    uint64_t bits = (uint64_t) number.as_num();
+    return this->add_node(node_num, (uint32_t) bits, (uint32_t) (bits >> 32));
+}
+
+uint32_t FlatAst::intern(const std::string &name) {
+    auto found = this->name_index.find(name);
+    if (found != this->name_index.end()) {
+        return found->second;
+    }
+    uint32_t index = (uint32_t) this->names.size();
+    this->names.push_back(name);
+    this->name_index.emplace(name, index);
+    return index;
+}
+
+// walks both arrays with an explicit stack instead of recursing
+bool FlatAst::equals(node_t node, const FlatAst &other, node_t other_node) const {
+    std::vector<std::pair<node_t, node_t>> pending;
+    pending.emplace_back(node, other_node);
+    while (!pending.empty()) {
+        node_t a = pending.back().first;
+        node_t b = pending.back().second;
+        pending.pop_back();
+        if (this->kinds[a] != other.kinds[b]) {
+            return false;
+        }
+        switch (this->kind(a)) {
+            case node_num:
+                if (!this->number(a).equals(other.number(b))) {
+                    return false;
+                }
+                break;
+            case node_bool:
+                if (this->first[a] != other.first[b]) {
+                    return false;
+                }
+                break;
+            case node_var:
+                if (this->names[this->first[a]] != other.names[other.first[b]]) {
+                    return false;
+                }
+                break;
+            case node_let:
+                if (this->names[this->first[a]] != other.names[other.first[b]]) {
+                    return false;
+                }
+                pending.emplace_back(this->second[a], other.second[b]);
+                pending.emplace_back(this->third[a], other.third[b]);
+                break;
+            case node_fun:
+                if (this->names[this->first[a]] != other.names[other.first[b]]) {
+                    return false;
+                }
+                pending.emplace_back(this->second[a], other.second[b]);
+                break;
+            case node_if:
+                pending.emplace_back(this->third[a], other.third[b]);
+                // fall through
+            case node_add:
+            case node_mult:
+            case node_eq:
+            case node_call:
+                pending.emplace_back(this->first[a], other.first[b]);
+                pending.emplace_back(this->second[a], other.second[b]);
+                break;
+        }
+    }
+    return true;
+}
+
+Value FlatAst::interp(node_t node, PTR(Env) env) {
+    if (env == nullptr) {
+        env = Env::empty;
+    }
+    switch (this->kind(node)) {
+        case node_num:
+            return this->number(node);
+        case node_bool:
+            return Value::from_bool(this->first[node] != 0);
+        case node_add:
+            return this->interp(this->first[node], env).add_to(this->interp(this->second[node], env));
+        case node_mult:
+            return this->interp(this->first[node], env).mult_with(this->interp(this->second[node], env));
+        case node_eq: {
+            Value lhs_val = this->interp(this->first[node], env);
+            Value rhs_val = this->interp(this->second[node], env);
+            return Value::from_bool(lhs_val.equals(rhs_val));
+        }
+        case node_var:
+            return env->lookup(this->names[this->first[node]]);
+        case node_let: {
+            Value rhs_val = this->interp(this->second[node], env);
+            PTR(Env) new_env = NEW(ExtendedEnv)(this->names[this->first[node]], rhs_val, env);
+            return this->interp(this->third[node], new_env);
+        }
+        case node_if:
+            if (this->interp(this->first[node], env).is_true()) {
+                return this->interp(this->second[node], env);
+            } else {
+                return this->interp(this->third[node], env);
+            }
+        case node_fun:
+            return Value(NEW(FlatFunVal)(THIS, node, env));
+        case node_call:
+            return this->interp(this->first[node], env).call(this->interp(this->second[node], env));
+    }
+    throw std::runtime_error("invalid node kind");
+}
+
+void FlatAst::print(std::ostream &out, node_t node) const {
+    switch (this->kind(node)) {
+        case node_num:
+            out << this->number(node).to_string();
+            break;
+        case node_bool:
+            out << (this->first[node] ? "_true" : "_false");
+            break;
+        case node_add:
+        case node_mult:
+        case node_eq:
+            out << "(";
+            this->print(out, this->first[node]);
+            out << (this->kind(node) == node_add ? "+" : this->kind(node) == node_mult ? "*" : "==");
+            this->print(out, this->second[node]);
+            out << ")";
+            break;
+        case node_var:
+            out << this->names[this->first[node]];
+            break;
+        case node_let:
+            out << "(_let " << this->names[this->first[node]] << "=";
+            this->print(out, this->second[node]);
+            out << " _in ";
+            this->print(out, this->third[node]);
+            out << ")";
+            break;
+        case node_if:
+            out << "(_if ";
+            this->print(out, this->first[node]);
+            out << " _then ";
+            this->print(out, this->second[node]);
+            out << " _else ";
+            this->print(out, this->third[node]);
+            out << ")";
+            break;
+        case node_fun:
+            out << "(_fun(" << this->names[this->first[node]] << ")";
+            this->print(out, this->second[node]);
+            out << ")";
+            break;
+        case node_call:
+            out << "(";
+            this->print(out, this->first[node]);
+            out << ") (";
+            this->print(out, this->second[node]);
+            out << ")";
+            break;
+    }
+}
+
+std::string FlatAst::to_string() const {
+    std::stringstream st("");
+    this->print(st, this->root);
+    return st.str();
+}
+
+// through the printer Exprs use, so the two layouts cannot drift apart
+std::string FlatAst::to_pretty_string() const {
+    return pretty_print_to_string(this->to_expr());
+}
+
+// builds children before parents with an explicit stack, so deep trees cannot
+// overflow it; nodes go through make_expr, so a current ExprFactory shares them
+PTR(Expr) FlatAst::to_expr(node_t node) const {
+    std::vector<std::pair<node_t, bool>> pending;
+    std::vector<PTR(Expr)> built;
+    pending.emplace_back(node, false);
+    while (!pending.empty()) {
+        node_t current = pending.back().first;
+        bool children_built = pending.back().second;
+        pending.pop_back();
+        node_kind_t kind = this->kind(current);
+        if (!children_built) {
+            pending.emplace_back(current, true);
+            // pushed in reverse so they are built, and land on built, in order
+            if (kind == node_let || kind == node_if) {
+                pending.emplace_back(this->third[current], false);
+            }
+            if (kind != node_num && kind != node_bool && kind != node_var) {
+                pending.emplace_back(this->second[current], false);
+            }
+            if (kind != node_num && kind != node_bool && kind != node_var && kind != node_let && kind != node_fun) {
+                pending.emplace_back(this->first[current], false);
+            }
+            continue;
+        }
+        PTR(Expr) expr;
+        switch (kind) {
+            case node_num:
+                expr = make_expr<NumExpr>(this->number(current));
+                break;
+            case node_bool:
+                expr = make_expr<BoolExpr>(this->first[current] != 0);
+                break;
+            case node_var:
+                expr = make_expr<VarExpr>(this->names[this->first[current]]);
+                break;
+            case node_fun: {
+                PTR(Expr) body = std::move(built.back());
+                built.pop_back();
+                expr = make_expr<FunExpr>(this->names[this->first[current]], body);
+                break;
+            }
+            case node_let:
+            case node_if: {
+                PTR(Expr) third = std::move(built.back());
+                built.pop_back();
+                PTR(Expr) second = std::move(built.back());
+                built.pop_back();
+                if (kind == node_let) {
+                    expr = make_expr<LetExpr>(this->names[this->first[current]], second, third);
+                } else {
+                    PTR(Expr) first = std::move(built.back());
+                    built.pop_back();
+                    expr = make_expr<IfExpr>(first, second, third);
+                }
+                break;
+            }
+            default: {
+                PTR(Expr) rhs = std::move(built.back());
+                built.pop_back();
+                PTR(Expr) lhs = std::move(built.back());
+                built.pop_back();
+                if (kind == node_add) {
+                    expr = make_expr<AddExpr>(lhs, rhs);
+                } else if (kind == node_mult) {
+                    expr = make_expr<MultExpr>(lhs, rhs);
+                } else if (kind == node_eq) {
+                    expr = make_expr<EqExpr>(lhs, rhs);
+                } else {
+                    expr = make_expr<CallExpr>(lhs, rhs);
+                }
+                break;
+            }
+        }
+        built.push_back(std::move(expr));
+    }
+    return built.back();
+}
+
+// post-order walk with an explicit stack: children are added before their
+// parent, in evaluation order, like the recursive visit would
+PTR(FlatAst) flatten(PTR(Expr) expr) {
+    PTR(FlatAst) ast = NEW(FlatAst)();
+    std::vector<std::pair<Expr *, bool>> pending;
+    std::vector<node_t> added;
+    pending.emplace_back(expr.get(), false);
+    while (!pending.empty()) {
+        Expr *current = pending.back().first;
+        bool children_added = pending.back().second;
+        pending.pop_back();
+        if (!children_added) {
+            pending.emplace_back(current, true);
+            size_t first_child = pending.size();
+            for_each_child(current, [&](const PTR(Expr) &child) {
+                pending.emplace_back(child.get(), false);
+            });
+            std::reverse(pending.begin() + first_child, pending.end());
+            continue;
+        }
+        node_t node = 0;
+        switch (current->kind) {
+            case expr_num:
+                node = ast->add_number(static_cast<NumExpr *>(current)->val);
+                break;
+            case expr_bool:
+                node = ast->add_node(node_bool, static_cast<BoolExpr *>(current)->rep ? 1 : 0);
+                break;
+            case expr_var:
+                node = ast->add_node(node_var, ast->intern(static_cast<VarExpr *>(current)->variable));
+                break;
+            case expr_fun: {
+                node_t body = added.back();
+                added.pop_back();
+                node = ast->add_node(node_fun, ast->intern(static_cast<FunExpr *>(current)->formal_arg), body);
+                break;
+            }
+            case expr_let:
+            case expr_if: {
+                node_t third = added.back();
+                added.pop_back();
+                node_t second = added.back();
+                added.pop_back();
+                if (current->kind == expr_let) {
+                    node = ast->add_node(node_let, ast->intern(static_cast<LetExpr *>(current)->lhs), second, third);
+                } else {
+                    node_t first = added.back();
+                    added.pop_back();
+                    node = ast->add_node(node_if, first, second, third);
+                }
+                break;
+            }
+            default: {
+                node_t rhs = added.back();
+                added.pop_back();
+                node_t lhs = added.back();
+                added.pop_back();
+                node_kind_t kind = current->kind == expr_add ? node_add
+                                   : current->kind == expr_mult ? node_mult
+                                   : current->kind == expr_eq ? node_eq
+                                   : node_call;
+                node = ast->add_node(kind, lhs, rhs);
+                break;
+            }
+        }
+        added.push_back(node);
+    }
+    ast->root = added.back();
+    return ast;
+}
+
+FlatFunVal::FlatFunVal(PTR(FlatAst) ast, node_t fun, PTR(Env) env) : Val(static_kind) {
+    this->ast = std::move(ast);
+    this->fun = fun;
+    this->env = std::move(env);
+}
+
+Value FlatFunVal::add_to(const Value &other_val) {
+    throw std::runtime_error("cannot add to a fun val");
+}
+
+Value FlatFunVal::mult_with(const Value &other_val) {
+    throw std::runtime_error("cannot mult with a fun val");
+}
+
+bool FlatFunVal::equals(const Value &other_val) {
+    auto other_fun = val_cast<FlatFunVal>(other_val);
+    if (other_fun == nullptr) {
+        return false;
+    }
+    return this->ast->equals(this->fun, *other_fun->ast, other_fun->fun);
+}
+
+std::string FlatFunVal::to_string() {
+    return "[function]";
+}
+
+bool FlatFunVal::is_true() {
+    throw std::runtime_error("a fun val cannot be interpreted as a bool val");
+}
+
+Value FlatFunVal::call(const Value &actual_arg) {
+    eval_tick();
+    CallDepth depth(EvalContext::current());
+    const std::string &formal_arg = this->ast->names[this->ast->first[this->fun]];
+    return this->ast->interp(this->ast->second[this->fun], NEW(ExtendedEnv)(formal_arg, actual_arg, this->env));
+}
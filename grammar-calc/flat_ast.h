@@ -0,0 +1,127 @@
+#ifndef FLAT_AST_H
+#define FLAT_AST_H
+
+class Expr;
+class Env;
+
+#include "expr.hpp"
+#include "val.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum node_kind_t : uint8_t {
+    node_num,
+    node_bool,
+    node_add,
+    node_mult,
+    node_eq,
+    node_var,
+    node_let,
+    node_if,
+    node_fun,
+    node_call,
+};
+
+typedef uint32_t node_t;
+
+// Expr tree stored as parallel arrays, children referenced by index.
+// Operands per kind:
+//   num:  first, second = low and high 32 bits of the value, third = 0;
+//         or third = 1 + index into big_numbers for a BigNumVal
+//   bool: first = 0 | 1
+//   add, mult, eq: first = lhs, second = rhs
+//   var:  first = name
+//   let:  first = name, second = rhs, third = body
+//   if:   first = condition, second = then, third = else
+//   fun:  first = formal arg name, second = body
+//   call: first = to_be_called, second = actual_arg
+// Children are always added before their parent.
+CLASS(FlatAst) {
+public:
+    std::vector<uint8_t> kinds;
+    std::vector<uint32_t> first;
+    std::vector<uint32_t> second;
+    std::vector<uint32_t> third;
+    std::vector<std::string> names;
+    std::vector<Value> big_numbers;
+    node_t root = 0;
+
+    node_t add_node(node_kind_t kind, uint32_t first = 0, uint32_t second = 0, uint32_t third = 0);
+
+    node_t add_number(const Value &number);
+
+    // the value of a node_num
+    Value number(node_t node) const {
+        if (this->third[node] != 0) {
+            return this->big_numbers[this->third[node] - 1];
+        }
+        return Value::from_num((int64_t) ((uint64_t) this->second[node] << 32 | this->first[node]));
+    }
+
+    uint32_t intern(const std::string &name);
+
+    size_t size() const {
+        return kinds.size();
+    }
+
+    node_kind_t kind(node_t node) const {
+        return (node_kind_t) kinds[node];
+    }
+
+    bool equals(node_t node, const FlatAst &other, node_t other_node) const;
+
+    bool equals(const FlatAst &other) const {
+        return equals(root, other, other.root);
+    }
+
+    Value interp(node_t node, PTR(Env) env = nullptr);
+
+    Value interp() {
+        return interp(root);
+    }
+
+    void print(std::ostream &out, node_t node) const;
+
+    std::string to_string() const;
+
+    std::string to_pretty_string() const;
+
+    PTR(Expr) to_expr(node_t node) const;
+
+    PTR(Expr) to_expr() const {
+        return to_expr(root);
+    }
+
+private:
+    std::unordered_map<std::string, uint32_t> name_index;
+};
+
+PTR(FlatAst) flatten(PTR(Expr) expr);
+
+// closure produced by evaluating a node_fun of a FlatAst
+class FlatFunVal : public Val {
+public:
+    static const val_kind_t static_kind = val_flat_fun;
+
+    PTR(FlatAst) ast;
+    node_t fun;
+    PTR(Env) env;
+
+    FlatFunVal(PTR(FlatAst) ast, node_t fun, PTR(Env) env);
+
+    Value add_to(const Value &other_val);
+
+    Value mult_with(const Value &other_val);
+
+    bool equals(const Value &other_val);
+
+    std::string to_string();
+
+    bool is_true();
+
+    Value call(const Value &actual_arg);
+};
+
+#endif // FLAT_AST_H
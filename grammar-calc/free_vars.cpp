@@ -0,0 +1,90 @@
+#include "free_vars.h"
+#include "visitor.h"
+
+#include <algorithm>
+
+namespace {
+
+class FreeVariables : public ExprVisitor<FreeVariables, void> {
+public:
+    std::vector<std::string> bound;
+    std::vector<std::string> free;
+
+    void visit_var(VarExpr *expr) {
+        const std::string &name = expr->variable;
+        if (std::find(this->bound.rbegin(), this->bound.rend(), name) != this->bound.rend()) {
+            return;
+        }
+        if (std::find(this->free.begin(), this->free.end(), name) == this->free.end()) {
+            this->free.push_back(name);
+        }
+    }
+
+    // the right-hand side of a _let is outside its own binding
+    void visit_let(LetExpr *expr) {
+        this->visit(expr->rhs);
+        this->bound.push_back(expr->lhs);
+        this->visit(expr->body);
+        this->bound.pop_back();
+    }
+
+    void visit_fun(FunExpr *expr) {
+        this->bound.push_back(expr->formal_arg);
+        this->visit(expr->body);
+        this->bound.pop_back();
+    }
+
+    void visit_expr(Expr *expr) {
+        for_each_child(expr, [this](const PTR(Expr) &child) { this->visit(child); });
+    }
+};
+
+class FreeAddresses : public ExprVisitor<FreeAddresses, void> {
+public:
+    // functions entered below the body being analysed
+    int nesting = 0;
+    std::vector<std::pair<int, int>> free;
+
+    void read(int depth, int slot) {
+        if (depth <= this->nesting) {
+            return;
+        }
+        std::pair<int, int> address(depth - this->nesting - 1, slot);
+        if (std::find(this->free.begin(), this->free.end(), address) == this->free.end()) {
+            this->free.push_back(address);
+        }
+    }
+
+    void visit_var(VarExpr *expr) {
+        this->read(expr->depth, expr->slot);
+    }
+
+    // a nested closure reads its captures when it is created
+    void visit_fun(FunExpr *expr) {
+        for (const auto &capture : expr->captures) {
+            this->read(capture.first, capture.second);
+        }
+        this->nesting++;
+        this->visit(expr->body);
+        this->nesting--;
+    }
+
+    void visit_expr(Expr *expr) {
+        for_each_child(expr, [this](const PTR(Expr) &child) { this->visit(child); });
+    }
+};
+
+}
+
+std::vector<std::string> free_variables(const PTR(Expr) &body, const std::string &formal_arg) {
+    FreeVariables analysis;
+    analysis.bound.push_back(formal_arg);
+    analysis.visit(body);
+    return analysis.free;
+}
+
+std::vector<std::pair<int, int>> free_addresses(const PTR(Expr) &body) {
+    FreeAddresses analysis;
+    analysis.visit(body);
+    return analysis.free;
+}
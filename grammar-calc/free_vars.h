@@ -0,0 +1,18 @@
+#ifndef FREE_VARS_H
+#define FREE_VARS_H
+
+#include "expr.hpp"
+#include <string>
+#include <utility>
+#include <vector>
+
+// names a function body reads from its closure: every variable it uses that is
+// bound neither by formal_arg nor inside the body, each listed once, in the order
+// they are first met
+std::vector<std::string> free_variables(const PTR(Expr) &body, const std::string &formal_arg);
+
+// the same for a resolved body, as (depth, slot) addresses counted from the
+// closure's own FrameEnv (the parent of the frame a call creates)
+std::vector<std::pair<int, int>> free_addresses(const PTR(Expr) &body);
+
+#endif // FREE_VARS_H
@@ -0,0 +1,61 @@
+TEMPLATE = app
+TARGET = grammar-calc-bench
+CONFIG += c++17 console release
+CONFIG -= qt app_bundle
+
+SOURCES += \
+    bench_main.cpp \
+    ast_cache.cpp \
+    big_num.cpp \
+    bytecode.cpp \
+    cek.cpp \
+    engine.cpp \
+    env.cpp \
+    expr.cpp \
+    expr_stream.cpp \
+    flat_ast.cpp \
+    free_vars.cpp \
+    hash_cons.cpp \
+    incremental_parse.cpp \
+    iterative_parse.cpp \
+    jit.cpp \
+    lexer.cpp \
+    memo.cpp \
+    optimize.cpp \
+    parallel.cpp \
+    parse.cpp \
+    pretty_print.cpp \
+    profile.cpp \
+    resolve.cpp \
+    val.cpp \
+    vm.cpp
+
+HEADERS += \
+    ast_cache.h \
+    big_num.h \
+    bytecode.h \
+    cek.h \
+    engine.h \
+    env.h \
+    eval_context.h \
+    expr.hpp \
+    expr_stream.h \
+    flat_ast.h \
+    free_vars.h \
+    hash_cons.h \
+    incremental_parse.h \
+    iterative_parse.h \
+    jit.h \
+    lexer.h \
+    memo.h \
+    optimize.h \
+    parallel.h \
+    parse.h \
+    pretty_print.h \
+    profile.h \
+    pointer.h \
+    resolve.h \
+    static_expr.h \
+    val.hpp \
+    visitor.h \
+    vm.h
@@ -1,20 +1,64 @@
-QT+=widgets
+QT+=widgets concurrent
+CONFIG += c++17
 
 SOURCES += \
     ControlPanel.cpp \
+    ast_cache.cpp \
+    big_num.cpp \
+    bytecode.cpp \
+    cek.cpp \
+    engine.cpp \
     env.cpp \
     expr.cpp \
+    expr_stream.cpp \
+    flat_ast.cpp \
+    free_vars.cpp \
+    hash_cons.cpp \
+    incremental_parse.cpp \
+    iterative_parse.cpp \
+    jit.cpp \
+    lexer.cpp \
+    memo.cpp \
+    optimize.cpp \
+    parallel.cpp \
     main.cpp \
     parse.cpp \
-    val.cpp
+    pretty_print.cpp \
+    profile.cpp \
+    resolve.cpp \
+    val.cpp \
+    vm.cpp
 
 HEADERS += \
     ControlPanel.h \
+    ast_cache.h \
+    big_num.h \
+    bytecode.h \
+    cek.h \
+    engine.h \
     env.h \
+    eval_context.h \
     expr.hpp \
+    expr_stream.h \
+    flat_ast.h \
+    free_vars.h \
+    hash_cons.h \
+    incremental_parse.h \
+    iterative_parse.h \
+    jit.h \
+    lexer.h \
+    memo.h \
+    optimize.h \
+    parallel.h \
     parse.h \
+    pretty_print.h \
+    profile.h \
     pointer.h \
-    val.hpp
+    resolve.h \
+    static_expr.h \
+    val.hpp \
+    visitor.h \
+    vm.h
 
 DISTFILES += \
     readme.md \
@@ -0,0 +1,59 @@
+#include "hash_cons.h"
+
+bool ExprFactory::ShallowEqual::operator()(const PTR(Expr) &a, const PTR(Expr) &b) const {
+    if (a->kind != b->kind) {
+        return false;
+    }
+    switch (a->kind) {
+        case expr_num:
+            return static_cast<NumExpr *>(a.get())->val.equals(static_cast<NumExpr *>(b.get())->val);
+        case expr_add: {
+            auto *x = static_cast<AddExpr *>(a.get());
+            auto *y = static_cast<AddExpr *>(b.get());
+            return x->lhs == y->lhs && x->rhs == y->rhs;
+        }
+        case expr_mult: {
+            auto *x = static_cast<MultExpr *>(a.get());
+            auto *y = static_cast<MultExpr *>(b.get());
+            return x->lhs == y->lhs && x->rhs == y->rhs;
+        }
+        case expr_var:
+            return static_cast<VarExpr *>(a.get())->variable == static_cast<VarExpr *>(b.get())->variable;
+        case expr_let: {
+            auto *x = static_cast<LetExpr *>(a.get());
+            auto *y = static_cast<LetExpr *>(b.get());
+            return x->lhs == y->lhs && x->rhs == y->rhs && x->body == y->body;
+        }
+        case expr_bool:
+            return static_cast<BoolExpr *>(a.get())->rep == static_cast<BoolExpr *>(b.get())->rep;
+        case expr_if: {
+            auto *x = static_cast<IfExpr *>(a.get());
+            auto *y = static_cast<IfExpr *>(b.get());
+            return x->condition == y->condition && x->then_expr == y->then_expr && x->else_expr == y->else_expr;
+        }
+        case expr_eq: {
+            auto *x = static_cast<EqExpr *>(a.get());
+            auto *y = static_cast<EqExpr *>(b.get());
+            return x->lhs == y->lhs && x->rhs == y->rhs;
+        }
+        case expr_fun: {
+            auto *x = static_cast<FunExpr *>(a.get());
+            auto *y = static_cast<FunExpr *>(b.get());
+            return x->formal_arg == y->formal_arg && x->body == y->body;
+        }
+        case expr_call: {
+            auto *x = static_cast<CallExpr *>(a.get());
+            auto *y = static_cast<CallExpr *>(b.get());
+            return x->to_be_called == y->to_be_called && x->actual_arg == y->actual_arg;
+        }
+    }
+    return false;
+}
+
+PTR(Expr) ExprFactory::intern(const PTR(Expr) &node) {
+    auto inserted = this->nodes.insert(node);
+    if (!inserted.second) {
+        this->shared_count++;
+    }
+    return *inserted.first;
+}
@@ -0,0 +1,84 @@
+#ifndef HASH_CONS_H
+#define HASH_CONS_H
+
+#include "expr.hpp"
+
+#include <cstdint>
+#include <unordered_set>
+#include <utility>
+
+// Interns expressions so that structurally equal subtrees are one shared node:
+// repeated subexpressions are stored once and Expr::equals on interned trees
+// always takes its pointer fast path. Nodes are interned bottom-up, so two
+// candidates only need their own fields and their children's addresses compared.
+class ExprFactory {
+public:
+    // the interned node equal to node, which becomes the interned one if it is
+    // new; node's children must already be interned
+    PTR(Expr) intern(const PTR(Expr) &node);
+
+    // distinct nodes held
+    size_t size() const {
+        return this->nodes.size();
+    }
+
+    // nodes that were replaced by an existing equal one
+    uint64_t shared() const {
+        return this->shared_count;
+    }
+
+    // the factory the parsers build with on this thread, or nullptr
+    static ExprFactory *current() {
+        return current_factory;
+    }
+
+private:
+    struct NodeHash {
+        size_t operator()(const PTR(Expr) &node) const {
+            return node->hash;
+        }
+    };
+
+    struct ShallowEqual {
+        bool operator()(const PTR(Expr) &a, const PTR(Expr) &b) const;
+    };
+
+    std::unordered_set<PTR(Expr), NodeHash, ShallowEqual> nodes;
+    uint64_t shared_count = 0;
+
+    static inline thread_local ExprFactory *current_factory = nullptr;
+
+    friend class ExprFactoryScope;
+};
+
+// makes factory current on this thread for as long as the scope lives
+class ExprFactoryScope {
+public:
+    explicit ExprFactoryScope(ExprFactory *factory) : previous(ExprFactory::current_factory) {
+        ExprFactory::current_factory = factory;
+    }
+
+    ~ExprFactoryScope() {
+        ExprFactory::current_factory = this->previous;
+    }
+
+    ExprFactoryScope(const ExprFactoryScope &) = delete;
+
+    ExprFactoryScope &operator=(const ExprFactoryScope &) = delete;
+
+private:
+    ExprFactory *previous;
+};
+
+// how the parsers build nodes: interned when a factory is current
+template<typename T, typename... Args>
+PTR(Expr) make_expr(Args &&... args) {
+    PTR(Expr) node = NEW(T)(std::forward<Args>(args)...);
+    ExprFactory *factory = ExprFactory::current();
+    if (factory == nullptr) {
+        return node;
+    }
+    return factory->intern(node);
+}
+
+#endif // HASH_CONS_H
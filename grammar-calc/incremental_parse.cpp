@@ -0,0 +1,90 @@
+#include "incremental_parse.h"
+#include "parse.h"
+#include "expr.hpp"
+
+#include <algorithm>
+
+namespace {
+
+bool comes_before(size_t offset, int open_parenthesis_to_match, parse_rule_t rule, size_t other_offset,
+                  int other_open, parse_rule_t other_rule) {
+    if (offset != other_offset) {
+        return offset < other_offset;
+    }
+    if (open_parenthesis_to_match != other_open) {
+        return open_parenthesis_to_match < other_open;
+    }
+    return rule < other_rule;
+}
+
+}
+
+PTR(Expr) ParseMemo::reuse(parse_rule_t rule, Lexer &lexer, int &open_parenthesis_to_match) {
+    size_t offset = lexer.peek().offset;
+    auto end = this->entries.begin() + this->sorted_size;
+    auto found = std::lower_bound(this->entries.begin(), end, offset, [&](const Entry &entry, size_t) {
+        return comes_before(entry.offset, entry.open_parenthesis_to_match, entry.rule,
+                            offset, open_parenthesis_to_match, rule);
+    });
+    if (found == end || found->offset != offset || found->open_parenthesis_to_match != open_parenthesis_to_match
+        || found->rule != rule) {
+        return nullptr;
+    }
+    lexer.seek(found->resume);
+    open_parenthesis_to_match += found->open_delta;
+    this->hit_count++;
+    return found->expr;
+}
+
+void ParseMemo::record(parse_rule_t rule, size_t start, int open_before, const Token &next, int open_after,
+                       const PTR(Expr) &expr) {
+    // the scanner looks one character past a token to see where it ends
+    size_t examined_end = next.offset + next.length + 1;
+    this->entries.push_back(Entry{start, open_before, rule, expr, next.offset, examined_end, open_after - open_before});
+}
+
+void ParseMemo::sort_entries() {
+    auto less = [](const Entry &a, const Entry &b) {
+        return comes_before(a.offset, a.open_parenthesis_to_match, a.rule, b.offset, b.open_parenthesis_to_match, b.rule);
+    };
+    auto middle = this->entries.begin() + this->sorted_size;
+    std::sort(middle, this->entries.end(), less);
+    std::inplace_merge(this->entries.begin(), middle, this->entries.end(), less);
+    auto same = [&](const Entry &a, const Entry &b) { return !less(a, b) && !less(b, a); };
+    this->entries.erase(std::unique(this->entries.begin(), this->entries.end(), same), this->entries.end());
+    this->sorted_size = this->entries.size();
+}
+
+void ParseMemo::edit(size_t start, size_t old_end, size_t new_end) {
+    this->sort_entries();
+    // entries before the edit keep their offsets and those after it move by the same amount, so the order holds
+    size_t kept = 0;
+    for (Entry &entry : this->entries) {
+        if (entry.examined_end <= start) {
+            this->entries[kept++] = std::move(entry);
+        } else if (entry.offset >= old_end) {
+            entry.offset = entry.offset - old_end + new_end;
+            entry.resume = entry.resume - old_end + new_end;
+            entry.examined_end = entry.examined_end - old_end + new_end;
+            this->entries[kept++] = std::move(entry);
+        }
+    }
+    this->entries.resize(kept);
+    this->sorted_size = kept;
+}
+
+PTR(Expr) IncrementalParser::parse(const std::string &text) {
+    // the edit is whatever lies between the longest common prefix and suffix
+    size_t limit = std::min(this->text.size(), text.size());
+    size_t prefix = std::mismatch(text.begin(), text.begin() + limit, this->text.begin()).first - text.begin();
+    size_t suffix = std::mismatch(text.rbegin(), text.rbegin() + (limit - prefix), this->text.rbegin()).first
+                    - text.rbegin();
+    this->memo.edit(prefix, this->text.size() - suffix, text.size() - suffix);
+    this->text = text;
+
+    uint64_t hits = this->memo.hits();
+    ParseMemoScope scope(&this->memo);
+    PTR(Expr) expr = parse_expression_str(this->text);
+    this->last_reused = this->memo.hits() - hits;
+    return expr;
+}
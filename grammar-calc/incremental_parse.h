@@ -0,0 +1,131 @@
+#ifndef INCREMENTAL_PARSE_H
+#define INCREMENTAL_PARSE_H
+
+class Expr;
+
+#include "lexer.h"
+#include "pointer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the parser functions whose results can be reused
+enum parse_rule_t : uint8_t {
+    rule_expr,
+    rule_comprag,
+};
+
+// Remembers what parse_expr and parse_comprag returned at each offset. A rule
+// only reads the text from its first token up to one character past the token
+// it stops at, and the only context it depends on is the count of open
+// parentheses, so after an edit every entry that read nothing inside the edit
+// still holds, shifted when it comes after the edit.
+class ParseMemo {
+public:
+    // what rule parsed at the lexer's position before, moving the lexer past it; nullptr if unknown
+    PTR(Expr) reuse(parse_rule_t rule, Lexer &lexer, int &open_parenthesis_to_match);
+
+    // rule parsed expr from start, stopping in front of next
+    void record(parse_rule_t rule, size_t start, int open_before, const Token &next, int open_after,
+                const PTR(Expr) &expr);
+
+    // [start, old_end) of the text was replaced by what is now [start, new_end)
+    void edit(size_t start, size_t old_end, size_t new_end);
+
+    size_t size() const {
+        return this->entries.size();
+    }
+
+    // reuse hits since construction
+    uint64_t hits() const {
+        return this->hit_count;
+    }
+
+    // the memo the parser records into on this thread, or nullptr
+    static ParseMemo *current() {
+        return current_memo;
+    }
+
+private:
+    struct Entry {
+        size_t offset;
+        int open_parenthesis_to_match;
+        parse_rule_t rule;
+        PTR(Expr) expr;
+        // where the lexer continues afterwards
+        size_t resume;
+        // one past the last character the rule read
+        size_t examined_end;
+        int open_delta;
+    };
+
+    // sorted by offset up to sorted_size, what the running parse records comes after
+    std::vector<Entry> entries;
+    size_t sorted_size = 0;
+    uint64_t hit_count = 0;
+
+    void sort_entries();
+
+    static inline thread_local ParseMemo *current_memo = nullptr;
+
+    friend class ParseMemoScope;
+};
+
+// makes memo current on this thread for as long as the scope lives
+class ParseMemoScope {
+public:
+    explicit ParseMemoScope(ParseMemo *memo) : previous(ParseMemo::current_memo) {
+        ParseMemo::current_memo = memo;
+    }
+
+    ~ParseMemoScope() {
+        ParseMemo::current_memo = this->previous;
+    }
+
+    ParseMemoScope(const ParseMemoScope &) = delete;
+
+    ParseMemoScope &operator=(const ParseMemoScope &) = delete;
+
+private:
+    ParseMemo *previous;
+};
+
+// how parse_expr and parse_comprag run parse: reused from the current memo when possible
+template<typename F>
+PTR(Expr) parse_memoized(parse_rule_t rule, Lexer &lexer, int &open_parenthesis_to_match, F parse) {
+    ParseMemo *memo = ParseMemo::current();
+    if (memo == nullptr) {
+        return parse();
+    }
+    size_t start = lexer.peek().offset;
+    int open_before = open_parenthesis_to_match;
+    PTR(Expr) expr = memo->reuse(rule, lexer, open_parenthesis_to_match);
+    if (expr == nullptr) {
+        expr = parse();
+        memo->record(rule, start, open_before, lexer.peek(), open_parenthesis_to_match, expr);
+    }
+    return expr;
+}
+
+// Parses successive versions of one text, e.g. an editor buffer, with the
+// recursive descent parser. Only the part of the tree around an edit is parsed
+// again; subtrees before and after it are the nodes of the previous parse.
+// Not thread safe: use it from one thread at a time.
+class IncrementalParser {
+public:
+    PTR(Expr) parse(const std::string &text);
+
+    // subtrees reused by the last parse
+    uint64_t reused() const {
+        return this->last_reused;
+    }
+
+private:
+    std::string text;
+    ParseMemo memo;
+    uint64_t last_reused = 0;
+};
+
+#endif // INCREMENTAL_PARSE_H
@@ -0,0 +1,326 @@
+#include "iterative_parse.h"
+#include "parse.h"
+#include "expr.hpp"
+#include "hash_cons.h"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+// one frame per pending function of the recursive-descent parser
+enum frame_kind_t {
+    frame_expr,
+    frame_comprag,
+    frame_addend,
+    frame_multiplicand,
+    frame_parenthesized,
+    frame_let,
+    frame_if,
+    frame_fun,
+};
+
+struct Frame {
+    frame_kind_t kind;
+    int state;
+    // index into the parser's locals: the open_parenthesis_to_match this frame updates
+    int open_parenthesis;
+    std::vector<PTR(Expr)> operands;
+    // frame_expr only: the by-value open_parenthesis_to_match of each level of an == chain
+    std::vector<int> levels;
+    std::string name;
+    bool first_call;
+    size_t call_end;
+    // frame_let, frame_if and frame_fun: where their keyword is
+    size_t offset;
+};
+
+class IterativeParser {
+public:
+    explicit IterativeParser(Lexer &lexer) : lexer(lexer) {}
+
+    PTR(Expr) parse() {
+        enter_expr(0);
+        PTR(Expr) result;
+        while (true) {
+            size_t top = frames.size() - 1;
+            bool done = false;
+            switch (frames[top].kind) {
+                case frame_expr:
+                    done = step_expr(top, result);
+                    break;
+                case frame_comprag:
+                    done = step_chain(top, result, tok_plus);
+                    break;
+                case frame_addend:
+                    done = step_chain(top, result, tok_star);
+                    break;
+                case frame_multiplicand:
+                    done = step_multiplicand(top, result);
+                    break;
+                case frame_parenthesized:
+                    done = step_parenthesized(top, result);
+                    break;
+                case frame_let:
+                    done = step_let(top, result);
+                    break;
+                case frame_if:
+                    done = step_if(top, result);
+                    break;
+                case frame_fun:
+                    done = step_fun(top, result);
+                    break;
+            }
+            if (done) {
+                frames.pop_back();
+                if (frames.empty()) {
+                    return result;
+                }
+            }
+        }
+    }
+
+private:
+    Lexer &lexer;
+    std::vector<Frame> frames;
+    std::vector<int> locals;
+
+    int &local(int index) {
+        return locals[index];
+    }
+
+    void push(frame_kind_t kind, int open_parenthesis) {
+        frames.push_back(Frame{kind, 0, open_parenthesis, {}, {}, "", true, 0, 0});
+    }
+
+    // parse_expr takes open_parenthesis_to_match by value
+    void enter_expr(int open_parenthesis_to_match) {
+        push(frame_expr, -1);
+        locals.push_back(open_parenthesis_to_match);
+        frames.back().levels.push_back((int) locals.size() - 1);
+    }
+
+    // expr: comparg || comparg == expr
+    bool step_expr(size_t index, PTR(Expr) &result) {
+        Frame &frame = frames[index];
+        if (frame.state == 0) {
+            frame.state = 1;
+            push(frame_comprag, frame.levels.back());
+            return false;
+        }
+        frame.operands.push_back(result);
+        if (lexer.peek().kind == tok_eq || lexer.peek().kind == tok_assign) {
+            consume_word(lexer, "==", local(frame.levels.back()));
+            locals.push_back(local(frame.levels.back()));
+            frame.levels.push_back((int) locals.size() - 1);
+            push(frame_comprag, frame.levels.back());
+            return false;
+        }
+
+        // every level of the chain checks what follows, innermost first
+        token_kind_t next = lexer.peek().kind;
+        for (size_t level = frame.levels.size(); level-- > 0;) {
+            if (next != tok_eof && next != tok_rparen && next != tok_keyword && next != tok_lparen) {
+                throw std::runtime_error("invalid input");
+            }
+            if (local(frame.levels[level]) == 0 && next == tok_rparen) {
+                throw std::runtime_error("missing open parenthesis");
+            }
+        }
+        result = frame.operands.back();
+        for (size_t i = frame.operands.size() - 1; i-- > 0;) {
+            result = make_expr<EqExpr>(frame.operands[i], result);
+        }
+        locals.resize(frame.levels.front());
+        return true;
+    }
+
+    // comprag: addend | addend + comprag
+    // addend: multiplicand | multiplicand * addend
+    bool step_chain(size_t index, PTR(Expr) &result, token_kind_t op) {
+        Frame &frame = frames[index];
+        frame_kind_t operand_kind = op == tok_plus ? frame_addend : frame_multiplicand;
+        if (frame.state == 0) {
+            frame.state = 1;
+            push(operand_kind, frame.open_parenthesis);
+            return false;
+        }
+        frame.operands.push_back(result);
+        if (lexer.peek().kind == op) {
+            consume(lexer, op, local(frame.open_parenthesis));
+            push(operand_kind, frame.open_parenthesis);
+            return false;
+        }
+        // both operators associate to the right
+        result = frame.operands.back();
+        for (size_t i = frame.operands.size() - 1; i-- > 0;) {
+            if (op == tok_plus) {
+                result = make_expr<AddExpr>(frame.operands[i], result);
+            } else {
+                result = make_expr<MultExpr>(frame.operands[i], result);
+            }
+        }
+        return true;
+    }
+
+    // multiplicand:  〈inner〉 | 〈multicand〉 ( 〈expr〉 )
+    bool step_multiplicand(size_t index, PTR(Expr) &result) {
+        Frame &frame = frames[index];
+        int open_parenthesis = frame.open_parenthesis;
+        if (frame.state == 0) {
+            frame.state = 1;
+            PTR(Expr) inner = start_inner(open_parenthesis);
+            if (inner == nullptr) {
+                return false;
+            }
+            result = inner;
+        }
+        if (frame.state == 1) {
+            frame.operands.push_back(result);
+        } else {
+            frame.call_end = lexer.peek().offset + lexer.peek().length;
+            consume(lexer, tok_rparen, local(open_parenthesis));
+            frame.operands.back() = make_expr<CallExpr>(frame.operands.back(), result);
+            frame.first_call = false;
+        }
+        // whitespace is allowed before the first argument only, f(1) (2) is not a chained call
+        if (lexer.peek().kind == tok_lparen && (frame.first_call || lexer.peek().offset == frame.call_end)) {
+            consume(lexer, tok_lparen, local(open_parenthesis));
+            frame.state = 2;
+            enter_expr(local(open_parenthesis));
+            return false;
+        }
+        result = frame.operands.back();
+        return true;
+    }
+
+    // inner: number | ( expression ) | variable | let binding | _true | _false | _if _then _else | _fun ( 〈variable〉 ) 〈expr〉
+    // returns the node right away, or nullptr after pushing a frame that will produce it
+    PTR(Expr) start_inner(int open_parenthesis) {
+        int &open_parenthesis_to_match = local(open_parenthesis);
+        const Token &token = lexer.peek();
+        if (token.kind == tok_num || lexer.first_char(token) == '-') {
+            return parse_num(lexer, open_parenthesis_to_match);
+        }
+        if (token.kind == tok_lparen) {
+            consume(lexer, tok_lparen, open_parenthesis_to_match);
+            push(frame_parenthesized, open_parenthesis);
+            return nullptr;
+        }
+        if (token.kind == tok_identifier) {
+            return parse_variable(lexer, open_parenthesis_to_match);
+        }
+        if (token.kind == tok_keyword) {
+            Token keyword = lexer.next();
+            std::string_view next_keyword = lexer.text(keyword);
+            if (next_keyword == "_let") {
+                push(frame_let, open_parenthesis);
+                frames.back().offset = keyword.offset;
+                return nullptr;
+            } else if (next_keyword == "_false") {
+                return located(make_expr<BoolExpr>(false), keyword.offset);
+            } else if (next_keyword == "_true") {
+                return located(make_expr<BoolExpr>(true), keyword.offset);
+            } else if (next_keyword == "_if") {
+                push(frame_if, open_parenthesis);
+                frames.back().offset = keyword.offset;
+                return nullptr;
+            } else if (next_keyword == "_fun") {
+                push(frame_fun, open_parenthesis);
+                frames.back().offset = keyword.offset;
+                return nullptr;
+            }
+            if (lexer.char_after(keyword) != '_') {
+                throw std::runtime_error("consume mismatch");
+            }
+        }
+        throw std::runtime_error("invalid input");
+    }
+
+    bool step_parenthesized(size_t index, PTR(Expr) &result) {
+        Frame &frame = frames[index];
+        if (frame.state == 0) {
+            frame.state = 1;
+            enter_expr(local(frame.open_parenthesis));
+            return false;
+        }
+        int &open_parenthesis_to_match = local(frame.open_parenthesis);
+        if (open_parenthesis_to_match > 0 && lexer.peek().kind != tok_rparen) {
+            if (lexer.peek().kind == tok_eof) {
+                throw std::runtime_error("missing close parenthesis");
+            }
+        } else {
+            consume(lexer, tok_rparen, open_parenthesis_to_match);
+        }
+        return true;
+    }
+
+    bool step_let(size_t index, PTR(Expr) &result) {
+        Frame &frame = frames[index];
+        int &open_parenthesis_to_match = local(frame.open_parenthesis);
+        switch (frame.state) {
+            case 0:
+                frame.name = parse_variable(lexer, open_parenthesis_to_match)->to_string();
+                consume_word(lexer, "=", open_parenthesis_to_match);
+                frame.state = 1;
+                push(frame_comprag, frame.open_parenthesis);
+                return false;
+            case 1:
+                frame.operands.push_back(result);
+                consume_word(lexer, "_in", open_parenthesis_to_match);
+                frame.state = 2;
+                push(frame_comprag, frame.open_parenthesis);
+                return false;
+            default:
+                result = located(make_expr<LetExpr>(frame.name, frame.operands[0], result), frame.offset);
+                return true;
+        }
+    }
+
+    bool step_if(size_t index, PTR(Expr) &result) {
+        Frame &frame = frames[index];
+        int &open_parenthesis_to_match = local(frame.open_parenthesis);
+        switch (frame.state) {
+            case 0:
+                frame.state = 1;
+                enter_expr(open_parenthesis_to_match);
+                return false;
+            case 1:
+                frame.operands.push_back(result);
+                consume_word(lexer, "_then", open_parenthesis_to_match);
+                frame.state = 2;
+                enter_expr(open_parenthesis_to_match);
+                return false;
+            case 2:
+                frame.operands.push_back(result);
+                consume_word(lexer, "_else", open_parenthesis_to_match);
+                frame.state = 3;
+                enter_expr(open_parenthesis_to_match);
+                return false;
+            default:
+                result = located(make_expr<IfExpr>(frame.operands[0], frame.operands[1], result), frame.offset);
+                return true;
+        }
+    }
+
+    bool step_fun(size_t index, PTR(Expr) &result) {
+        Frame &frame = frames[index];
+        int &open_parenthesis_to_match = local(frame.open_parenthesis);
+        if (frame.state == 0) {
+            consume(lexer, tok_lparen, open_parenthesis_to_match);
+            frame.name = parse_variable(lexer, open_parenthesis_to_match)->to_string();
+            consume(lexer, tok_rparen, open_parenthesis_to_match);
+            frame.state = 1;
+            enter_expr(open_parenthesis_to_match);
+            return false;
+        }
+        result = located(make_expr<FunExpr>(frame.name, result), frame.offset);
+        return true;
+    }
+};
+
+}
+
+PTR(Expr) parse_expr_iterative(Lexer &lexer) {
+    return IterativeParser(lexer).parse();
+}
@@ -0,0 +1,15 @@
+#ifndef ITERATIVE_PARSE_H
+#define ITERATIVE_PARSE_H
+
+class Expr;
+
+#include "lexer.h"
+#include "pointer.h"
+
+// Same grammar, trees and errors as parse_expr(Lexer &), but driven by an
+// explicit stack: +, * and == chains are collected in loops (precedence
+// climbing) and nested _let/_if/_fun/parentheses push a frame instead of
+// recursing. Runs in linear time, and nesting depth is only limited by memory.
+PTR(Expr) parse_expr_iterative(Lexer &lexer);
+
+#endif // ITERATIVE_PARSE_H
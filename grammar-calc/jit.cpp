@@ -0,0 +1,675 @@
+#include "jit.h"
+#include "expr.hpp"
+#include "env.h"
+#include "eval_context.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <new>
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define JIT_X86_64 1
+#include <alloca.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// a value as the generated code holds it: payload in rax, tag in rdx, which
+// is also how a function returns this struct on x86-64 Unix
+struct JitValue {
+    uint64_t payload;
+    uint64_t tag;
+};
+
+// what one call of compiled code keeps on the C++ side; the code has it in rbx
+class JitFrame {
+public:
+    std::exception_ptr error;
+
+    // boxes is uninitialized room for count Values, which live as long as the frame
+    JitFrame(void *boxes, size_t count) : boxes(static_cast<Value *>(boxes)), count(count) {
+        for (size_t i = 0; i < count; i++) {
+            new (&this->boxes[i]) Value();
+        }
+    }
+
+    ~JitFrame() {
+        for (size_t i = 0; i < this->count; i++) {
+            this->boxes[i].~Value();
+        }
+    }
+
+    JitFrame(const JitFrame &) = delete;
+
+    JitFrame &operator=(const JitFrame &) = delete;
+
+    // every operation that can produce a heap value has its own box, so a
+    // box is never overwritten while something still points at it
+    Value &box(uint64_t i) {
+        return this->boxes[i];
+    }
+
+private:
+    Value *boxes;
+    size_t count;
+};
+
+namespace {
+
+std::atomic<uint32_t> threshold{100};
+
+// bodies larger than this are left to the interpreter; it also bounds the
+// stack one call of compiled code takes
+const size_t max_body_nodes = 512;
+
+enum jit_tag_t : uint64_t {
+    tag_num,
+    tag_bool,
+    // the payload is a const Value *
+    tag_value,
+    // the exception is in the JitFrame
+    tag_error,
+};
+
+typedef JitValue (*jit_code_t)(JitFrame *frame, const JitValue *vars);
+
+Value to_value(uint64_t payload, uint64_t tag) {
+    switch (tag) {
+        case tag_num:
+            return Value::from_num((int64_t) payload);
+        case tag_bool:
+            return Value::from_bool(payload != 0);
+        default:
+            return *(const Value *) payload;
+    }
+}
+
+// value must outlive the call: the argument, a captured variable or a box
+JitValue to_jit(const Value &value) {
+    if (value.is_num()) {
+        return JitValue{(uint64_t) value.as_num(), tag_num};
+    }
+    if (value.is_bool()) {
+        return JitValue{value.as_bool() ? 1u : 0u, tag_bool};
+    }
+    return JitValue{(uint64_t) &value, tag_value};
+}
+
+JitValue boxed(JitFrame *frame, Value value, uint64_t box) {
+    if (value.is_heap()) {
+        Value &slot = frame->box(box);
+        slot = std::move(value);
+        return to_jit(slot);
+    }
+    return to_jit(value);
+}
+
+// The generated code calls these for everything but int64 arithmetic without
+// overflow, comparisons of numbers and booleans and tests of booleans. No
+// exception may unwind through generated code, so they catch and report it.
+template<typename F>
+JitValue guarded(JitFrame *frame, F f) noexcept {
+    try {
+        return f();
+    } catch (...) {
+        frame->error = std::current_exception();
+        return JitValue{0, tag_error};
+    }
+}
+
+JitValue jit_add(JitFrame *frame, uint64_t lhs, uint64_t lhs_tag, uint64_t rhs, uint64_t rhs_tag, uint64_t box) noexcept {
+    return guarded(frame, [&] {
+        return boxed(frame, to_value(lhs, lhs_tag).add_to(to_value(rhs, rhs_tag)), box);
+    });
+}
+
+JitValue jit_mult(JitFrame *frame, uint64_t lhs, uint64_t lhs_tag, uint64_t rhs, uint64_t rhs_tag, uint64_t box) noexcept {
+    return guarded(frame, [&] {
+        return boxed(frame, to_value(lhs, lhs_tag).mult_with(to_value(rhs, rhs_tag)), box);
+    });
+}
+
+JitValue jit_eq(JitFrame *frame, uint64_t lhs, uint64_t lhs_tag, uint64_t rhs, uint64_t rhs_tag) noexcept {
+    return guarded(frame, [&] {
+        bool equal = to_value(lhs, lhs_tag).equals(to_value(rhs, rhs_tag));
+        return JitValue{equal ? 1u : 0u, tag_bool};
+    });
+}
+
+JitValue jit_is_true(JitFrame *frame, uint64_t condition, uint64_t condition_tag) noexcept {
+    return guarded(frame, [&] {
+        return JitValue{to_value(condition, condition_tag).is_true() ? 1u : 0u, tag_bool};
+    });
+}
+
+JitValue jit_call(JitFrame *frame, uint64_t callee, uint64_t callee_tag, uint64_t arg, uint64_t arg_tag, uint64_t box) noexcept {
+    return guarded(frame, [&] {
+        // a compiled callee runs straight from here, with the checks of
+        // FunVal::call and without making Values of the argument and result
+        FunVal *fun = callee_tag == tag_value ? val_cast<FunVal>(*(const Value *) callee) : nullptr;
+        JitFunction *jit = fun != nullptr ? fun->jit.get() : nullptr;
+        void *code = jit != nullptr ? jit->compiled() : nullptr;
+        EvalContext *context = EvalContext::current();
+        if (code != nullptr && (context == nullptr || context->memo == nullptr)) {
+            if (context != nullptr) {
+                context->tick();
+            }
+            CallDepth depth(context);
+            return jit->invoke(code, *fun, JitValue{arg, arg_tag}, frame->box(box), frame->error);
+        }
+        return boxed(frame, to_value(callee, callee_tag).call(to_value(arg, arg_tag)), box);
+    });
+}
+
+// the variable index of every VarExpr, -1 when one is not the argument or a capture
+class Layout {
+public:
+    Layout(const std::string &formal_arg, bool resolved, const std::vector<std::string> *names, size_t capture_count)
+        : formal_arg(formal_arg), resolved(resolved), names(names), capture_count(capture_count) {}
+
+    int index(const VarExpr *var) const {
+        if (this->resolved) {
+            if (var->depth == 0 && var->slot == 0) {
+                return 0;
+            }
+            if (var->depth == 1 && var->slot >= 0 && (size_t) var->slot < this->capture_count) {
+                return 1 + var->slot;
+            }
+            return -1;
+        }
+        if (var->variable == this->formal_arg) {
+            return 0;
+        }
+        auto found = std::find(this->names->begin(), this->names->end(), var->variable);
+        return found == this->names->end() ? -1 : 1 + (int) (found - this->names->begin());
+    }
+
+private:
+    const std::string &formal_arg;
+    bool resolved;
+    const std::vector<std::string> *names;
+    size_t capture_count;
+};
+
+// whether the compiler handles every node of body, counting the boxes it needs
+bool compilable(Expr *body, const Layout &layout, size_t &nodes, size_t &boxes) {
+    if (++nodes > max_body_nodes) {
+        return false;
+    }
+    switch (body->kind) {
+        case expr_num:
+            return static_cast<NumExpr *>(body)->val.is_num();
+        case expr_bool:
+            return true;
+        case expr_var:
+            return layout.index(static_cast<VarExpr *>(body)) >= 0;
+        case expr_add: {
+            auto *add = static_cast<AddExpr *>(body);
+            boxes++;
+            return compilable(add->lhs.get(), layout, nodes, boxes) && compilable(add->rhs.get(), layout, nodes, boxes);
+        }
+        case expr_mult: {
+            auto *mult = static_cast<MultExpr *>(body);
+            boxes++;
+            return compilable(mult->lhs.get(), layout, nodes, boxes) && compilable(mult->rhs.get(), layout, nodes, boxes);
+        }
+        case expr_eq: {
+            auto *eq = static_cast<EqExpr *>(body);
+            return compilable(eq->lhs.get(), layout, nodes, boxes) && compilable(eq->rhs.get(), layout, nodes, boxes);
+        }
+        case expr_if: {
+            auto *if_expr = static_cast<IfExpr *>(body);
+            return compilable(if_expr->condition.get(), layout, nodes, boxes)
+                && compilable(if_expr->then_expr.get(), layout, nodes, boxes)
+                && compilable(if_expr->else_expr.get(), layout, nodes, boxes);
+        }
+        case expr_call: {
+            auto *call = static_cast<CallExpr *>(body);
+            boxes++;
+            return compilable(call->to_be_called.get(), layout, nodes, boxes)
+                && compilable(call->actual_arg.get(), layout, nodes, boxes);
+        }
+        default:
+            return false;
+    }
+}
+
+#ifdef JIT_X86_64
+
+enum reg_t : uint8_t {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15,
+};
+
+// condition codes of jcc
+enum cond_t : uint8_t {
+    cond_overflow = 0x0,
+    cond_equal = 0x4,
+    cond_not_equal = 0x5,
+    cond_above = 0x7,
+};
+
+// the few instructions the compiler emits, all on 64-bit registers
+class Assembler {
+public:
+    std::vector<uint8_t> code;
+
+    // op r/m64, r64: add 01, or 09, xor 31, cmp 39, test 85, mov 89
+    void op(uint8_t opcode, reg_t dst, reg_t src) {
+        this->rex(src, dst);
+        this->byte(opcode);
+        this->byte(0xC0 | (src & 7) << 3 | (dst & 7));
+    }
+
+    void mov(reg_t dst, reg_t src) {
+        this->op(0x89, dst, src);
+    }
+
+    void imul(reg_t dst, reg_t src) {
+        this->rex(dst, src);
+        this->byte(0x0F);
+        this->byte(0xAF);
+        this->byte(0xC0 | (dst & 7) << 3 | (src & 7));
+    }
+
+    void mov_imm(reg_t dst, uint64_t imm) {
+        if (imm <= UINT32_MAX) {
+            // writing the low half zeroes the rest
+            if (dst >= r8) {
+                this->byte(0x41);
+            }
+            this->byte(0xB8 + (dst & 7));
+            this->word32((uint32_t) imm);
+            return;
+        }
+        this->rex(rax, dst);
+        this->byte(0xB8 + (dst & 7));
+        for (int i = 0; i < 8; i++) {
+            this->byte((uint8_t) (imm >> 8 * i));
+        }
+    }
+
+    // mov dst, [base + disp]
+    void load(reg_t dst, reg_t base, int32_t disp) {
+        this->rex(dst, base);
+        this->byte(0x8B);
+        this->byte(0x80 | (dst & 7) << 3 | (base & 7));
+        if ((base & 7) == rsp) {
+            this->byte(0x24);
+        }
+        this->word32((uint32_t) disp);
+    }
+
+    // cmp reg, imm8
+    void cmp_imm(reg_t reg, int8_t imm) {
+        this->rex(rax, reg);
+        this->byte(0x83);
+        this->byte(0xF8 | (reg & 7));
+        this->byte((uint8_t) imm);
+    }
+
+    void push(reg_t reg) {
+        if (reg >= r8) {
+            this->byte(0x41);
+        }
+        this->byte(0x50 + (reg & 7));
+    }
+
+    void pop(reg_t reg) {
+        if (reg >= r8) {
+            this->byte(0x41);
+        }
+        this->byte(0x58 + (reg & 7));
+    }
+
+    // sete al
+    void set_equal() {
+        this->byte(0x0F);
+        this->byte(0x94);
+        this->byte(0xC0);
+    }
+
+    void call(const void *target) {
+        this->mov_imm(rax, (uint64_t) target);
+        this->byte(0xFF);
+        this->byte(0xD0);
+    }
+
+    // a forward jump, to be bound with bind(); jmp when cond is omitted
+    size_t jump(int cond = -1) {
+        if (cond < 0) {
+            this->byte(0xE9);
+        } else {
+            this->byte(0x0F);
+            this->byte(0x80 + cond);
+        }
+        this->word32(0);
+        return this->code.size();
+    }
+
+    // makes the jump that ends at from land here
+    void bind(size_t from) {
+        uint32_t rel = (uint32_t) (this->code.size() - from);
+        std::memcpy(&this->code[from - 4], &rel, 4);
+    }
+
+    void byte(uint8_t b) {
+        this->code.push_back(b);
+    }
+
+private:
+    // REX.W, with the high bits of the ModRM reg and rm registers
+    void rex(reg_t reg, reg_t rm) {
+        this->byte(0x48 | (reg >= r8 ? 4 : 0) | (rm >= r8 ? 1 : 0));
+    }
+
+    void word32(uint32_t word) {
+        for (int i = 0; i < 4; i++) {
+            this->byte((uint8_t) (word >> 8 * i));
+        }
+    }
+};
+
+// Compiles a body to one function taking the JitFrame in rdi and the
+// variables in rsi, kept in rbx and r12. Each node leaves its value in
+// rax/rdx; an operand waiting for the other is pushed as a pair, so the
+// stack stays 16-byte aligned for the helper calls.
+class Compiler {
+public:
+    Assembler as;
+
+    explicit Compiler(const Layout &layout) : layout(layout) {}
+
+    void function(Expr *body) {
+        this->as.push(rbp);
+        this->as.mov(rbp, rsp);
+        this->as.push(rbx);
+        this->as.push(r12);
+        this->as.mov(rbx, rdi);
+        this->as.mov(r12, rsi);
+        this->expr(body);
+        for (size_t exit : this->exits) {
+            this->as.bind(exit);
+        }
+        // lea rsp, [rbp - 16]: drops whatever an error left pushed
+        for (uint8_t b : {0x48, 0x8D, 0x65, 0xF0}) {
+            this->as.byte(b);
+        }
+        this->as.pop(r12);
+        this->as.pop(rbx);
+        this->as.pop(rbp);
+        this->as.byte(0xC3);
+    }
+
+private:
+    const Layout &layout;
+    size_t boxes = 0;
+    // jumps to the epilogue, taken with an error in rax/rdx
+    std::vector<size_t> exits;
+
+    void expr(Expr *expr) {
+        switch (expr->kind) {
+            case expr_num:
+                this->as.mov_imm(rax, (uint64_t) static_cast<NumExpr *>(expr)->val.as_num());
+                this->as.op(0x31, rdx, rdx);
+                return;
+            case expr_bool:
+                this->as.mov_imm(rax, static_cast<BoolExpr *>(expr)->rep ? 1 : 0);
+                this->as.mov_imm(rdx, tag_bool);
+                return;
+            case expr_var: {
+                int32_t at = (int32_t) (this->layout.index(static_cast<VarExpr *>(expr)) * sizeof(JitValue));
+                this->as.load(rax, r12, at);
+                this->as.load(rdx, r12, at + 8);
+                return;
+            }
+            case expr_add: {
+                auto *add = static_cast<AddExpr *>(expr);
+                this->operands(add->lhs.get(), add->rhs.get());
+                this->arithmetic(0x01, (const void *) &jit_add);
+                return;
+            }
+            case expr_mult: {
+                auto *mult = static_cast<MultExpr *>(expr);
+                this->operands(mult->lhs.get(), mult->rhs.get());
+                this->arithmetic(0xAF, (const void *) &jit_mult);
+                return;
+            }
+            case expr_eq: {
+                auto *eq = static_cast<EqExpr *>(expr);
+                this->operands(eq->lhs.get(), eq->rhs.get());
+                this->equals();
+                return;
+            }
+            case expr_if: {
+                auto *if_expr = static_cast<IfExpr *>(expr);
+                this->expr(if_expr->condition.get());
+                this->as.cmp_imm(rdx, tag_bool);
+                size_t is_bool = this->as.jump(cond_equal);
+                this->as.mov(rsi, rax);
+                this->helper((const void *) &jit_is_true);
+                this->as.bind(is_bool);
+                this->as.op(0x85, rax, rax);
+                size_t is_false = this->as.jump(cond_equal);
+                this->expr(if_expr->then_expr.get());
+                size_t done = this->as.jump();
+                this->as.bind(is_false);
+                this->expr(if_expr->else_expr.get());
+                this->as.bind(done);
+                return;
+            }
+            case expr_call: {
+                auto *call = static_cast<CallExpr *>(expr);
+                this->operands(call->to_be_called.get(), call->actual_arg.get());
+                this->as.mov_imm(r9, this->boxes++);
+                this->helper((const void *) &jit_call);
+                return;
+            }
+            default:
+                // compilable() let something through that expr() does not know
+                throw std::logic_error("cannot compile expression kind");
+        }
+    }
+
+    // evaluates lhs then rhs, leaving lhs in rsi/rdx and rhs in rcx/r8, the
+    // registers of the helpers' second to fifth arguments
+    void operands(Expr *lhs, Expr *rhs) {
+        this->expr(lhs);
+        this->as.push(rax);
+        this->as.push(rdx);
+        this->expr(rhs);
+        this->as.mov(rcx, rax);
+        this->as.mov(r8, rdx);
+        this->as.pop(rdx);
+        this->as.pop(rsi);
+    }
+
+    // add or imul of two numbers, or the helper when either is not one or the result overflows
+    void arithmetic(uint8_t opcode, const void *slow) {
+        this->as.mov(rax, rdx);
+        this->as.op(0x09, rax, r8);
+        size_t not_nums = this->as.jump(cond_not_equal);
+        this->as.mov(rax, rsi);
+        if (opcode == 0xAF) {
+            this->as.imul(rax, rcx);
+        } else {
+            this->as.op(opcode, rax, rcx);
+        }
+        size_t overflow = this->as.jump(cond_overflow);
+        this->as.op(0x31, rdx, rdx);
+        size_t done = this->as.jump();
+        this->as.bind(not_nums);
+        this->as.bind(overflow);
+        this->as.mov_imm(r9, this->boxes++);
+        this->helper(slow);
+        this->as.bind(done);
+    }
+
+    // two numbers or booleans are equal when their tags and payloads are
+    void equals() {
+        this->as.mov(rax, rdx);
+        this->as.op(0x09, rax, r8);
+        this->as.cmp_imm(rax, tag_bool);
+        size_t not_immediate = this->as.jump(cond_above);
+        this->as.op(0x31, rax, rax);
+        this->as.op(0x39, rdx, r8);
+        size_t different = this->as.jump(cond_not_equal);
+        this->as.op(0x39, rsi, rcx);
+        this->as.set_equal();
+        this->as.bind(different);
+        this->as.mov_imm(rdx, tag_bool);
+        size_t done = this->as.jump();
+        this->as.bind(not_immediate);
+        this->helper((const void *) &jit_eq);
+        this->as.bind(done);
+    }
+
+    // calls a helper with the frame and whatever arguments are already in
+    // place, leaving the function when it reports an error
+    void helper(const void *target) {
+        this->as.mov(rdi, rbx);
+        this->as.call(target);
+        this->as.cmp_imm(rdx, tag_error);
+        this->exits.push_back(this->as.jump(cond_equal));
+    }
+};
+
+#endif
+
+}
+
+bool jit_available() {
+#ifdef JIT_X86_64
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint32_t jit_threshold() {
+    return threshold.load(std::memory_order_relaxed);
+}
+
+void set_jit_threshold(uint32_t calls) {
+    threshold.store(calls, std::memory_order_relaxed);
+}
+
+PTR(JitFunction) JitFunction::make(const FunExpr &fun, PTR(const std::vector<std::string>) names) {
+    if (!jit_available()) {
+        return nullptr;
+    }
+    PTR(JitFunction) made = NEW(JitFunction)(fun, std::move(names));
+    Layout layout(made->formal_arg, made->resolved, made->names.get(), made->var_count - 1);
+    size_t nodes = 0;
+    if (!compilable(made->body, layout, nodes, made->box_count)) {
+        return nullptr;
+    }
+    return made;
+}
+
+JitFunction::JitFunction(const FunExpr &fun, PTR(const std::vector<std::string>) names) {
+    this->body = fun.body.get();
+    this->formal_arg = fun.formal_arg;
+    this->resolved = fun.frame_size >= 0;
+    this->names = std::move(names);
+    this->var_count = 1 + (this->resolved ? fun.captures.size() : this->names->size());
+}
+
+JitFunction::~JitFunction() {
+#ifdef JIT_X86_64
+    void *code = this->code.load(std::memory_order_acquire);
+    if (code != nullptr) {
+        munmap(code, this->code_size);
+    }
+#endif
+}
+
+bool JitFunction::run(const FunVal &fun, const Value &actual_arg, Value &result) {
+    void *code = this->code.load(std::memory_order_acquire);
+    if (code == nullptr) {
+        // a lost count between threads only delays compiling
+        uint32_t calls = this->calls.load(std::memory_order_relaxed);
+        uint32_t needed = jit_threshold();
+        if (needed == 0 || calls < needed) {
+            this->calls.store(calls + 1, std::memory_order_relaxed);
+            return false;
+        }
+        if (this->failed.load(std::memory_order_relaxed) || (code = this->compile()) == nullptr) {
+            return false;
+        }
+    }
+    std::exception_ptr error;
+    JitValue returned = this->invoke(code, fun, to_jit(actual_arg), result, error);
+    if (returned.tag == tag_error) {
+        std::rethrow_exception(error);
+    }
+    if (returned.tag != tag_value) {
+        result = to_value(returned.payload, returned.tag);
+    }
+    return true;
+}
+
+JitValue JitFunction::invoke(void *code, const FunVal &fun, JitValue arg, Value &result, std::exception_ptr &error) {
+#ifdef JIT_X86_64
+    // sized for this body on the stack, so deep recursion through compiled
+    // code runs out of stack no sooner than the interpreter does
+    auto *vars = static_cast<JitValue *>(alloca(sizeof(JitValue) * this->var_count));
+    vars[0] = arg;
+    if (this->resolved) {
+        auto *captured = static_cast<FrameEnv *>(fun.env.get());
+        for (size_t i = 1; i < this->var_count; i++) {
+            vars[i] = to_jit(captured->slots[i - 1]);
+        }
+    } else if (this->var_count > 1) {
+        // FunExpr::interp only hands this to closures whose env is a ClosureEnv
+        auto *captured = static_cast<ClosureEnv *>(fun.env.get());
+        for (size_t i = 1; i < this->var_count; i++) {
+            vars[i] = to_jit(captured->vals[i - 1]);
+        }
+    }
+    void *boxes = alloca(sizeof(Value) * this->box_count);
+    JitFrame frame(boxes, this->box_count);
+    JitValue returned = ((jit_code_t) code)(&frame, vars);
+    if (returned.tag == tag_value) {
+        // it may point into frame, which is about to go
+        result = *(const Value *) returned.payload;
+        return to_jit(result);
+    }
+    if (returned.tag == tag_error) {
+        error = std::move(frame.error);
+    }
+    return returned;
+#else
+    error = std::make_exception_ptr(std::logic_error("no native code in this build"));
+    return JitValue{0, tag_error};
+#endif
+}
+
+void *JitFunction::compile() {
+    std::lock_guard<std::mutex> lock(this->compiling);
+    void *code = this->code.load(std::memory_order_acquire);
+    if (code != nullptr || this->failed.load(std::memory_order_relaxed)) {
+        return code;
+    }
+#ifdef JIT_X86_64
+    Layout layout(this->formal_arg, this->resolved, this->names.get(), this->var_count - 1);
+    Compiler compiler(layout);
+    compiler.function(this->body);
+    const std::vector<uint8_t> &bytes = compiler.as.code;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t size = (bytes.size() + page - 1) / page * page;
+    // written while only writable, then only executable
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        std::memcpy(memory, bytes.data(), bytes.size());
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0) {
+            this->code_size = size;
+            this->code.store(memory, std::memory_order_release);
+            return memory;
+        }
+        munmap(memory, size);
+    }
+#endif
+    this->failed.store(true, std::memory_order_relaxed);
+    return nullptr;
+}
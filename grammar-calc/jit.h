@@ -0,0 +1,87 @@
+#ifndef JIT_H
+#define JIT_H
+
+class FunExpr;
+class FunVal;
+class JitFrame;
+struct JitValue;
+
+#include "pointer.h"
+#include "val.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// true when this build can generate native code (x86-64 on a Unix-like
+// system); elsewhere every call stays with the interpreter
+bool jit_available();
+
+// calls through FunVal::call before a function body is compiled; 0 never
+// compiles. Read on each call of a body not compiled yet, so it takes effect
+// for functions already made too.
+uint32_t jit_threshold();
+
+void set_jit_threshold(uint32_t calls);
+
+// Native x86-64 code for the body of one FunExpr, compiled once its closures
+// have been called jit_threshold() times. Only bodies built from numbers,
+// booleans, +, *, ==, _if, variables and calls are compiled. Numbers and
+// booleans stay in registers; anything else the code meets at run time (a
+// closure, an overflowing result, a type error) is handed to the Value
+// operations the interpreter uses, so results and error messages are the same.
+// Shared by the FunExpr's closures, which may run on any thread.
+class JitFunction {
+public:
+    // nullptr when the body has something the compiler does not handle or
+    // this build cannot compile; names is the ClosureEnv layout for an
+    // unresolved body
+    static PTR(JitFunction) make(const FunExpr &fun, PTR(const std::vector<std::string>) names);
+
+    JitFunction(const FunExpr &fun, PTR(const std::vector<std::string>) names);
+
+    ~JitFunction();
+
+    JitFunction(const JitFunction &) = delete;
+
+    JitFunction &operator=(const JitFunction &) = delete;
+
+    // counts the call and runs the compiled body when there is one, putting
+    // its value in result; false leaves the call to the interpreter
+    bool run(const FunVal &fun, const Value &actual_arg, Value &result);
+
+    // the compiled body, nullptr until it is compiled
+    void *compiled() const {
+        return this->code.load(std::memory_order_acquire);
+    }
+
+    // runs code, the compiled body, for fun and arg; a heap result is copied
+    // to result, which the returned value then points at, and an error is
+    // left in error. Also how compiled code calls compiled code directly.
+    JitValue invoke(void *code, const FunVal &fun, JitValue arg, Value &result, std::exception_ptr &error);
+
+private:
+    // the body stays alive as long as fun's closures, which hold this
+    Expr *body;
+    std::string formal_arg;
+    bool resolved;
+    PTR(const std::vector<std::string>) names;
+    // the argument, then each captured variable
+    size_t var_count;
+    // results the code may need to keep as Values during one call
+    size_t box_count = 0;
+
+    std::atomic<uint32_t> calls{0};
+    std::atomic<void *> code{nullptr};
+    std::atomic<bool> failed{false};
+    std::mutex compiling;
+    size_t code_size = 0;
+
+    void *compile();
+};
+
+#endif // JIT_H
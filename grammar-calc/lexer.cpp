@@ -0,0 +1,175 @@
+#include "lexer.h"
+
+#include <cstdio>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+bool is_space(char ch) {
+    return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+bool is_digit(char ch) {
+    return (unsigned char) (ch - '0') < 10;
+}
+
+bool is_alpha(char ch) {
+    return (unsigned char) ((ch | 0x20) - 'a') < 26;
+}
+
+// characters a variable may be directly followed by, see parse_variable
+bool may_follow_variable(const char *ch, const char *end) {
+    return ch == end || is_space(*ch) || *ch == '+' || *ch == '*' || *ch == ')' || *ch == '(' || *ch == '=';
+}
+
+#if defined(__SSE2__)
+
+// bit i set when p[i] is a whitespace character
+unsigned space_mask(__m128i chunk) {
+    __m128i blank = _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '));
+    // '\t'..'\r' is 9..13: shift the range to the bottom of the signed range and compare once
+    __m128i shifted = _mm_sub_epi8(chunk, _mm_set1_epi8((char) ('\t' - 128)));
+    __m128i control = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char) (-128 + 5)));
+    return (unsigned) _mm_movemask_epi8(_mm_or_si128(blank, control));
+}
+
+unsigned digit_mask(__m128i chunk) {
+    __m128i shifted = _mm_sub_epi8(chunk, _mm_set1_epi8((char) ('0' - 128)));
+    return (unsigned) _mm_movemask_epi8(_mm_cmplt_epi8(shifted, _mm_set1_epi8((char) (-128 + 10))));
+}
+
+#endif
+
+const char *skip_spaces(const char *p, const char *end) {
+#if defined(__SSE2__)
+    while (end - p >= 16) {
+        unsigned mask = space_mask(_mm_loadu_si128((const __m128i *) p));
+        if (mask != 0xFFFF) {
+            return p + __builtin_ctz(~mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && is_space(*p)) {
+        p++;
+    }
+    return p;
+}
+
+const char *skip_digits(const char *p, const char *end) {
+#if defined(__SSE2__)
+    while (end - p >= 16) {
+        unsigned mask = digit_mask(_mm_loadu_si128((const __m128i *) p));
+        if (mask != 0xFFFF) {
+            return p + __builtin_ctz(~mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && is_digit(*p)) {
+        p++;
+    }
+    return p;
+}
+
+const char *skip_letters(const char *p, const char *end) {
+    while (p < end && is_alpha(*p)) {
+        p++;
+    }
+    return p;
+}
+
+}
+
+Lexer::Lexer(std::string_view source) : source(source) {
+    this->pos = 0;
+    this->current = this->scan();
+}
+
+Token Lexer::next() {
+    Token token = this->current;
+    this->current = this->scan();
+    return token;
+}
+
+int Lexer::first_char(const Token &token) const {
+    if (token.kind == tok_eof) {
+        return EOF;
+    }
+    return (unsigned char) this->source[token.offset];
+}
+
+int Lexer::char_after(const Token &token) const {
+    size_t after = token.offset + token.length;
+    if (after >= this->source.size()) {
+        return EOF;
+    }
+    return (unsigned char) this->source[after];
+}
+
+void Lexer::consume_prefix(size_t length) {
+    this->pos = this->current.offset + length;
+    this->current = this->scan();
+}
+
+void Lexer::seek(size_t offset) {
+    this->pos = offset;
+    this->current = this->scan();
+}
+
+Token Lexer::scan() {
+    const char *begin = this->source.data();
+    const char *end = begin + this->source.size();
+    const char *p = skip_spaces(begin + this->pos, end);
+    Token token{tok_eof, (size_t) (p - begin), 0, 0, false, false};
+    if (p == end) {
+        this->pos = token.offset;
+        return token;
+    }
+
+    const char *stop = p + 1;
+    char ch = *p;
+    if (is_digit(ch) || (ch == '-' && p + 1 < end && is_digit(p[1]))) {
+        const char *digits = ch == '-' ? p + 1 : p;
+        stop = skip_digits(digits, end);
+        // the magnitude, until it no longer fits; -2^63 is the one that only fits negated
+        const uint64_t max = (uint64_t) INT64_MAX + (ch == '-' ? 1 : 0);
+        uint64_t num = 0;
+        for (const char *d = digits; d < stop && !token.big; d++) {
+            token.big = num > (max - (*d - '0')) / 10;
+            num = num * 10 + (*d - '0');
+        }
+        token.kind = tok_num;
+        token.value = token.big ? 0 : ch == '-' ? (int64_t) (0 - num) : (int64_t) num;
+    } else if (is_alpha(ch)) {
+        stop = skip_letters(p, end);
+        token.kind = tok_identifier;
+        token.bad_follow = !may_follow_variable(stop, end);
+    } else if (ch == '_') {
+        stop = skip_letters(p + 1, end);
+        token.kind = tok_keyword;
+    } else if (ch == '=') {
+        if (p + 1 < end && p[1] == '=') {
+            stop = p + 2;
+            token.kind = tok_eq;
+        } else {
+            token.kind = tok_assign;
+        }
+    } else if (ch == '(') {
+        token.kind = tok_lparen;
+    } else if (ch == ')') {
+        token.kind = tok_rparen;
+    } else if (ch == '+') {
+        token.kind = tok_plus;
+    } else if (ch == '*') {
+        token.kind = tok_star;
+    } else {
+        token.kind = tok_invalid;
+    }
+    token.length = stop - p;
+    this->pos = stop - begin;
+    return token;
+}
@@ -0,0 +1,71 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+enum token_kind_t {
+    tok_eof,
+    tok_num,         // digits, with a leading - when it is directly followed by a digit
+    tok_identifier,  // alphabetic word
+    tok_keyword,     // _ followed by letters, e.g. _let
+    tok_lparen,
+    tok_rparen,
+    tok_plus,
+    tok_star,
+    tok_assign,      // =
+    tok_eq,          // ==
+    tok_invalid,     // any other character, or a - that is not followed by a digit
+};
+
+struct Token {
+    token_kind_t kind;
+    size_t offset;
+    size_t length;
+    int64_t value;
+    // identifiers only: the character after the word is not one a variable may be followed by
+    bool bad_follow;
+    // numbers only: the literal does not fit in value, which is then 0; its text has the digits
+    bool big;
+};
+
+// Scans tokens lazily out of a contiguous buffer that must outlive the lexer.
+// Nothing is copied: token text is a view into the source.
+class Lexer {
+public:
+    explicit Lexer(std::string_view source);
+
+    const Token &peek() {
+        return this->current;
+    }
+
+    Token next();
+
+    std::string_view text(const Token &token) const {
+        return this->source.substr(token.offset, token.length);
+    }
+
+    // first character of the token, or EOF, as istream::peek() would report it
+    int first_char(const Token &token) const;
+
+    // character right after the token, or EOF
+    int char_after(const Token &token) const;
+
+    // consume a prefix of the current keyword token, e.g. _in out of _inx, and rescan what is left
+    void consume_prefix(size_t length);
+
+    // continue scanning at offset, which must be where a token (or whitespace before one) starts
+    void seek(size_t offset);
+
+    std::string_view source;
+
+private:
+    size_t pos;
+    Token current;
+
+    Token scan();
+};
+
+#endif // LEXER_H
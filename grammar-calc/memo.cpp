@@ -0,0 +1,141 @@
+#include "memo.h"
+#include "env.h"
+#include "free_vars.h"
+#include "big_num.h"
+
+#include <functional>
+
+static bool same_value(const Value &a, const Value &b) {
+    if (a.is_num()) {
+        return b.is_num() && a.as_num() == b.as_num();
+    }
+    if (a.is_bool()) {
+        return b.is_bool() && a.as_bool() == b.as_bool();
+    }
+    if (val_cast<BigNumVal>(a) != nullptr) {
+        return a.equals(b);
+    }
+    return b.is_heap() && a.as_heap() == b.as_heap();
+}
+
+static size_t hash_value(const Value &value) {
+    if (is_number(value)) {
+        return hash_number(value);
+    }
+    if (value.is_bool()) {
+        return value.as_bool() ? 0x9e3779b9u : 0x7f4a7c15u;
+    }
+    return std::hash<Val *>()(value.as_heap().get());
+}
+
+static void hash_combine(size_t &seed, size_t hash) {
+    seed ^= hash + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+}
+
+bool MemoCache::Key::operator==(const Key &other) const {
+    if (this->function != other.function || !same_value(this->arg, other.arg)
+        || this->captured.size() != other.captured.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < this->captured.size(); i++) {
+        if (!same_value(this->captured[i], other.captured[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t MemoCache::KeyHash::operator()(const Key &key) const {
+    size_t seed = std::hash<const BodyInfo *>()(key.function);
+    hash_combine(seed, hash_value(key.arg));
+    for (const Value &value : key.captured) {
+        hash_combine(seed, hash_value(value));
+    }
+    return seed;
+}
+
+MemoCache::MemoCache(size_t max_entries) {
+    this->max_entries = max_entries;
+}
+
+const MemoCache::BodyInfo &MemoCache::body_info(FunVal &fun) {
+    auto range = this->bodies.equal_range(fun.body.get());
+    for (auto found = range.first; found != range.second; ++found) {
+        if (found->second.formal_arg == fun.formal_arg) {
+            return found->second;
+        }
+    }
+    BodyInfo info;
+    info.formal_arg = fun.formal_arg;
+    info.body = fun.body;
+    if (fun.frame_size >= 0) {
+        info.addresses = free_addresses(fun.body);
+    } else {
+        info.names = free_variables(fun.body, fun.formal_arg);
+    }
+    return this->bodies.emplace(fun.body.get(), std::move(info))->second;
+}
+
+// false when a captured variable cannot be read: the body may never touch it,
+// so such a call just runs uncached
+bool MemoCache::make_key(FunVal &fun, const Value &actual_arg, Key &key) {
+    const BodyInfo &info = this->body_info(fun);
+    key.function = &info;
+    key.arg = actual_arg;
+    if (fun.frame_size >= 0) {
+        auto *frame = static_cast<FrameEnv *>(fun.env.get());
+        for (const auto &address : info.addresses) {
+            key.captured.push_back(frame->lookup(address.first, address.second));
+        }
+        return true;
+    }
+    try {
+        for (const std::string &name : info.names) {
+            key.captured.push_back(fun.env->lookup(name));
+        }
+    } catch (const std::runtime_error &) {
+        return false;
+    }
+    return true;
+}
+
+Value MemoCache::call(FunVal &fun, const Value &actual_arg) {
+    Key key;
+    if (!this->make_key(fun, actual_arg, key)) {
+        return fun.apply(actual_arg);
+    }
+    auto found = this->index.find(key);
+    if (found != this->index.end()) {
+        this->counters.hits++;
+        this->entries.splice(this->entries.begin(), this->entries, found->second);
+        return found->second->second;
+    }
+    this->counters.misses++;
+
+    // the body can call back into the cache, so nothing is held across it
+    Value result = fun.apply(actual_arg);
+    if (this->max_entries == 0 || this->index.count(key) > 0) {
+        return result;
+    }
+    this->entries.emplace_front(std::move(key), result);
+    this->index.emplace(this->entries.front().first, this->entries.begin());
+    if (this->entries.size() > this->max_entries) {
+        this->index.erase(this->entries.back().first);
+        this->entries.pop_back();
+        this->counters.evictions++;
+    }
+    return result;
+}
+
+MemoStats MemoCache::stats() const {
+    MemoStats stats = this->counters;
+    stats.size = this->entries.size();
+    return stats;
+}
+
+void MemoCache::clear() {
+    this->entries.clear();
+    this->index.clear();
+    this->bodies.clear();
+    this->counters = MemoStats();
+}
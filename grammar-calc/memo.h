@@ -0,0 +1,77 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+class Expr;
+class FunVal;
+
+#include "pointer.h"
+#include "val.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct MemoStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t size = 0;
+};
+
+// Caches FunVal calls. Evaluation is pure, so a call is determined by the
+// function (its formal argument and body), the values of the variables the body reads from its closure,
+// and the argument. Closures compare by identity, numbers and booleans by value.
+// Keys hold on to what they mention, so an entry can never match a recycled
+// address. At most max_entries results are kept; the least recently used goes first.
+class MemoCache {
+public:
+    explicit MemoCache(size_t max_entries = 100000);
+
+    Value call(FunVal &fun, const Value &actual_arg);
+
+    MemoStats stats() const;
+
+    void clear();
+
+private:
+    // what a function reads from its closure, worked out on its first call.
+    // Hash-consed functions with different formal arguments can share one
+    // body, so it belongs to the pair.
+    struct BodyInfo {
+        std::string formal_arg;
+        PTR(Expr) body;
+        std::vector<std::string> names;
+        std::vector<std::pair<int, int>> addresses;
+    };
+
+    struct Key {
+        // owned by bodies, which is only cleared together with the entries
+        const BodyInfo *function = nullptr;
+        std::vector<Value> captured;
+        Value arg;
+
+        bool operator==(const Key &other) const;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const;
+    };
+
+    typedef std::list<std::pair<Key, Value>> Entries;
+
+    size_t max_entries;
+    Entries entries;
+    std::unordered_map<Key, Entries::iterator, KeyHash> index;
+    std::unordered_multimap<Expr *, BodyInfo> bodies;
+    MemoStats counters;
+
+    const BodyInfo &body_info(FunVal &fun);
+
+    bool make_key(FunVal &fun, const Value &actual_arg, Key &key);
+};
+
+#endif // MEMO_H
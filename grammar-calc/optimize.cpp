@@ -0,0 +1,205 @@
+#include "optimize.h"
+#include "visitor.h"
+#include "free_vars.h"
+#include "val.hpp"
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct Binding {
+    // the literal the variable stands for, or nullptr
+    PTR(Expr) literal;
+    int uses = 0;
+};
+
+bool is_literal(const PTR(Expr) &expr) {
+    return expr->kind == expr_num || expr->kind == expr_bool;
+}
+
+Value literal_value(const PTR(Expr) &expr) {
+    if (expr->kind == expr_num) {
+        return expr_cast<NumExpr>(expr)->val;
+    }
+    return Value::from_bool(expr_cast<BoolExpr>(expr)->rep);
+}
+
+PTR(Expr) value_literal(const Value &value) {
+    if (value.is_bool()) {
+        return NEW(BoolExpr)(value.as_bool());
+    }
+    return NEW(NumExpr)(value);
+}
+
+class Optimizer : public ExprVisitor<Optimizer, PTR(Expr)> {
+public:
+    const OptimizeOptions &options;
+    OptimizeStats &stats;
+    // innermost binding of each name last; functions push an entry without a literal to shadow
+    std::unordered_map<std::string, std::vector<Binding>> scope;
+
+    Optimizer(const OptimizeOptions &options, OptimizeStats &stats) : options(options), stats(stats) {}
+
+    PTR(Expr) visit_num(NumExpr *num) {
+        return num->THIS;
+    }
+
+    PTR(Expr) visit_bool(BoolExpr *boolean) {
+        return boolean->THIS;
+    }
+
+    PTR(Expr) visit_var(VarExpr *var) {
+        Binding *binding = lookup(var->variable);
+        if (binding == nullptr) {
+            return var->THIS;
+        }
+        if (binding->literal != nullptr) {
+            return binding->literal;
+        }
+        binding->uses++;
+        return var->THIS;
+    }
+
+    PTR(Expr) visit_add(AddExpr *add) {
+        PTR(Expr) lhs = visit(add->lhs);
+        PTR(Expr) rhs = visit(add->rhs);
+        PTR(Expr) folded = fold(lhs, rhs, [](const Value &l, const Value &r) { return l.add_to(r); });
+        if (folded != nullptr) {
+            return folded;
+        }
+        if (lhs == add->lhs && rhs == add->rhs) {
+            return add->THIS;
+        }
+        return NEW(AddExpr)(lhs, rhs);
+    }
+
+    PTR(Expr) visit_mult(MultExpr *mult) {
+        PTR(Expr) lhs = visit(mult->lhs);
+        PTR(Expr) rhs = visit(mult->rhs);
+        PTR(Expr) folded = fold(lhs, rhs, [](const Value &l, const Value &r) { return l.mult_with(r); });
+        if (folded != nullptr) {
+            return folded;
+        }
+        if (lhs == mult->lhs && rhs == mult->rhs) {
+            return mult->THIS;
+        }
+        return NEW(MultExpr)(lhs, rhs);
+    }
+
+    PTR(Expr) visit_eq(EqExpr *eq) {
+        PTR(Expr) lhs = visit(eq->lhs);
+        PTR(Expr) rhs = visit(eq->rhs);
+        PTR(Expr) folded = fold(lhs, rhs, [](const Value &l, const Value &r) { return Value::from_bool(l.equals(r)); });
+        if (folded != nullptr) {
+            return folded;
+        }
+        if (lhs == eq->lhs && rhs == eq->rhs) {
+            return eq->THIS;
+        }
+        return NEW(EqExpr)(lhs, rhs);
+    }
+
+    PTR(Expr) visit_if(IfExpr *if_expr) {
+        PTR(Expr) condition = visit(if_expr->condition);
+        // only a boolean picks a branch, a number condition has to fail at run time
+        if (options.fold_constants && condition->kind == expr_bool) {
+            stats.branches_pruned++;
+            return visit(expr_cast<BoolExpr>(condition)->rep ? if_expr->then_expr : if_expr->else_expr);
+        }
+        PTR(Expr) then_expr = visit(if_expr->then_expr);
+        PTR(Expr) else_expr = visit(if_expr->else_expr);
+        if (condition == if_expr->condition && then_expr == if_expr->then_expr && else_expr == if_expr->else_expr) {
+            return if_expr->THIS;
+        }
+        return NEW(IfExpr)(condition, then_expr, else_expr);
+    }
+
+    PTR(Expr) visit_let(LetExpr *let) {
+        PTR(Expr) rhs = visit(let->rhs);
+        bool inline_rhs = options.inline_literal_lets && is_literal(rhs);
+        std::vector<Binding> &bindings = scope[let->lhs];
+        bindings.push_back(Binding{inline_rhs ? rhs : nullptr, 0});
+        PTR(Expr) body = visit(let->body);
+        std::vector<Binding> &after = scope[let->lhs];
+        int uses = after.back().uses;
+        after.pop_back();
+
+        if (inline_rhs) {
+            stats.lets_inlined++;
+        }
+        if (options.remove_dead_lets && uses == 0 && cannot_fail(rhs)) {
+            stats.dead_lets_removed++;
+            return body;
+        }
+        if (rhs == let->rhs && body == let->body) {
+            return let->THIS;
+        }
+        PTR(LetExpr) rewritten = NEW(LetExpr)(let->lhs, rhs, body);
+        rewritten->slot = let->slot;
+        return rewritten;
+    }
+
+    // FunVal::equals compares bodies by structure, so a body is kept exactly as
+    // written; the variables it reads from outside still count as uses
+    PTR(Expr) visit_fun(FunExpr *fun) {
+        for (const std::string &name : free_variables(fun->body, fun->formal_arg)) {
+            Binding *binding = lookup(name);
+            if (binding != nullptr) {
+                binding->uses++;
+            }
+        }
+        return fun->THIS;
+    }
+
+    PTR(Expr) visit_call(CallExpr *call) {
+        PTR(Expr) to_be_called = visit(call->to_be_called);
+        PTR(Expr) actual_arg = visit(call->actual_arg);
+        if (to_be_called == call->to_be_called && actual_arg == call->actual_arg) {
+            return call->THIS;
+        }
+        return NEW(CallExpr)(to_be_called, actual_arg);
+    }
+
+private:
+    Binding *lookup(const std::string &name) {
+        auto found = scope.find(name);
+        if (found == scope.end() || found->second.empty()) {
+            return nullptr;
+        }
+        return &found->second.back();
+    }
+
+    // literals, functions and bound variables evaluate without error
+    bool cannot_fail(const PTR(Expr) &expr) {
+        if (is_literal(expr) || expr->kind == expr_fun) {
+            return true;
+        }
+        return expr->kind == expr_var && lookup(expr_cast<VarExpr>(expr)->variable) != nullptr;
+    }
+
+    // the literal op produces from two literals, or nullptr when it would throw
+    template<typename Op>
+    PTR(Expr) fold(const PTR(Expr) &lhs, const PTR(Expr) &rhs, Op op) {
+        if (!options.fold_constants || !is_literal(lhs) || !is_literal(rhs)) {
+            return nullptr;
+        }
+        try {
+            PTR(Expr) folded = value_literal(op(literal_value(lhs), literal_value(rhs)));
+            stats.folded++;
+            return folded;
+        } catch (const std::runtime_error &) {
+            return nullptr;
+        }
+    }
+};
+
+}
+
+PTR(Expr) optimize(const PTR(Expr) &expr, const OptimizeOptions &options, OptimizeStats *stats) {
+    OptimizeStats local_stats;
+    Optimizer optimizer(options, stats != nullptr ? *stats : local_stats);
+    return optimizer.visit(expr);
+}
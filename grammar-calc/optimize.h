@@ -0,0 +1,33 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+class Expr;
+
+#include "pointer.h"
+
+// which rewrites optimize() may apply
+struct OptimizeOptions {
+    // + * == on two literals, _if on a literal boolean
+    bool fold_constants = true;
+    // replace variables bound to a number or boolean literal by the literal
+    bool inline_literal_lets = true;
+    // drop _let bindings the body never reads, when evaluating the rhs cannot fail
+    bool remove_dead_lets = true;
+};
+
+struct OptimizeStats {
+    int folded = 0;
+    int branches_pruned = 0;
+    int lets_inlined = 0;
+    int dead_lets_removed = 0;
+};
+
+// Rewrites a parsed (unresolved) expression into a simpler one with the same
+// result, including the same error: nothing that would throw at run time is
+// folded or dropped. Function bodies are left alone, since closures compare
+// equal by the structure of their bodies. Unchanged subtrees are shared with
+// the input.
+PTR(Expr) optimize(const PTR(Expr) &expr, const OptimizeOptions &options = OptimizeOptions(),
+                   OptimizeStats *stats = nullptr);
+
+#endif // OPTIMIZE_H
@@ -0,0 +1,412 @@
+#include "parallel.h"
+#include "expr.hpp"
+#include "env.h"
+#include "eval_context.h"
+#include "visitor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+// a worker stops forking once this many of its tasks wait to be stolen
+const size_t max_pending_tasks = 2;
+
+// the subtrees of one evaluation that contain a call, the only way to do unbounded work
+class Evaluation : public ExprVisitor<Evaluation, bool> {
+public:
+    std::unordered_set<const Expr *> expensive;
+
+    bool visit_call(CallExpr *call) {
+        this->visit_expr(call);
+        return true;
+    }
+
+    bool visit_expr(Expr *expr) {
+        bool any = false;
+        for_each_child(expr, [&](const PTR(Expr) &child) { any = this->visit(child) || any; });
+        if (any) {
+            this->expensive.insert(expr);
+        }
+        return any;
+    }
+
+    bool is_expensive(const Expr *expr) const {
+        return expr->kind == expr_call || this->expensive.count(expr) > 0;
+    }
+};
+
+// thrown into tasks whose result is no longer wanted; not a runtime_error so nothing else catches it
+struct TaskCancelled {
+};
+
+struct Task {
+    Expr *expr = nullptr;
+    PTR(Env) env;
+    // the task that was running on the forking thread, nullptr for the root
+    Task *parent = nullptr;
+    const Evaluation *evaluation = nullptr;
+    EvalContext *context = nullptr;
+    // calls in progress where the task was forked, which CallDepth counts per thread
+    uint64_t depth = 0;
+    Value result;
+    std::exception_ptr error;
+    std::atomic<bool> done{false};
+    std::atomic<bool> cancelled{false};
+};
+
+// the innermost task this thread started from a queue (tasks run inline keep their parent's)
+thread_local Task *current_task = nullptr;
+
+struct Worker {
+    std::mutex mutex;
+    std::deque<Task *> tasks;
+    std::atomic<size_t> size{0};
+};
+
+class Pool {
+public:
+    static Pool &shared() {
+        static Pool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+    explicit Pool(unsigned threads) {
+        for (unsigned i = 0; i < threads; i++) {
+            this->workers.emplace_back(new Worker());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            this->threads.emplace_back([this, i] { this->work(i); });
+        }
+    }
+
+    ~Pool() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->wake.notify_all();
+        for (std::thread &thread : this->threads) {
+            thread.join();
+        }
+    }
+
+    // runs root on the pool and blocks the calling thread until it is done
+    void run(Task *root) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->injected.push_back(root);
+        this->wake.notify_all();
+        this->finished.wait(lock, [root] { return root->done.load(std::memory_order_acquire); });
+    }
+
+    bool worth_forking() const {
+        return this->workers.size() > 1 && this->workers[worker_index]->size.load(std::memory_order_relaxed) < max_pending_tasks;
+    }
+
+    void push(Task *task) {
+        Worker &worker = *this->workers[worker_index];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(task);
+            worker.size.store(worker.tasks.size(), std::memory_order_relaxed);
+        }
+        this->queued++;
+        this->wake_sleepers();
+    }
+
+    // waits for a task pushed by this thread; runs it here if nobody stole it
+    void join(Task *task) {
+        if (this->take_back(task)) {
+            try {
+                task->result = eval(task->expr, task->env);
+            } catch (...) {
+                task->error = std::current_exception();
+            }
+            return;
+        }
+        this->wait_for(task);
+    }
+
+    // like join, but the task's result is not wanted any more
+    void abandon(Task *task) {
+        task->cancelled.store(true, std::memory_order_relaxed);
+        if (!this->take_back(task)) {
+            this->wait_for(task);
+        }
+    }
+
+    static Value eval(Expr *expr, const PTR(Env) &env);
+
+private:
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::deque<Task *> injected;
+    // tasks in the workers' queues; with sleeping, read and written in
+    // sequentially consistent order so a push and a thread going to sleep
+    // cannot miss each other
+    std::atomic<size_t> queued{0};
+    std::atomic<int> sleeping{0};
+    bool stopping = false;
+
+    static thread_local size_t worker_index;
+
+    bool take_back(Task *task) {
+        Worker &worker = *this->workers[worker_index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty() || worker.tasks.back() != task) {
+            return false;
+        }
+        worker.tasks.pop_back();
+        worker.size.store(worker.tasks.size(), std::memory_order_relaxed);
+        this->queued--;
+        return true;
+    }
+
+    // whether another worker has a task waiting, which steal() may get
+    bool stealable() const {
+        return this->queued.load() > this->workers[worker_index]->size.load();
+    }
+
+    // taking the mutex orders the notify after a sleeper's wait has begun
+    void wake_sleepers() {
+        if (this->sleeping.load() > 0) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->wake.notify_all();
+        }
+    }
+
+    // blocks until ready() holds; pushes, finished tasks and the destructor wake it
+    template<typename Ready>
+    void sleep_until(Ready ready) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->sleeping++;
+        this->wake.wait(lock, ready);
+        this->sleeping--;
+    }
+
+    // keeps this worker busy with other tasks until a stolen one is finished
+    void wait_for(Task *task) {
+        while (!task->done.load()) {
+            Task *other = this->steal();
+            if (other != nullptr) {
+                this->execute(other);
+            } else {
+                this->sleep_until([this, task] { return task->done.load() || this->stealable() || this->stopping; });
+            }
+        }
+    }
+
+    // the oldest task of another worker: the one closest to the root, so the biggest
+    Task *steal() {
+        size_t count = this->workers.size();
+        for (size_t i = 1; i < count; i++) {
+            Worker &victim = *this->workers[(worker_index + i) % count];
+            if (victim.size.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                Task *task = victim.tasks.front();
+                victim.tasks.pop_front();
+                victim.size.store(victim.tasks.size(), std::memory_order_relaxed);
+                this->queued--;
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    void execute(Task *task) {
+        Task *previous = current_task;
+        current_task = task;
+        {
+            EvalScope scope(task->context);
+            DepthScope depth(task->depth);
+            try {
+                task->result = eval(task->expr, task->env);
+            } catch (...) {
+                task->error = std::current_exception();
+            }
+        }
+        current_task = previous;
+        if (task->parent == nullptr) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            task->done.store(true, std::memory_order_release);
+            this->finished.notify_all();
+        } else {
+            task->done.store(true);
+            this->wake_sleepers();
+        }
+    }
+
+    void work(size_t index) {
+        worker_index = index;
+        while (true) {
+            Task *task = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                if (this->stopping) {
+                    return;
+                }
+                if (!this->injected.empty()) {
+                    task = this->injected.front();
+                    this->injected.pop_front();
+                }
+            }
+            if (task == nullptr) {
+                task = this->steal();
+            }
+            if (task != nullptr) {
+                this->execute(task);
+                continue;
+            }
+            this->sleep_until([this] { return this->stopping || !this->injected.empty() || this->stealable(); });
+        }
+    }
+};
+
+thread_local size_t Pool::worker_index = 0;
+
+bool is_cancelled() {
+    for (Task *task = current_task; task != nullptr; task = task->parent) {
+        if (task->cancelled.load(std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// evaluates lhs then rhs, or both at once when that is worth a task
+void eval_both(Expr *lhs, Expr *rhs, const PTR(Env) &env, Value &lhs_val, Value &rhs_val) {
+    Pool &pool = Pool::shared();
+    const Evaluation *evaluation = current_task->evaluation;
+    if (!evaluation->is_expensive(lhs) || !evaluation->is_expensive(rhs) || !pool.worth_forking()) {
+        lhs_val = Pool::eval(lhs, env);
+        rhs_val = Pool::eval(rhs, env);
+        return;
+    }
+    Task task;
+    task.expr = rhs;
+    task.env = env;
+    task.parent = current_task;
+    task.evaluation = evaluation;
+    task.context = EvalContext::current();
+    task.depth = CallDepth::current();
+    pool.push(&task);
+    try {
+        lhs_val = Pool::eval(lhs, env);
+    } catch (...) {
+        pool.abandon(&task);
+        throw;
+    }
+    pool.join(&task);
+    if (task.error) {
+        std::rethrow_exception(task.error);
+    }
+    rhs_val = std::move(task.result);
+}
+
+}
+
+Value Pool::eval(Expr *expr, const PTR(Env) &env) {
+    Value lhs_val;
+    Value rhs_val;
+    switch (expr->kind) {
+        case expr_num:
+        case expr_bool:
+        case expr_var:
+        case expr_fun:
+            return expr->interp(env);
+        case expr_add: {
+            auto *add = static_cast<AddExpr *>(expr);
+            eval_both(add->lhs.get(), add->rhs.get(), env, lhs_val, rhs_val);
+            return lhs_val.add_to(rhs_val);
+        }
+        case expr_mult: {
+            auto *mult = static_cast<MultExpr *>(expr);
+            eval_both(mult->lhs.get(), mult->rhs.get(), env, lhs_val, rhs_val);
+            return lhs_val.mult_with(rhs_val);
+        }
+        case expr_eq: {
+            auto *eq = static_cast<EqExpr *>(expr);
+            eval_both(eq->lhs.get(), eq->rhs.get(), env, lhs_val, rhs_val);
+            return Value::from_bool(lhs_val.equals(rhs_val));
+        }
+        case expr_let: {
+            auto *let = static_cast<LetExpr *>(expr);
+            Value rhs = eval(let->rhs.get(), env);
+            if (let->slot >= 0) {
+                static_cast<FrameEnv *>(env.get())->slots[let->slot] = rhs;
+                return eval(let->body.get(), env);
+            }
+            return eval(let->body.get(), NEW(ExtendedEnv)(let->lhs, rhs, env));
+        }
+        case expr_if: {
+            auto *if_expr = static_cast<IfExpr *>(expr);
+            if (eval(if_expr->condition.get(), env).is_true()) {
+                return eval(if_expr->then_expr.get(), env);
+            }
+            return eval(if_expr->else_expr.get(), env);
+        }
+        case expr_call: {
+            auto *call = static_cast<CallExpr *>(expr);
+            eval_both(call->to_be_called.get(), call->actual_arg.get(), env, lhs_val, rhs_val);
+            if (is_cancelled()) {
+                throw TaskCancelled();
+            }
+            auto *fun = val_cast<FunVal>(lhs_val);
+            if (fun == nullptr) {
+                return lhs_val.call(rhs_val);
+            }
+            // the body runs here so its own operands can be forked too
+            EvalContext *context = EvalContext::current();
+            if (context != nullptr) {
+                context->tick_shared();
+            }
+            CallDepth depth(context);
+            if (fun->frame_size >= 0) {
+                PTR(FrameEnv) frame = NEW(FrameEnv)(fun->frame_size, std::static_pointer_cast<FrameEnv>(fun->env));
+                frame->slots[0] = std::move(rhs_val);
+                return eval(fun->body.get(), frame);
+            }
+            return eval(fun->body.get(), NEW(ExtendedEnv)(fun->formal_arg, std::move(rhs_val), fun->env));
+        }
+    }
+    throw std::runtime_error("invalid expression kind");
+}
+
+Value parallel_interp(const PTR(Expr) &expr, PTR(Env) env) {
+    if (env == nullptr) {
+        env = Env::empty;
+    }
+    // the memo cache is not shared between threads
+    EvalContext *context = EvalContext::current();
+    if (context != nullptr && context->memo != nullptr) {
+        return expr->interp(env);
+    }
+    Evaluation evaluation;
+    evaluation.visit(expr);
+
+    Task root;
+    root.expr = expr.get();
+    root.env = std::move(env);
+    root.evaluation = &evaluation;
+    root.context = context;
+    root.depth = CallDepth::current();
+    Pool::shared().run(&root);
+    if (root.error) {
+        std::rethrow_exception(root.error);
+    }
+    return root.result;
+}
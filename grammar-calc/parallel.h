@@ -0,0 +1,21 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+class Expr;
+class Env;
+
+#include "pointer.h"
+#include "val.hpp"
+
+// Evaluates like expr->interp(env) on a shared work-stealing pool with one
+// worker per hardware thread. The operands of +, *, == and a call's callee and
+// argument are independent (evaluation is pure), so the right one becomes a
+// task that an idle worker may steal while the left one runs. Only operands
+// that contain a call are forked, and only while the worker's own queue is
+// nearly empty; everything else stays sequential. Errors are the ones
+// sequential evaluation raises: when the left operand throws, the right one
+// is cancelled and the left error wins. With a memo cache in the current
+// EvalContext the evaluation stays on the calling thread.
+Value parallel_interp(const PTR(Expr) &expr, PTR(Env) env = nullptr);
+
+#endif // PARALLEL_H
@@ -1,257 +1,223 @@
 #include "parse.h"
 #include "expr.hpp"
+#include "big_num.h"
+#include "iterative_parse.h"
+#include "hash_cons.h"
+#include "incremental_parse.h"
 
-PTR(Expr) parse_expression_str(const std::string &str) {
-    std::istringstream is(str);
-    return parse_expr(is);
-}
+#include <iterator>
 
-// expr: comparg || comparg == expr
-PTR(Expr) parse_expr(std::istream &in, int open_parenthesis_to_match) {
-    // std::cout << "parse_expr:\n";
-    PTR(Expr) comprag = parse_comprag(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    int ch = in.peek();
-    if (ch == '=') {
-        consume_word(in, "==", open_parenthesis_to_match);
-        PTR(Expr) second_expr = parse_expr(in, open_parenthesis_to_match);
-        comprag = NEW(EqExpr)(comprag, second_expr);
-        skip_whitespaces(in, open_parenthesis_to_match);
-        ch = in.peek();
+PTR(Expr) parse_expression_str(std::string_view str, parser_t parser, ExprFactory *factory) {
+    ExprFactoryScope scope(factory);
+    Lexer lexer(str);
+    if (parser == parser_iterative) {
+        return parse_expr_iterative(lexer);
     }
+    return parse_expr(lexer);
+}
 
-    if (ch != EOF && ch != ')' && ch != '_' && ch != '\n' && ch != '(') {
-        throw std::runtime_error("invalid input");
+PTR(Expr) located(PTR(Expr) expr, size_t offset) {
+    if (expr->offset == Expr::unknown_offset && offset < Expr::unknown_offset) {
+        expr->offset = (uint32_t) offset;
     }
-    if (open_parenthesis_to_match == 0 && ch == ')') {
-        throw std::runtime_error("missing open parenthesis");
-    }
-    return comprag;
+    return expr;
 }
 
-// comprag: addend | addend + comprag
-PTR(Expr) parse_comprag(std::istream &in, int &open_parenthesis_to_match) {
-    //   std::cout << "parse_comprag:\n";
-    PTR(Expr) addend = parse_addend(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    int ch = in.peek();
-    if (ch == '+') {
-        consume(in, '+', open_parenthesis_to_match);
-        PTR(Expr) second_expr = parse_comprag(in, open_parenthesis_to_match);
-        addend = NEW(AddExpr)(addend, second_expr);
-        skip_whitespaces(in, open_parenthesis_to_match);
-    }
-    return addend;
+PTR(Expr) parse_expr(std::istream &in) {
+    std::string str((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return parse_expression_str(str);
 }
 
-PTR(Expr) parse_num(std::istream &in, int &open_parenthesis_to_match) {
-    unsigned int num = 0;
-    bool is_negative = false;
-    if (in.peek() == '-') {
-        consume(in, '-', open_parenthesis_to_match);
-        is_negative = true;
-        if (!isdigit(in.peek())) {
-            throw std::runtime_error("number should come right after -");
+// expr: comparg || comparg == expr
+PTR(Expr) parse_expr(Lexer &lexer, int open_parenthesis_to_match) {
+    return parse_memoized(rule_expr, lexer, open_parenthesis_to_match, [&] {
+        PTR(Expr) comprag = parse_comprag(lexer, open_parenthesis_to_match);
+        if (lexer.peek().kind == tok_eq || lexer.peek().kind == tok_assign) {
+            consume_word(lexer, "==", open_parenthesis_to_match);
+            PTR(Expr) second_expr = parse_expr(lexer, open_parenthesis_to_match);
+            comprag = make_expr<EqExpr>(comprag, second_expr);
         }
-    }
-    int ch;
 
-    while ((ch = in.peek()) && isdigit(ch)) {
-        consume(in, ch, open_parenthesis_to_match);
-        num = num * 10 + (ch - '0');
-    }
+        token_kind_t next = lexer.peek().kind;
+        if (next != tok_eof && next != tok_rparen && next != tok_keyword && next != tok_lparen) {
+            throw std::runtime_error("invalid input");
+        }
+        if (open_parenthesis_to_match == 0 && next == tok_rparen) {
+            throw std::runtime_error("missing open parenthesis");
+        }
+        return comprag;
+    });
+}
+
+// comprag: addend | addend + comprag
+PTR(Expr) parse_comprag(Lexer &lexer, int &open_parenthesis_to_match) {
+    return parse_memoized(rule_comprag, lexer, open_parenthesis_to_match, [&] {
+        PTR(Expr) addend = parse_addend(lexer, open_parenthesis_to_match);
+        if (lexer.peek().kind == tok_plus) {
+            consume(lexer, tok_plus, open_parenthesis_to_match);
+            PTR(Expr) second_expr = parse_comprag(lexer, open_parenthesis_to_match);
+            addend = make_expr<AddExpr>(addend, second_expr);
+        }
+        return addend;
+    });
+}
 
-    if (is_negative) {
-        num *= -1;
+PTR(Expr) parse_num(Lexer &lexer, int &open_parenthesis_to_match) {
+    if (lexer.peek().kind != tok_num) {
+        throw std::runtime_error("number should come right after -");
     }
-    return NEW(NumExpr)((int) num);
+    Token token = lexer.next();
+    if (token.big) {
+        return located(make_expr<NumExpr>(parse_number(lexer.text(token))), token.offset);
+    }
+    return located(make_expr<NumExpr>(token.value), token.offset);
 }
 
 
 // addend: multiplicand | multiplicand * addend
-PTR(Expr) parse_addend(std::istream &in, int &open_parenthesis_to_match) {
-    // std::cout << "parse_addend\n";
-    PTR(Expr) first_multiplicand = parse_multiplicand(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-
-    int ch = in.peek();
+PTR(Expr) parse_addend(Lexer &lexer, int &open_parenthesis_to_match) {
+    PTR(Expr) first_multiplicand = parse_multiplicand(lexer, open_parenthesis_to_match);
 
-    if (ch != '*') {
+    if (lexer.peek().kind != tok_star) {
         return first_multiplicand;
     }
-    consume(in, '*', open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    PTR(Expr) second_addend = parse_addend(in, open_parenthesis_to_match);
-    return NEW(MultExpr)(first_multiplicand, second_addend);
+    consume(lexer, tok_star, open_parenthesis_to_match);
+    PTR(Expr) second_addend = parse_addend(lexer, open_parenthesis_to_match);
+    return make_expr<MultExpr>(first_multiplicand, second_addend);
 }
 
-PTR(Expr) parse_variable(std::istream &in, int &open_parenthesis_to_match) {
-    int ch;
-    std::string str;
-
-    while ((ch = in.peek()) && isalpha(ch)) {
-        consume(in, ch, open_parenthesis_to_match);
-        str += (char) ch;
+PTR(Expr) parse_variable(Lexer &lexer, int &open_parenthesis_to_match) {
+    const Token &token = lexer.peek();
+    if (token.kind == tok_identifier) {
+        if (token.bad_follow) {
+            throw std::runtime_error("unexpected character in variable");
+        }
+        Token name = lexer.next();
+        return located(make_expr<VarExpr>(std::string(lexer.text(name))), name.offset);
     }
-    ch = in.peek();
 
-    if (!isspace(ch) && !(ch == '+' || ch == '*' || ch == ')' || ch == '(' || ch == '=' || in.eof())) {
+    // no letters at all still makes an (empty) variable if what follows is acceptable
+    int ch = lexer.first_char(token);
+    if (!(ch == '+' || ch == '*' || ch == ')' || ch == '(' || ch == '=' || ch == EOF)) {
         throw std::runtime_error("unexpected character in variable");
     }
-    return NEW(VarExpr)(str);
+    return located(make_expr<VarExpr>(""), token.offset);
 }
 
-void consume_word(std::istream &in, const std::string &expectation, int &open_parenthesis_to_match) {
-    for (char ch: expectation) {
-        if (in.peek() != ch) {
-            throw std::runtime_error("invalid input");
-        }
-        consume(in, ch, open_parenthesis_to_match);
+// matches expectation character by character like the stream parser did, so _inx reads as _in followed by x
+void consume_word(Lexer &lexer, std::string_view expectation, int &open_parenthesis_to_match) {
+    const Token &token = lexer.peek();
+    std::string_view text = lexer.text(token);
+    if (text == expectation) {
+        lexer.next();
+        return;
+    }
+    if (token.kind == tok_keyword && text.size() > expectation.size()
+        && text.substr(0, expectation.size()) == expectation) {
+        lexer.consume_prefix(expectation.size());
+        return;
     }
+    throw std::runtime_error("invalid input");
 }
 
 
-PTR(Expr) parse_let_binding(std::istream &in, int &open_parenthesis_to_match) {
-    skip_whitespaces(in, open_parenthesis_to_match);
-    PTR(Expr) lhs = parse_variable(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    consume_word(in, "=", open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    PTR(Expr) rhs = parse_comprag(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    // std::cout << "parse_comprag: " << rhs->to_string() << "\n";
-    consume_word(in, "_in", open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    PTR(Expr) body = parse_comprag(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    return NEW(LetExpr)(lhs->to_string(), rhs, body);
+PTR(Expr) parse_let_binding(Lexer &lexer, int &open_parenthesis_to_match) {
+    PTR(Expr) lhs = parse_variable(lexer, open_parenthesis_to_match);
+    consume_word(lexer, "=", open_parenthesis_to_match);
+    PTR(Expr) rhs = parse_comprag(lexer, open_parenthesis_to_match);
+    consume_word(lexer, "_in", open_parenthesis_to_match);
+    PTR(Expr) body = parse_comprag(lexer, open_parenthesis_to_match);
+    return make_expr<LetExpr>(lhs->to_string(), rhs, body);
 }
 
-PTR(Expr) parse_if_expr(std::istream &in, int &open_parenthesis_to_match) {
-    // std::cout << "parse_if_expr:\n";
-    skip_whitespaces(in, open_parenthesis_to_match);
-    //  std::cout << "parse_if_expr: after skip_whitespaces\n";
-    PTR(Expr) condition = parse_expr(in, open_parenthesis_to_match);
-    // std::cout << "parse_if_expr condition: " << condition->to_string() << "\n";
-    skip_whitespaces(in, open_parenthesis_to_match);
-    consume_word(in, "_then", open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    PTR(Expr) then_expr = parse_expr(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    consume_word(in, "_else", open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    PTR(Expr) else_expr = parse_expr(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    return NEW(IfExpr)(condition, then_expr, else_expr);
+PTR(Expr) parse_if_expr(Lexer &lexer, int &open_parenthesis_to_match) {
+    PTR(Expr) condition = parse_expr(lexer, open_parenthesis_to_match);
+    consume_word(lexer, "_then", open_parenthesis_to_match);
+    PTR(Expr) then_expr = parse_expr(lexer, open_parenthesis_to_match);
+    consume_word(lexer, "_else", open_parenthesis_to_match);
+    PTR(Expr) else_expr = parse_expr(lexer, open_parenthesis_to_match);
+    return make_expr<IfExpr>(condition, then_expr, else_expr);
 }
 
-// multiplicand:  〈inner〉 | 〈multicand〉 ( 〈expr〉 )
-PTR(Expr) parse_multiplicand(std::istream &in, int &open_parenthesis_to_match) {
-    // std::cout << "parse_multiplicand:\n";
-    skip_whitespaces(in, open_parenthesis_to_match);
-    PTR(Expr) expr = parse_inner(in, open_parenthesis_to_match);
-    // std::cout << "inner: " << expr->to_string() << "\n";
-    skip_whitespaces(in, open_parenthesis_to_match);
-    while (!in.eof() && in.peek() == '(') {
-        consume(in, '(', open_parenthesis_to_match);
-        skip_whitespaces(in, open_parenthesis_to_match);
-        PTR(Expr) actual_arg = parse_expr(in, open_parenthesis_to_match);
-        skip_whitespaces(in, open_parenthesis_to_match);
-        consume(in, ')', open_parenthesis_to_match);
-        expr = NEW(CallExpr)(expr, actual_arg);
+// multiplicand:  〈inner〉 | 〈multicand〉 ( 〈expr〉 )
+PTR(Expr) parse_multiplicand(Lexer &lexer, int &open_parenthesis_to_match) {
+    PTR(Expr) expr = parse_inner(lexer, open_parenthesis_to_match);
+    // whitespace is allowed before the first argument only, f(1) (2) is not a chained call
+    bool first_call = true;
+    size_t call_end = 0;
+    while (lexer.peek().kind == tok_lparen && (first_call || lexer.peek().offset == call_end)) {
+        consume(lexer, tok_lparen, open_parenthesis_to_match);
+        PTR(Expr) actual_arg = parse_expr(lexer, open_parenthesis_to_match);
+        call_end = lexer.peek().offset + lexer.peek().length;
+        consume(lexer, tok_rparen, open_parenthesis_to_match);
+        expr = make_expr<CallExpr>(expr, actual_arg);
+        first_call = false;
     }
     return expr;
 }
 
-// inner: number | ( expression ) | variable | let binding | _true | _false | _if _then _else | _fun ( 〈variable〉 ) 〈expr〉
-PTR(Expr) parse_inner(std::istream &in, int &open_parenthesis_to_match) {
-    //  std::cout << "parse_inner:\n";
-    skip_whitespaces(in, open_parenthesis_to_match);
-    int ch = in.peek();
-    // std::cout << "parse_inner ch: " << (char) ch << "   " << (int) ch << "\n";
-    if (isdigit(ch) || ch == '-') {
-        return parse_num(in, open_parenthesis_to_match);
-    }
-    if (ch == '(') {
-        consume(in, '(', open_parenthesis_to_match);
-        PTR(Expr) inner_expr = parse_expr(in, open_parenthesis_to_match);
-        skip_whitespaces(in, open_parenthesis_to_match);
-        if (open_parenthesis_to_match > 0 && in.peek() != ')') {
-            if (in.eof()) {
+// inner: number | ( expression ) | variable | let binding | _true | _false | _if _then _else | _fun ( 〈variable〉 ) 〈expr〉
+PTR(Expr) parse_inner(Lexer &lexer, int &open_parenthesis_to_match) {
+    const Token &token = lexer.peek();
+    if (token.kind == tok_num || lexer.first_char(token) == '-') {
+        return parse_num(lexer, open_parenthesis_to_match);
+    }
+    if (token.kind == tok_lparen) {
+        consume(lexer, tok_lparen, open_parenthesis_to_match);
+        PTR(Expr) inner_expr = parse_expr(lexer, open_parenthesis_to_match);
+        if (open_parenthesis_to_match > 0 && lexer.peek().kind != tok_rparen) {
+            if (lexer.peek().kind == tok_eof) {
                 throw std::runtime_error("missing close parenthesis");
             }
         } else {
-            consume(in, ')', open_parenthesis_to_match);
+            consume(lexer, tok_rparen, open_parenthesis_to_match);
         }
         return inner_expr;
     }
 
-    if (isalpha(ch)) {
-        PTR(Expr) variable = parse_variable(in, open_parenthesis_to_match);
-        skip_whitespaces(in, open_parenthesis_to_match);
-        return variable;
+    if (token.kind == tok_identifier) {
+        return parse_variable(lexer, open_parenthesis_to_match);
     }
 
-    if (ch == '_') {
-        std::string next_keyword = consume_and_find_next_keyword(in, open_parenthesis_to_match);
+    if (token.kind == tok_keyword) {
+        Token keyword = lexer.next();
+        std::string_view next_keyword = lexer.text(keyword);
         if (next_keyword == "_let") {
-            return parse_let_binding(in, open_parenthesis_to_match);
+            return located(parse_let_binding(lexer, open_parenthesis_to_match), keyword.offset);
         } else if (next_keyword == "_false") {
-            return NEW(BoolExpr)(false);
+            return located(make_expr<BoolExpr>(false), keyword.offset);
         } else if (next_keyword == "_true") {
-            return NEW(BoolExpr)(true);
+            return located(make_expr<BoolExpr>(true), keyword.offset);
         } else if (next_keyword == "_if") {
-            return parse_if_expr(in, open_parenthesis_to_match);
+            return located(parse_if_expr(lexer, open_parenthesis_to_match), keyword.offset);
         } else if (next_keyword == "_fun") {
-            return parse_fun_expr(in, open_parenthesis_to_match);
+            return located(parse_fun_expr(lexer, open_parenthesis_to_match), keyword.offset);
+        }
+        // an unknown keyword used to be followed by an attempt to consume another _
+        if (lexer.char_after(keyword) != '_') {
+            throw std::runtime_error("consume mismatch");
         }
     }
-    consume(in, ch, open_parenthesis_to_match);
     throw std::runtime_error("invalid input");
 }
 
-PTR(Expr) parse_fun_expr(std::istream &in, int &open_parenthesis_to_match) {
-    skip_whitespaces(in, open_parenthesis_to_match);
-    consume(in, '(', open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    PTR(Expr) variable = parse_variable(in, open_parenthesis_to_match);
-    skip_whitespaces(in, open_parenthesis_to_match);
-    consume(in, ')', open_parenthesis_to_match);
-    PTR(Expr) body = parse_expr(in, open_parenthesis_to_match);
-    return NEW(FunExpr)(variable->to_string(), body);
+PTR(Expr) parse_fun_expr(Lexer &lexer, int &open_parenthesis_to_match) {
+    consume(lexer, tok_lparen, open_parenthesis_to_match);
+    PTR(Expr) variable = parse_variable(lexer, open_parenthesis_to_match);
+    consume(lexer, tok_rparen, open_parenthesis_to_match);
+    PTR(Expr) body = parse_expr(lexer, open_parenthesis_to_match);
+    return make_expr<FunExpr>(variable->to_string(), body);
 }
 
-void consume(std::istream &in, int expectation, int &open_parenthesis_to_match) {
-    int ch = in.get();
-    if (ch != expectation) {
+void consume(Lexer &lexer, token_kind_t expectation, int &open_parenthesis_to_match) {
+    Token token = lexer.next();
+    if (token.kind != expectation) {
         throw std::runtime_error("consume mismatch");
     }
-    if (ch == '(') {
+    if (token.kind == tok_lparen) {
         open_parenthesis_to_match++;
     }
-    if (ch == ')') {
+    if (token.kind == tok_rparen) {
         open_parenthesis_to_match--;
     }
-    // std::cout << "consume: real: " << (char) ch << " expected: " << (char) expectation << "\n";
-}
-
-void skip_whitespaces(std::istream &in, int &open_parenthesis_to_match) {
-    int ch;
-    while ((ch = in.peek()) && isspace(ch)) {
-        consume(in, ch, open_parenthesis_to_match);
-    }
-}
-
-// start with _, consume and return the keyword like _let: return _let
-std::string consume_and_find_next_keyword(std::istream &in, int &open_parenthesis_to_match) {
-    if (in.eof() || in.peek() != '_') {
-        throw std::runtime_error("not a keyword");
-    }
-    consume(in, '_', open_parenthesis_to_match);
-    std::string keyword = "_";
-    while (isalpha(in.peek())) {
-        keyword += (char) in.peek();
-        consume(in, in.peek(), open_parenthesis_to_match);
-    }
-    return keyword;
 }
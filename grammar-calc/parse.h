@@ -2,39 +2,54 @@
 #define PARSE_H
 
 class Expr;
+class ExprFactory;
 
 #include <iostream>
+#include <string_view>
+#include "lexer.h"
 #include "pointer.h"
 
-PTR(Expr) parse_expression_str(const std::string &str);
+// both accept the same language and build the same trees; the iterative one
+// keeps its state on the heap, so deeply nested input cannot overflow the stack
+enum parser_t {
+    parser_recursive_descent,
+    parser_iterative,
+};
 
-PTR(Expr) parse_expr(std::istream &in, int open_parenthesis_to_match = 0);
+// with a factory, structurally equal subtrees come back as one shared node (see hash_cons.h)
+PTR(Expr) parse_expression_str(std::string_view str, parser_t parser = parser_recursive_descent,
+                               ExprFactory *factory = nullptr);
 
-PTR(Expr) parse_comprag(std::istream &in, int &open_parenthesis_to_match);
+// records that expr starts at offset in the text being parsed, unless it knows
+// already: a node shared by hash-consing keeps its first position
+PTR(Expr) located(PTR(Expr) expr, size_t offset);
 
-PTR(Expr) parse_num(std::istream &in, int &open_parenthesis_to_match);
+// reads the rest of the stream and parses it as one expression
+PTR(Expr) parse_expr(std::istream &in);
 
-PTR(Expr) parse_addend(std::istream &in, int &open_parenthesis_to_match);
+PTR(Expr) parse_expr(Lexer &lexer, int open_parenthesis_to_match = 0);
 
-PTR(Expr) parse_multiplicand(std::istream &in, int &open_parenthesis_to_match);
+PTR(Expr) parse_comprag(Lexer &lexer, int &open_parenthesis_to_match);
 
-PTR(Expr) parse_variable(std::istream &in, int &open_parenthesis_to_match);
+PTR(Expr) parse_num(Lexer &lexer, int &open_parenthesis_to_match);
 
-PTR(Expr) parse_let_binding(std::istream &in, int &open_parenthesis_to_match);
+PTR(Expr) parse_addend(Lexer &lexer, int &open_parenthesis_to_match);
 
-PTR(Expr) parse_if_expr(std::istream &in, int &open_parenthesis_to_match);
+PTR(Expr) parse_multiplicand(Lexer &lexer, int &open_parenthesis_to_match);
 
-PTR(Expr) parse_inner(std::istream &in, int &open_parenthesis_to_match);
+PTR(Expr) parse_variable(Lexer &lexer, int &open_parenthesis_to_match);
 
-PTR(Expr) parse_fun_expr(std::istream &in, int &open_parenthesis_to_match);
+PTR(Expr) parse_let_binding(Lexer &lexer, int &open_parenthesis_to_match);
 
-void consume_word(std::istream &in, const std::string &expectation, int &open_parenthesis_to_match);
+PTR(Expr) parse_if_expr(Lexer &lexer, int &open_parenthesis_to_match);
 
-void consume(std::istream &in, int expectation, int &open_parenthesis_to_match);
+PTR(Expr) parse_inner(Lexer &lexer, int &open_parenthesis_to_match);
 
-void skip_whitespaces(std::istream &in, int &open_parenthesis_to_match);
+PTR(Expr) parse_fun_expr(Lexer &lexer, int &open_parenthesis_to_match);
 
-std::string consume_and_find_next_keyword(std::istream &in, int &open_parenthesis_to_match);
+void consume_word(Lexer &lexer, std::string_view expectation, int &open_parenthesis_to_match);
+
+void consume(Lexer &lexer, token_kind_t expectation, int &open_parenthesis_to_match);
 
 
 #endif // PARSE_H
@@ -0,0 +1,337 @@
+#include "pretty_print.h"
+#include "visitor.h"
+
+#include <charconv>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+// passed as continuation when a node starts its own operator chain
+const size_t no_continuation = SIZE_MAX;
+
+// whether print puts expr in parentheses when it is a binary operator
+bool needs_parentheses(Expr *expr, precedence_t precedence, bool wrap_eq) {
+    switch (expr->kind) {
+        case expr_add:
+            return precedence >= precedence_add;
+        case expr_mult:
+            return precedence >= precedence_mult;
+        case expr_eq:
+            return wrap_eq;
+        default:
+            return false;
+    }
+}
+
+size_t number_width(const Value &val) {
+    if (!val.is_num()) {
+        return val.to_string().size();
+    }
+    char digits[24];
+    return std::to_chars(digits, digits + sizeof(digits), val.as_num()).ptr - digits;
+}
+
+}
+
+PrettyPrinter::PrettyPrinter(std::string &out, const PrettyPrintOptions &options)
+    : options(options), text(&out), origin(out.size()) {
+}
+
+PrettyPrinter::PrettyPrinter(std::ostream &out, const PrettyPrintOptions &options)
+    : options(options), text(&this->buffer), out(&out), origin(0) {
+}
+
+PrettyPrinter::PrettyPrinter(int fd, const PrettyPrintOptions &options)
+    : options(options), text(&this->buffer), fd(fd), origin(0) {
+}
+
+PrettyPrinter::~PrettyPrinter() {
+    try {
+        this->flush();
+    } catch (const std::runtime_error &) {
+        // a destructor cannot report it, call flush() first to find out
+    }
+}
+
+void PrettyPrinter::print(const PTR(Expr) &expr) {
+    if (this->options.max_width > 0) {
+        this->measure(expr.get());
+    }
+    this->print(expr.get(), precedence_none, false, false, this->position(), no_continuation);
+    this->extents.clear();
+}
+
+// the classic layout of expr up to its first line break; parentheses a parent adds come from printed_extent
+PrettyPrinter::Extent PrettyPrinter::measure(Expr *expr) {
+    auto found = this->extents.find(expr);
+    if (found != this->extents.end()) {
+        return found->second;
+    }
+    Extent extent{0, false};
+    auto binary = [&](Expr *lhs, precedence_t lhs_precedence, bool lhs_wrap_eq, size_t op_width, Expr *rhs,
+                      precedence_t rhs_precedence, bool rhs_wrap_eq) {
+        Extent left = this->printed_extent(lhs, lhs_precedence, lhs_wrap_eq);
+        Extent right = this->printed_extent(rhs, rhs_precedence, rhs_wrap_eq);
+        if (left.multiline) {
+            return left;
+        }
+        return Extent{left.first_line + op_width + right.first_line, right.multiline};
+    };
+    for_each_child(expr, [&](const PTR(Expr) &child) { this->measure(child.get()); });
+    switch (expr->kind) {
+        case expr_num:
+            extent.first_line = number_width(static_cast<NumExpr *>(expr)->val);
+            break;
+        case expr_var:
+            extent.first_line = static_cast<VarExpr *>(expr)->variable.size();
+            break;
+        case expr_bool:
+            extent.first_line = static_cast<BoolExpr *>(expr)->rep ? 5 : 6;
+            break;
+        case expr_add: {
+            auto *add = static_cast<AddExpr *>(expr);
+            extent = binary(add->lhs.get(), precedence_add, true, 3, add->rhs.get(), precedence_none, true);
+            break;
+        }
+        case expr_mult: {
+            auto *mult = static_cast<MultExpr *>(expr);
+            extent = binary(mult->lhs.get(), precedence_mult, true, 3, mult->rhs.get(), precedence_add, true);
+            break;
+        }
+        case expr_eq: {
+            auto *eq = static_cast<EqExpr *>(expr);
+            extent = binary(eq->lhs.get(), precedence_none, true, 4, eq->rhs.get(), precedence_none, false);
+            break;
+        }
+        case expr_let: {
+            auto *let = static_cast<LetExpr *>(expr);
+            extent = Extent{5 + let->lhs.size() + 3 + this->measure(let->rhs.get()).first_line, true};
+            break;
+        }
+        case expr_if:
+            extent = Extent{4 + this->measure(static_cast<IfExpr *>(expr)->condition.get()).first_line, true};
+            break;
+        case expr_fun:
+            extent = Extent{6 + static_cast<FunExpr *>(expr)->formal_arg.size() + 1, true};
+            break;
+        case expr_call: {
+            auto *call = static_cast<CallExpr *>(expr);
+            Extent callee = this->measure(call->to_be_called.get());
+            Extent arg = this->measure(call->actual_arg.get());
+            if (callee.multiline) {
+                extent = callee;
+            } else {
+                extent = Extent{callee.first_line + 1 + arg.first_line + (arg.multiline ? 0 : 1), arg.multiline};
+            }
+            break;
+        }
+    }
+    this->extents.emplace(expr, extent);
+    return extent;
+}
+
+PrettyPrinter::Extent PrettyPrinter::printed_extent(Expr *expr, precedence_t precedence, bool wrap_eq) {
+    Extent extent = this->measure(expr);
+    if (needs_parentheses(expr, precedence, wrap_eq)) {
+        extent.first_line += extent.multiline ? 1 : 2;
+    }
+    return extent;
+}
+
+void PrettyPrinter::flush() {
+    if (this->text != &this->buffer || this->buffer.empty()) {
+        return;
+    }
+    if (this->out != nullptr) {
+        this->out->write(this->buffer.data(), this->buffer.size());
+    } else {
+        const char *data = this->buffer.data();
+        size_t left = this->buffer.size();
+        while (left > 0) {
+            auto written = ::write(this->fd, data, left);
+            if (written <= 0) {
+                throw std::runtime_error("cannot write pretty printed output");
+            }
+            data += written;
+            left -= written;
+        }
+    }
+    this->flushed += this->buffer.size();
+    this->buffer.clear();
+}
+
+void PrettyPrinter::newline() {
+    this->write("\n");
+    this->line_begin = this->position();
+}
+
+// op is " + ", " * " or " == "; with a width limit the line ends after it
+// instead if what follows up to the next operator of the same chain would not fit
+void PrettyPrinter::write_operator(std::string_view op, Expr *parent, Expr *rhs, precedence_t rhs_precedence,
+                                   bool rhs_wrap_eq, size_t indent, size_t &prev_stop_at) {
+    size_t max_width = this->options.max_width;
+    if (max_width > 0 && this->column() > indent) {
+        Extent next = this->printed_extent(rhs, rhs_precedence, rhs_wrap_eq);
+        if (rhs->kind == parent->kind && !needs_parentheses(rhs, rhs_precedence, rhs_wrap_eq)) {
+            Expr *rhs_lhs = rhs->kind == expr_add ? static_cast<AddExpr *>(rhs)->lhs.get()
+                            : rhs->kind == expr_mult ? static_cast<MultExpr *>(rhs)->lhs.get()
+                            : static_cast<EqExpr *>(rhs)->lhs.get();
+            next = this->printed_extent(rhs_lhs, rhs->kind == expr_add ? precedence_add
+                                                 : rhs->kind == expr_mult ? precedence_mult : precedence_none, true);
+        }
+        if (this->column() + op.size() + next.first_line > max_width) {
+            this->write(op.substr(0, op.size() - 1));
+            this->newline();
+            prev_stop_at = this->position();
+            this->write_spaces(indent);
+            return;
+        }
+    }
+    this->write(op);
+}
+
+// prev_stop_at is where the line of the closest enclosing _let, _if or _fun
+// began; they indent by how far they start past it, as the stream version did
+void PrettyPrinter::print(Expr *expr, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq,
+                          size_t prev_stop_at, size_t continuation) {
+    switch (expr->kind) {
+        case expr_num: {
+            const Value &val = static_cast<NumExpr *>(expr)->val;
+            if (!val.is_num()) {
+                this->write(val.to_string());
+                break;
+            }
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), val.as_num());
+            this->write(std::string_view(digits, result.ptr - digits));
+            break;
+        }
+        case expr_add: {
+            auto *add = static_cast<AddExpr *>(expr);
+            bool parentheses = precedence >= precedence_add;
+            if (parentheses) {
+                this->write("(");
+            }
+            size_t indent = continuation != no_continuation ? continuation : this->column();
+            this->print(add->lhs.get(), precedence_add, true, true, prev_stop_at, no_continuation);
+            this->write_operator(" + ", add, add->rhs.get(), precedence_none, true, indent, prev_stop_at);
+            this->print(add->rhs.get(), precedence_none, false, true, prev_stop_at, indent);
+            if (parentheses) {
+                this->write(")");
+            }
+            break;
+        }
+        case expr_mult: {
+            auto *mult = static_cast<MultExpr *>(expr);
+            bool parentheses = precedence >= precedence_mult;
+            if (parentheses) {
+                this->write("(");
+            }
+            size_t indent = continuation != no_continuation ? continuation : this->column();
+            this->print(mult->lhs.get(), precedence_mult, true, true, prev_stop_at, no_continuation);
+            this->write_operator(" * ", mult, mult->rhs.get(), precedence_add, true, indent, prev_stop_at);
+            this->print(mult->rhs.get(), precedence_add, !parentheses && wrap_let_or_fun, true, prev_stop_at, indent);
+            if (parentheses) {
+                this->write(")");
+            }
+            break;
+        }
+        case expr_eq: {
+            auto *eq = static_cast<EqExpr *>(expr);
+            if (wrap_eq) {
+                this->write("(");
+            }
+            size_t indent = continuation != no_continuation ? continuation : this->column();
+            this->print(eq->lhs.get(), precedence_none, true, true, prev_stop_at, no_continuation);
+            this->write_operator(" == ", eq, eq->rhs.get(), precedence_none, false, indent, prev_stop_at);
+            this->print(eq->rhs.get(), precedence_none, false, false, prev_stop_at, indent);
+            if (wrap_eq) {
+                this->write(")");
+            }
+            break;
+        }
+        case expr_var:
+            this->write(static_cast<VarExpr *>(expr)->variable);
+            break;
+        case expr_bool:
+            this->write(static_cast<BoolExpr *>(expr)->rep ? "_true" : "_false");
+            break;
+        case expr_let: {
+            auto *let = static_cast<LetExpr *>(expr);
+            if (wrap_let_or_fun) {
+                this->write("(");
+            }
+            size_t blank_spaces_backoff = this->position() - prev_stop_at;
+            this->write("_let ");
+            this->write(let->lhs);
+            this->write(" = ");
+            this->print(let->rhs.get(), precedence_none, false, false, prev_stop_at, no_continuation);
+            this->newline();
+            prev_stop_at = this->position();
+            this->write_spaces(blank_spaces_backoff);
+            this->write("_in  ");
+            this->print(let->body.get(), precedence_none, false, false, prev_stop_at, no_continuation);
+            if (wrap_let_or_fun) {
+                this->write(")");
+            }
+            break;
+        }
+        case expr_if: {
+            auto *if_expr = static_cast<IfExpr *>(expr);
+            size_t blank_spaces_backoff = this->position() - prev_stop_at;
+            this->write("_if ");
+            this->print(if_expr->condition.get(), precedence_none, false, false, prev_stop_at, no_continuation);
+            this->newline();
+            prev_stop_at = this->position();
+            this->write_spaces(blank_spaces_backoff);
+            this->write("_then ");
+            this->print(if_expr->then_expr.get(), precedence_none, false, false, prev_stop_at, no_continuation);
+            this->newline();
+            prev_stop_at = this->position();
+            this->write_spaces(blank_spaces_backoff);
+            this->write("_else ");
+            this->print(if_expr->else_expr.get(), precedence_none, false, false, prev_stop_at, no_continuation);
+            break;
+        }
+        case expr_fun: {
+            auto *fun = static_cast<FunExpr *>(expr);
+            if (wrap_let_or_fun) {
+                this->write("(");
+            }
+            size_t blank_spaces_backoff = this->position() - prev_stop_at + 2;
+            this->write("_fun (");
+            this->write(fun->formal_arg);
+            this->write(")");
+            this->newline();
+            prev_stop_at = this->position();
+            this->write_spaces(blank_spaces_backoff);
+            this->print(fun->body.get(), precedence_none, false, false, prev_stop_at, no_continuation);
+            if (wrap_let_or_fun) {
+                this->write(")");
+            }
+            break;
+        }
+        case expr_call: {
+            auto *call = static_cast<CallExpr *>(expr);
+            this->print(call->to_be_called.get(), precedence_none, true, false, prev_stop_at, no_continuation);
+            this->write("(");
+            this->print(call->actual_arg.get(), precedence_none, false, false, prev_stop_at, no_continuation);
+            this->write(")");
+            break;
+        }
+    }
+}
+
+std::string pretty_print_to_string(const PTR(Expr) &expr, const PrettyPrintOptions &options) {
+    std::string out;
+    PrettyPrinter(out, options).print(expr);
+    return out;
+}
@@ -0,0 +1,110 @@
+#ifndef PRETTY_PRINT_H
+#define PRETTY_PRINT_H
+
+class Expr;
+
+#include "pointer.h"
+#include "expr.hpp"
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct PrettyPrintOptions {
+    // 0 keeps the classic layout; otherwise +, * and == chains are broken after
+    // an operator, rather than run past this column
+    size_t max_width = 0;
+};
+
+// The layout of "Beautify the Expression": _let, _if and _fun go over several
+// lines, indented by how far into the output their line they started. Output
+// is appended to a string or collected in a buffer that is written out to a
+// stream or file descriptor as it fills, and positions are counted rather than
+// asked of the stream, so printing takes time linear in the output.
+class PrettyPrinter {
+public:
+    explicit PrettyPrinter(std::string &out, const PrettyPrintOptions &options = PrettyPrintOptions());
+
+    explicit PrettyPrinter(std::ostream &out, const PrettyPrintOptions &options = PrettyPrintOptions());
+
+    // throws std::runtime_error if writing to fd fails
+    explicit PrettyPrinter(int fd, const PrettyPrintOptions &options = PrettyPrintOptions());
+
+    ~PrettyPrinter();
+
+    PrettyPrinter(const PrettyPrinter &) = delete;
+
+    PrettyPrinter &operator=(const PrettyPrinter &) = delete;
+
+    void print(const PTR(Expr) &expr);
+
+    // hands buffered output to the stream or file descriptor
+    void flush();
+
+private:
+    PrettyPrintOptions options;
+    // buffered output is handed on once it reaches this size
+    static const size_t flush_threshold = 64 << 10;
+
+    // the string being appended to, either the caller's or the buffer in front of out or fd
+    std::string *text;
+    std::string buffer;
+    std::ostream *out = nullptr;
+    int fd = -1;
+    // size of text when printing started, plus what has been flushed from it since
+    size_t origin;
+    size_t flushed = 0;
+    // position just after the last newline
+    size_t line_begin = 0;
+
+    // what a node prints before its first line break, and whether it breaks at all
+    struct Extent {
+        size_t first_line;
+        bool multiline;
+    };
+
+    // filled in before printing when there is a width limit
+    std::unordered_map<const Expr *, Extent> extents;
+
+    size_t position() const {
+        return this->flushed + this->text->size() - this->origin;
+    }
+
+    size_t column() const {
+        return this->position() - this->line_begin;
+    }
+
+    void write(std::string_view str) {
+        this->text->append(str.data(), str.size());
+        this->flush_if_full();
+    }
+
+    void write_spaces(size_t count) {
+        this->text->append(count, ' ');
+        this->flush_if_full();
+    }
+
+    void flush_if_full() {
+        if (this->text == &this->buffer && this->buffer.size() >= flush_threshold) {
+            this->flush();
+        }
+    }
+
+    void newline();
+
+    Extent measure(Expr *expr);
+
+    Extent printed_extent(Expr *expr, precedence_t precedence, bool wrap_eq);
+
+    void write_operator(std::string_view op, Expr *parent, Expr *rhs, precedence_t rhs_precedence, bool rhs_wrap_eq,
+                        size_t indent, size_t &prev_stop_at);
+
+    void print(Expr *expr, precedence_t precedence, bool wrap_let_or_fun, bool wrap_eq, size_t prev_stop_at,
+               size_t continuation);
+};
+
+std::string pretty_print_to_string(const PTR(Expr) &expr, const PrettyPrintOptions &options = PrettyPrintOptions());
+
+#endif // PRETTY_PRINT_H
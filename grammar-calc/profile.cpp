@@ -0,0 +1,266 @@
+#include "profile.h"
+#include "expr.hpp"
+#include "env.h"
+#include "eval_context.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// puts a value back when the scope ends, however it ends
+class Restore {
+public:
+    Restore(size_t &slot) : slot(slot), saved(slot) {}
+
+    ~Restore() {
+        this->slot = this->saved;
+    }
+
+private:
+    size_t &slot;
+    size_t saved;
+};
+
+}
+
+// times one activation of a node or closure body, from construction to destruction
+class Profiler::Timed {
+public:
+    Timed(Profiler &profiler, Stats &stats)
+        : profiler(profiler), stats(stats), parent(profiler.current), stack(profiler.current_stack) {
+        this->stats.count++;
+        this->stats.active++;
+        this->profiler.current = this;
+        this->start = now_ns();
+    }
+
+    ~Timed() {
+        uint64_t elapsed = now_ns() - this->start;
+        uint64_t exclusive = elapsed - std::min(elapsed, this->children);
+        this->stats.exclusive_ns += exclusive;
+        this->profiler.stacks[this->stack].exclusive_ns += exclusive;
+        if (--this->stats.active == 0) {
+            this->stats.inclusive_ns += elapsed;
+        }
+        if (this->parent != nullptr) {
+            this->parent->children += elapsed;
+        }
+        this->profiler.current = this->parent;
+    }
+
+    Timed(const Timed &) = delete;
+
+    Timed &operator=(const Timed &) = delete;
+
+private:
+    Profiler &profiler;
+    Stats &stats;
+    Timed *parent;
+    size_t stack;
+    uint64_t start;
+    // time spent in the activations this one started
+    uint64_t children = 0;
+};
+
+Profiler::Profiler(std::string source) : source(std::move(source)) {
+    this->line_starts.push_back(0);
+    for (size_t i = 0; i < this->source.size(); i++) {
+        if (this->source[i] == '\n') {
+            this->line_starts.push_back(i + 1);
+        }
+    }
+    this->stacks.push_back(Stack{0, nullptr, 0});
+}
+
+Value Profiler::interp(const PTR(Expr) &expr) {
+    // entries point into the tree, so it must outlive them
+    this->roots.push_back(expr);
+    return this->eval(expr.get(), Env::empty);
+}
+
+Value Profiler::eval(Expr *expr, const PTR(Env) &env) {
+    // references into an unordered_map stay valid when it grows
+    Stats &stats = this->nodes[expr];
+    Timed timed(*this, stats);
+    switch (expr->kind) {
+        case expr_num:
+        case expr_bool:
+        case expr_var:
+            return expr->interp(env);
+        case expr_fun: {
+            this->fun_of_body.emplace(static_cast<FunExpr *>(expr)->body.get(), expr);
+            Value closure = expr->interp(env);
+            // a closed function is lifted: every evaluation shares the one closure its FunExpr keeps
+            if (closure.as_heap().use_count() == 1) {
+                stats.allocations++;
+            }
+            return closure;
+        }
+        case expr_add: {
+            auto *add = static_cast<AddExpr *>(expr);
+            Value lhs_val = this->eval(add->lhs.get(), env);
+            return lhs_val.add_to(this->eval(add->rhs.get(), env));
+        }
+        case expr_mult: {
+            auto *mult = static_cast<MultExpr *>(expr);
+            Value lhs_val = this->eval(mult->lhs.get(), env);
+            return lhs_val.mult_with(this->eval(mult->rhs.get(), env));
+        }
+        case expr_eq: {
+            auto *eq = static_cast<EqExpr *>(expr);
+            Value lhs_val = this->eval(eq->lhs.get(), env);
+            Value rhs_val = this->eval(eq->rhs.get(), env);
+            return Value::from_bool(lhs_val.equals(rhs_val));
+        }
+        case expr_let: {
+            auto *let = static_cast<LetExpr *>(expr);
+            Value rhs_val = this->eval(let->rhs.get(), env);
+            if (let->slot >= 0) {
+                static_cast<FrameEnv *>(env.get())->slots[let->slot] = rhs_val;
+                return this->eval(let->body.get(), env);
+            }
+            stats.allocations++;
+            return this->eval(let->body.get(), NEW(ExtendedEnv)(let->lhs, rhs_val, env));
+        }
+        case expr_if: {
+            auto *if_expr = static_cast<IfExpr *>(expr);
+            if (this->eval(if_expr->condition.get(), env).is_true()) {
+                return this->eval(if_expr->then_expr.get(), env);
+            }
+            return this->eval(if_expr->else_expr.get(), env);
+        }
+        case expr_call: {
+            auto *call = static_cast<CallExpr *>(expr);
+            Value to_be_called = this->eval(call->to_be_called.get(), env);
+            Value actual_arg = this->eval(call->actual_arg.get(), env);
+            auto *fun = val_cast<FunVal>(to_be_called);
+            EvalContext *context = EvalContext::current();
+            if (fun == nullptr || (context != nullptr && context->memo != nullptr)) {
+                return to_be_called.call(actual_arg);
+            }
+            eval_tick();
+            CallDepth depth(context);
+            stats.allocations++;
+            Restore restore(this->current_stack);
+            this->current_stack = this->enter_stack(fun->body.get());
+            Timed body_timed(*this, this->bodies[fun->body.get()]);
+            if (fun->frame_size >= 0) {
+                PTR(FrameEnv) frame = NEW(FrameEnv)(fun->frame_size, std::static_pointer_cast<FrameEnv>(fun->env));
+                frame->slots[0] = std::move(actual_arg);
+                return this->eval(fun->body.get(), frame);
+            }
+            return this->eval(fun->body.get(), NEW(ExtendedEnv)(fun->formal_arg, std::move(actual_arg), fun->env));
+        }
+    }
+    throw std::runtime_error("invalid expression kind");
+}
+
+size_t Profiler::enter_stack(Expr *body) {
+    auto key = std::make_pair(this->current_stack, body);
+    auto found = this->stack_children.find(key);
+    if (found != this->stack_children.end()) {
+        return found->second;
+    }
+    this->stacks.push_back(Stack{this->current_stack, body, 0});
+    this->stack_children.emplace(key, this->stacks.size() - 1);
+    return this->stacks.size() - 1;
+}
+
+std::string Profiler::location(const Expr *expr) const {
+    if (expr == nullptr || expr->offset == Expr::unknown_offset || expr->offset > this->source.size()) {
+        return "?";
+    }
+    auto line = std::upper_bound(this->line_starts.begin(), this->line_starts.end(), (size_t) expr->offset) - 1;
+    return std::to_string(line - this->line_starts.begin() + 1) + ":" + std::to_string(expr->offset - *line + 1);
+}
+
+std::string Profiler::label(Expr *expr) const {
+    switch (expr->kind) {
+        case expr_num:
+        case expr_bool:
+            return expr->to_string();
+        case expr_var:
+            return static_cast<VarExpr *>(expr)->variable;
+        case expr_add:
+            return "+";
+        case expr_mult:
+            return "*";
+        case expr_eq:
+            return "==";
+        case expr_let:
+            return "_let " + static_cast<LetExpr *>(expr)->lhs;
+        case expr_if:
+            return "_if";
+        case expr_fun:
+            return "_fun (" + static_cast<FunExpr *>(expr)->formal_arg + ")";
+        case expr_call:
+            return "call";
+    }
+    return "?";
+}
+
+std::vector<ProfileEntry> Profiler::entries() const {
+    std::vector<ProfileEntry> entries;
+    auto add = [&](std::string label, std::string location, const Stats &stats) {
+        entries.push_back(ProfileEntry{std::move(label), std::move(location), stats.count, stats.inclusive_ns,
+                                       stats.exclusive_ns, stats.allocations});
+    };
+    for (const auto &node : this->nodes) {
+        add(this->label(node.first), this->location(node.first), node.second);
+    }
+    for (const auto &body : this->bodies) {
+        auto fun = this->fun_of_body.find(body.first);
+        if (fun != this->fun_of_body.end()) {
+            add(this->label(fun->second) + " body", this->location(fun->second), body.second);
+        } else {
+            add("_fun body", this->location(body.first), body.second);
+        }
+    }
+    std::sort(entries.begin(), entries.end(), [](const ProfileEntry &a, const ProfileEntry &b) {
+        return a.exclusive_ns > b.exclusive_ns;
+    });
+    return entries;
+}
+
+std::string Profiler::collapsed_stacks(const std::string &root) const {
+    std::vector<std::string> frames(this->stacks.size());
+    frames[0] = root;
+    // a stack's parent is always created before it
+    for (size_t i = 1; i < this->stacks.size(); i++) {
+        Expr *body = this->stacks[i].body;
+        auto fun = this->fun_of_body.find(body);
+        Expr *named = fun != this->fun_of_body.end() ? fun->second : body;
+        std::string frame = fun != this->fun_of_body.end() ? this->label(named) : "_fun";
+        frames[i] = frames[this->stacks[i].parent] + ";" + frame + " " + this->location(named);
+    }
+    std::ostringstream out;
+    for (size_t i = 0; i < this->stacks.size(); i++) {
+        if (this->stacks[i].exclusive_ns > 0) {
+            out << frames[i] << " " << this->stacks[i].exclusive_ns << "\n";
+        }
+    }
+    return out.str();
+}
+
+std::string Profiler::hot_spots(size_t limit) const {
+    std::vector<ProfileEntry> entries = this->entries();
+    std::ostringstream out;
+    out << std::setw(14) << "exclusive ms" << std::setw(14) << "inclusive ms" << std::setw(12) << "count"
+        << std::setw(13) << "allocations" << "  " << std::left << std::setw(10) << "location" << "node\n"
+        << std::right << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < entries.size() && i < limit; i++) {
+        const ProfileEntry &entry = entries[i];
+        out << std::setw(14) << entry.exclusive_ns / 1e6 << std::setw(14) << entry.inclusive_ns / 1e6
+            << std::setw(12) << entry.count << std::setw(13) << entry.allocations << "  " << std::left
+            << std::setw(10) << entry.location << entry.label << "\n" << std::right;
+    }
+    return out.str();
+}
@@ -0,0 +1,98 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+class Expr;
+class Env;
+
+#include "pointer.h"
+#include "val.hpp"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// what one node, or one closure body, cost over the evaluations of a Profiler
+struct ProfileEntry {
+    // "+", "call", "_let x", "_fun (x)", "_fun (x) body", a literal or a variable name
+    std::string label;
+    // "line:column" of the node in the parsed text, "?" for nodes the parser did not build
+    std::string location;
+    uint64_t count = 0;
+    // the node and everything it evaluated; time inside a recursive call to
+    // something already running is only counted once
+    uint64_t inclusive_ns = 0;
+    // the node alone, without the nodes it evaluated
+    uint64_t exclusive_ns = 0;
+    // environments and closures the node created
+    uint64_t allocations = 0;
+};
+
+// Evaluates trees the way Expr::interp does, recording the count, time and
+// allocations of every node and closure body, keyed by where the parser found
+// them. It is a separate evaluator, so the regular engines pay nothing for it.
+// Calls answered by a memo cache are not looked into, their cost stays with
+// the call node. Not thread-safe: use one per evaluating thread.
+class Profiler {
+public:
+    // source is the text the trees were parsed from, used to turn offsets into lines and columns
+    explicit Profiler(std::string source = "");
+
+    // evaluates expr, adding to what earlier calls recorded
+    Value interp(const PTR(Expr) &expr);
+
+    // one entry per node that ran and per closure body that was called, most exclusive time first
+    std::vector<ProfileEntry> entries() const;
+
+    // one "frame;frame;... nanoseconds" line per distinct stack of closure
+    // bodies, below a root frame named root: the input flamegraph.pl,
+    // speedscope and similar tools take
+    std::string collapsed_stacks(const std::string &root = "script") const;
+
+    // the top entries as an aligned text table
+    std::string hot_spots(size_t limit = 20) const;
+
+private:
+    struct Stats {
+        uint64_t count = 0;
+        uint64_t inclusive_ns = 0;
+        uint64_t exclusive_ns = 0;
+        uint64_t allocations = 0;
+        // activations running now, so recursion is counted once in inclusive_ns
+        int active = 0;
+    };
+
+    // a node of the tree of closure-body stacks; 0 is the root
+    struct Stack {
+        size_t parent;
+        Expr *body;
+        uint64_t exclusive_ns;
+    };
+
+    class Timed;
+
+    std::string source;
+    std::vector<size_t> line_starts;
+    std::vector<PTR(Expr)> roots;
+    std::unordered_map<Expr *, Stats> nodes;
+    // keyed by the closure's body, which is what a FunVal holds
+    std::unordered_map<Expr *, Stats> bodies;
+    // the FunExpr each body belongs to, for its label and location
+    std::unordered_map<Expr *, Expr *> fun_of_body;
+    std::vector<Stack> stacks;
+    std::map<std::pair<size_t, Expr *>, size_t> stack_children;
+    Timed *current = nullptr;
+    size_t current_stack = 0;
+
+    Value eval(Expr *expr, const PTR(Env) &env);
+
+    size_t enter_stack(Expr *body);
+
+    std::string location(const Expr *expr) const;
+
+    std::string label(Expr *expr) const;
+};
+
+#endif // PROFILE_H
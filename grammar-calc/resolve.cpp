@@ -0,0 +1,136 @@
+#include "resolve.h"
+#include "visitor.h"
+#include "val.hpp"
+#include "env.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct Scope {
+    std::vector<std::pair<std::string, int>> bindings;
+    int frame_size = 0;
+    // variables of enclosing functions the function reads, each at the slot of
+    // its capture frame given by its index, and where to copy it from
+    std::vector<std::string> captured;
+    std::vector<std::pair<int, int>> captures;
+};
+
+class Resolver : public ExprVisitor<Resolver, PTR(Expr)> {
+public:
+    std::vector<Scope> scopes;
+
+    // slots are never reused within a frame, a closure may still refer to a finished let
+    int bind(const std::string &name) {
+        Scope &scope = scopes.back();
+        int slot = scope.frame_size++;
+        scope.bindings.emplace_back(name, slot);
+        return slot;
+    }
+
+    PTR(Expr) visit_num(NumExpr *num) {
+        return num->THIS;
+    }
+
+    PTR(Expr) visit_bool(BoolExpr *boolean) {
+        return boolean->THIS;
+    }
+
+    PTR(Expr) visit_add(AddExpr *add) {
+        PTR(Expr) lhs = visit(add->lhs);
+        return NEW(AddExpr)(lhs, visit(add->rhs));
+    }
+
+    PTR(Expr) visit_mult(MultExpr *mult) {
+        PTR(Expr) lhs = visit(mult->lhs);
+        return NEW(MultExpr)(lhs, visit(mult->rhs));
+    }
+
+    PTR(Expr) visit_eq(EqExpr *eq) {
+        PTR(Expr) lhs = visit(eq->lhs);
+        return NEW(EqExpr)(lhs, visit(eq->rhs));
+    }
+
+    // name as seen from the function of scopes[level]: a slot of its own frame
+    // at depth 0, or of its capture frame at depth 1, captured from the
+    // enclosing functions (and by them, in turn) the first time it is needed
+    std::pair<int, int> address(size_t level, const std::string &name) {
+        Scope &scope = scopes[level];
+        for (auto it = scope.bindings.rbegin(); it != scope.bindings.rend(); ++it) {
+            if (it->first == name) {
+                return std::make_pair(0, it->second);
+            }
+        }
+        for (size_t i = 0; i < scope.captured.size(); i++) {
+            if (scope.captured[i] == name) {
+                return std::make_pair(1, (int) i);
+            }
+        }
+        if (level == 0) {
+            throw std::runtime_error("free variable: " + name);
+        }
+        scope.captures.push_back(address(level - 1, name));
+        scope.captured.push_back(name);
+        return std::make_pair(1, (int) scope.captures.size() - 1);
+    }
+
+    PTR(Expr) visit_var(VarExpr *var) {
+        std::pair<int, int> found = address(scopes.size() - 1, var->variable);
+        PTR(VarExpr) resolved = NEW(VarExpr)(var->variable);
+        resolved->depth = found.first;
+        resolved->slot = found.second;
+        return resolved;
+    }
+
+    PTR(Expr) visit_let(LetExpr *let) {
+        PTR(Expr) rhs = visit(let->rhs);
+        size_t bindings_before = scopes.back().bindings.size();
+        int slot = bind(let->lhs);
+        PTR(Expr) body = visit(let->body);
+        scopes.back().bindings.resize(bindings_before);
+        PTR(LetExpr) resolved = NEW(LetExpr)(let->lhs, rhs, body);
+        resolved->slot = slot;
+        return resolved;
+    }
+
+    PTR(Expr) visit_if(IfExpr *if_expr) {
+        PTR(Expr) condition = visit(if_expr->condition);
+        PTR(Expr) then_expr = visit(if_expr->then_expr);
+        return NEW(IfExpr)(condition, then_expr, visit(if_expr->else_expr));
+    }
+
+    PTR(Expr) visit_fun(FunExpr *fun) {
+        scopes.emplace_back();
+        bind(fun->formal_arg);
+        PTR(FunExpr) resolved = NEW(FunExpr)(fun->formal_arg, visit(fun->body));
+        resolved->frame_size = scopes.back().frame_size;
+        resolved->captures = std::move(scopes.back().captures);
+        scopes.pop_back();
+        return resolved;
+    }
+
+    PTR(Expr) visit_call(CallExpr *call) {
+        PTR(Expr) to_be_called = visit(call->to_be_called);
+        return NEW(CallExpr)(to_be_called, visit(call->actual_arg));
+    }
+};
+
+}
+
+ResolvedExpr::ResolvedExpr(PTR(Expr) expr, int frame_size) {
+    this->expr = std::move(expr);
+    this->frame_size = frame_size;
+}
+
+Value ResolvedExpr::interp() {
+    return this->expr->interp(NEW(FrameEnv)(this->frame_size, nullptr));
+}
+
+PTR(ResolvedExpr) resolve(PTR(Expr) expr) {
+    Resolver resolver;
+    resolver.scopes.emplace_back();
+    PTR(Expr) resolved = resolver.visit(expr);
+    return NEW(ResolvedExpr)(resolved, resolver.scopes.back().frame_size);
+}
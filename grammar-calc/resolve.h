@@ -0,0 +1,23 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+class Expr;
+
+#include "pointer.h"
+#include "val.hpp"
+
+// an expression whose variables were rewritten to (depth, slot) addresses
+CLASS(ResolvedExpr) {
+public:
+    PTR(Expr) expr;
+    int frame_size;
+
+    ResolvedExpr(PTR(Expr) expr, int frame_size);
+
+    Value interp();
+};
+
+// runs after parse_expr, throws for free variables instead of leaving them to interp
+PTR(ResolvedExpr) resolve(PTR(Expr) expr);
+
+#endif // RESOLVE_H
@@ -0,0 +1,307 @@
+#ifndef STATIC_EXPR_H
+#define STATIC_EXPR_H
+
+// Header-only expression templates for the calculator grammar, for formulas
+// written in C++ rather than parsed from text:
+//
+//   STATIC_VAR(x);
+//   STATIC_VAR(y);
+//   using namespace static_expr;
+//
+//   constexpr auto formula = let<y>(var<x>() * 2, _if(var<y>() == 10, var<y>() + 1, num(0)));
+//   static_assert(interp(formula, bind<x>(5)) == 11);   // evaluated by the compiler
+//   int64_t at_run_time = interp(formula, bind<x>(input));   // straight-line code, no allocation
+//   std::string text = formula.to_expr()->to_string();   // the same formula as a runtime Expr
+//
+// Numbers and booleans are known apart at compile time, so what the runtime
+// reports as an error (adding a boolean, an _if on a number, a free variable)
+// is rejected with a static_assert instead. Both branches of an _if must have
+// the same type. Numbers are int64_t: a sum or product that does not fit, which
+// the interpreter would turn into a BigNumVal, fails to compile when the
+// compiler evaluates it and throws std::overflow_error at run time.
+
+#include "expr.hpp"
+#include "big_num.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+// declares the tag type that names variable `name`
+#define STATIC_VAR(name) struct name { static constexpr const char *text = #name; }
+
+namespace static_expr {
+
+template<typename T>
+constexpr bool always_false = false;
+
+// ---- environments: a compile-time list of (tag, value) bindings ----
+
+struct Empty {
+};
+
+template<typename Tag, typename T, typename Rest>
+struct Binding {
+    using tag = Tag;
+    T value;
+    Rest rest;
+};
+
+// what a variable bound to a T holds: numbers are widened to int64_t
+template<typename T>
+using held_t = std::conditional_t<std::is_same_v<T, bool>, bool, int64_t>;
+
+// binds Tag to value on top of rest, e.g. bind<x>(1, bind<y>(2))
+template<typename Tag, typename T, typename Rest = Empty>
+constexpr Binding<Tag, held_t<T>, Rest> bind(T value, Rest rest = Rest()) {
+    static_assert(std::is_integral_v<T>, "variables hold numbers or booleans");
+    return Binding<Tag, held_t<T>, Rest>{value, rest};
+}
+
+template<typename Tag, typename Env>
+constexpr auto lookup(const Env &env) {
+    if constexpr (std::is_same_v<Env, Empty>) {
+        static_assert(always_false<Tag>, "free variable");
+        return 0;
+    } else if constexpr (std::is_same_v<Tag, typename Env::tag>) {
+        return env.value;
+    } else {
+        return lookup<Tag>(env.rest);
+    }
+}
+
+// ---- nodes ----
+
+struct Num {
+    int64_t val;
+
+    template<typename Env>
+    constexpr int64_t interp(const Env &) const {
+        return this->val;
+    }
+
+    PTR(Expr) to_expr() const {
+        return NEW(NumExpr)(this->val);
+    }
+};
+
+struct Bool {
+    bool rep;
+
+    template<typename Env>
+    constexpr bool interp(const Env &) const {
+        return this->rep;
+    }
+
+    PTR(Expr) to_expr() const {
+        return NEW(BoolExpr)(this->rep);
+    }
+};
+
+template<typename Tag>
+struct Var {
+    template<typename Env>
+    constexpr auto interp(const Env &env) const {
+        return lookup<Tag>(env);
+    }
+
+    PTR(Expr) to_expr() const {
+        return NEW(VarExpr)(Tag::text);
+    }
+};
+
+template<typename L, typename R>
+struct Add {
+    L lhs;
+    R rhs;
+
+    template<typename Env>
+    constexpr int64_t interp(const Env &env) const {
+        auto l = this->lhs.interp(env);
+        auto r = this->rhs.interp(env);
+        static_assert(std::is_same_v<decltype(l), int64_t>, "cannot add to a bool val");
+        static_assert(std::is_same_v<decltype(r), int64_t>, "add to non-number");
+        int64_t sum = 0;
+        if (add_overflow(l, r, sum)) {
+            throw std::overflow_error("sum does not fit in 64 bits");
+        }
+        return sum;
+    }
+
+    PTR(Expr) to_expr() const {
+        return NEW(AddExpr)(this->lhs.to_expr(), this->rhs.to_expr());
+    }
+};
+
+template<typename L, typename R>
+struct Mult {
+    L lhs;
+    R rhs;
+
+    template<typename Env>
+    constexpr int64_t interp(const Env &env) const {
+        auto l = this->lhs.interp(env);
+        auto r = this->rhs.interp(env);
+        static_assert(std::is_same_v<decltype(l), int64_t>, "cannot mult with a bool val");
+        static_assert(std::is_same_v<decltype(r), int64_t>, "mult with non-number");
+        int64_t product = 0;
+        if (mult_overflow(l, r, product)) {
+            throw std::overflow_error("product does not fit in 64 bits");
+        }
+        return product;
+    }
+
+    PTR(Expr) to_expr() const {
+        return NEW(MultExpr)(this->lhs.to_expr(), this->rhs.to_expr());
+    }
+};
+
+template<typename L, typename R>
+struct Eq {
+    L lhs;
+    R rhs;
+
+    // a number never equals a boolean
+    template<typename Env>
+    constexpr bool interp(const Env &env) const {
+        auto l = this->lhs.interp(env);
+        auto r = this->rhs.interp(env);
+        if constexpr (std::is_same_v<decltype(l), decltype(r)>) {
+            return l == r;
+        } else {
+            return false;
+        }
+    }
+
+    PTR(Expr) to_expr() const {
+        return NEW(EqExpr)(this->lhs.to_expr(), this->rhs.to_expr());
+    }
+};
+
+template<typename C, typename T, typename E>
+struct If {
+    C condition;
+    T then_expr;
+    E else_expr;
+
+    template<typename Env>
+    constexpr auto interp(const Env &env) const {
+        using then_t = decltype(this->then_expr.interp(env));
+        using else_t = decltype(this->else_expr.interp(env));
+        static_assert(std::is_same_v<decltype(this->condition.interp(env)), bool>,
+                      "a num val cannot be interpreted as a bool val");
+        static_assert(std::is_same_v<then_t, else_t>, "both branches of an _if must have the same type");
+        if (this->condition.interp(env)) {
+            return this->then_expr.interp(env);
+        }
+        return this->else_expr.interp(env);
+    }
+
+    PTR(Expr) to_expr() const {
+        return NEW(IfExpr)(this->condition.to_expr(), this->then_expr.to_expr(), this->else_expr.to_expr());
+    }
+};
+
+template<typename Tag, typename Rhs, typename Body>
+struct Let {
+    Rhs rhs;
+    Body body;
+
+    template<typename Env>
+    constexpr auto interp(const Env &env) const {
+        return this->body.interp(bind<Tag>(this->rhs.interp(env), env));
+    }
+
+    PTR(Expr) to_expr() const {
+        return NEW(LetExpr)(Tag::text, this->rhs.to_expr(), this->body.to_expr());
+    }
+};
+
+// ---- building ----
+
+template<typename T>
+struct is_node : std::false_type {
+};
+
+template<> struct is_node<Num> : std::true_type {};
+template<> struct is_node<Bool> : std::true_type {};
+template<typename Tag> struct is_node<Var<Tag>> : std::true_type {};
+template<typename L, typename R> struct is_node<Add<L, R>> : std::true_type {};
+template<typename L, typename R> struct is_node<Mult<L, R>> : std::true_type {};
+template<typename L, typename R> struct is_node<Eq<L, R>> : std::true_type {};
+template<typename C, typename T, typename E> struct is_node<If<C, T, E>> : std::true_type {};
+template<typename Tag, typename R, typename B> struct is_node<Let<Tag, R, B>> : std::true_type {};
+
+// an integer or bool operand stands for the literal
+template<typename T>
+constexpr std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, Num> lift(T val) {
+    return Num{(int64_t) val};
+}
+
+constexpr Bool lift(bool rep) {
+    return Bool{rep};
+}
+
+template<typename T, typename = std::enable_if_t<is_node<T>::value>>
+constexpr T lift(T node) {
+    return node;
+}
+
+template<typename T>
+using lifted = decltype(lift(std::declval<T>()));
+
+// at least one side has to be a node so plain int arithmetic is left alone
+template<typename L, typename R>
+constexpr bool either_node = is_node<std::decay_t<L>>::value || is_node<std::decay_t<R>>::value;
+
+constexpr Num num(int64_t val) {
+    return Num{val};
+}
+
+constexpr Bool boolean(bool rep) {
+    return Bool{rep};
+}
+
+template<typename Tag>
+constexpr Var<Tag> var() {
+    return Var<Tag>{};
+}
+
+template<typename L, typename R, typename = std::enable_if_t<either_node<L, R>>>
+constexpr Add<lifted<L>, lifted<R>> operator+(L lhs, R rhs) {
+    return {lift(lhs), lift(rhs)};
+}
+
+template<typename L, typename R, typename = std::enable_if_t<either_node<L, R>>>
+constexpr Mult<lifted<L>, lifted<R>> operator*(L lhs, R rhs) {
+    return {lift(lhs), lift(rhs)};
+}
+
+// builds an == node; it does not compare the two expressions
+template<typename L, typename R, typename = std::enable_if_t<either_node<L, R>>>
+constexpr Eq<lifted<L>, lifted<R>> operator==(L lhs, R rhs) {
+    return {lift(lhs), lift(rhs)};
+}
+
+template<typename C, typename T, typename E>
+constexpr If<lifted<C>, lifted<T>, lifted<E>> _if(C condition, T then_expr, E else_expr) {
+    return {lift(condition), lift(then_expr), lift(else_expr)};
+}
+
+template<typename Tag, typename R, typename B>
+constexpr Let<Tag, lifted<R>, lifted<B>> let(R rhs, B body) {
+    return {lift(rhs), lift(body)};
+}
+
+// ---- evaluating ----
+
+template<typename E, typename Env = Empty>
+constexpr auto interp(const E &expr, const Env &env = Env()) {
+    static_assert(is_node<E>::value, "not a static expression");
+    return expr.interp(env);
+}
+
+}
+
+#endif // STATIC_EXPR_H
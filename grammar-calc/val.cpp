@@ -1,102 +1,121 @@
 #include "expr.hpp"
 #include "val.hpp"
 #include "env.h"
+#include "eval_context.h"
+#include "memo.h"
+#include "big_num.h"
+#include "jit.h"
 
 #include <utility>
 
-NumVal::NumVal(int rep) {
-    this->rep = rep;
-}
-
-PTR(Val)  NumVal::add_to(PTR(Val) other_val) {
-    auto other_num = CAST(NumVal)(other_val);
-    if (other_num == nullptr) {
-        throw std::runtime_error("add to non-number");
+Value Value::add_to(const Value &other_val) const {
+    switch (this->kind) {
+        case kind_num: {
+            int64_t sum;
+            if (other_val.is_num() && !add_overflow(this->num_rep, other_val.num_rep, sum)) {
+                return from_num(sum);
+            }
+            if (!is_number(other_val)) {
+                throw std::runtime_error("add to non-number");
+            }
+            return big_add(*this, other_val);
+        }
+        case kind_bool:
+            throw std::runtime_error("cannot add to a bool val");
+        default:
+            return this->heap->add_to(other_val);
     }
-    int new_val = (unsigned) this->rep + (unsigned) other_num->rep;
-    return NEW(NumVal)(new_val);
 }
 
-PTR(Val)  NumVal::mult_with(PTR(Val) other_val) {
-    auto other_num = CAST(NumVal)(other_val);
-    if (other_num == nullptr) {
-        throw std::runtime_error("mult with non-number");
+Value Value::mult_with(const Value &other_val) const {
+    switch (this->kind) {
+        case kind_num: {
+            int64_t product;
+            if (other_val.is_num() && !mult_overflow(this->num_rep, other_val.num_rep, product)) {
+                return from_num(product);
+            }
+            if (!is_number(other_val)) {
+                throw std::runtime_error("mult with non-number");
+            }
+            return big_mult(*this, other_val);
+        }
+        case kind_bool:
+            throw std::runtime_error("cannot mult with a bool val");
+        default:
+            return this->heap->mult_with(other_val);
     }
-    int new_val = (unsigned) this->rep * (unsigned) other_num->rep;
-    return NEW(NumVal)(new_val);
 }
 
-bool NumVal::equals(PTR(Val) other_val) {
-    auto other_num = CAST(NumVal)(other_val);
-    if (other_num == nullptr) {
-        return false;
+bool Value::equals(const Value &other_val) const {
+    switch (this->kind) {
+        case kind_num:
+            return other_val.is_num() && this->num_rep == other_val.num_rep;
+        case kind_bool:
+            return other_val.is_bool() && this->bool_rep == other_val.bool_rep;
+        default:
+            return this->heap->equals(other_val);
     }
-    return this->rep == other_num->rep;
-}
-
-std::string NumVal::to_string() {
-    return std::to_string(this->rep);
-}
-
-bool NumVal::is_true() {
-    throw std::runtime_error("a num val cannot be interpreted as a bool val");
-}
-
-PTR(Val)  NumVal::call(PTR(Val) actual_arg) {
-    throw std::runtime_error("cannot call on a num val");
 }
 
-BoolVal::BoolVal(bool rep) {
-    this->rep = rep;
-}
-
-PTR(Val)  BoolVal::add_to(PTR(Val) other_val) {
-    throw std::runtime_error("cannot add to a bool val");
-}
-
-PTR(Val)  BoolVal::mult_with(PTR(Val) other_val) {
-    throw std::runtime_error("cannot mult with a bool val");
-}
-
-bool BoolVal::equals(PTR(Val) other_val) {
-    auto other_bool = CAST(BoolVal)(other_val);
-    if (other_bool == nullptr) {
-        return false;
+std::string Value::to_string() const {
+    switch (this->kind) {
+        case kind_num:
+            return std::to_string(this->num_rep);
+        case kind_bool:
+            return this->bool_rep ? "_true" : "_false";
+        default:
+            return this->heap->to_string();
     }
-    return this->rep == other_bool->rep;
 }
 
-std::string BoolVal::to_string() {
-    return this->rep ? "_true" : "_false";
+bool Value::is_true() const {
+    switch (this->kind) {
+        case kind_num:
+            throw std::runtime_error("a num val cannot be interpreted as a bool val");
+        case kind_bool:
+            return this->bool_rep;
+        default:
+            return this->heap->is_true();
+    }
 }
 
-bool BoolVal::is_true() {
-    return this->rep;
+Value Value::call(const Value &actual_arg) const {
+    switch (this->kind) {
+        case kind_num:
+            throw std::runtime_error("cannot call on a num val");
+        case kind_bool:
+            throw std::runtime_error("cannot call on a bool val");
+        default:
+            return this->heap->call(actual_arg);
+    }
 }
 
-PTR(Val)  BoolVal::call(PTR(Val) actual_arg) {
-    throw std::runtime_error("cannot call on a bool val");
+Val::Val(val_kind_t kind) : kind(kind) {
+    eval_allocate();
 }
 
-FunVal::FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env) {
+FunVal::FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env, int frame_size, PTR(JitFunction) jit)
+    : Val(static_kind) {
     if(env == nullptr) {
         env = Env::empty;
     }
     this->formal_arg = std::move(formal_arg);
     this->body = std::move(body);
     this->env = std::move(env);
+    this->frame_size = frame_size;
+    this->jit = std::move(jit);
 }
 
-PTR(Val)  FunVal::add_to(PTR(Val) other_val) {
+Value FunVal::add_to(const Value &other_val) {
     throw std::runtime_error("cannot add to a fun val");
 }
 
-PTR(Val)  FunVal::mult_with(PTR(Val) other_val) {
+Value FunVal::mult_with(const Value &other_val) {
     throw std::runtime_error("cannot mult with a fun val");
 }
 
-bool FunVal::equals(PTR(Val) other_val) {
-    auto other_fun = CAST(FunVal)(other_val);
+bool FunVal::equals(const Value &other_val) {
+    auto other_fun = val_cast<FunVal>(other_val);
     if (other_fun == nullptr) {
         return false;
     }
@@ -111,6 +130,25 @@ bool FunVal::is_true() {
     throw std::runtime_error("a fun val cannot be interpreted as a bool val");
 }
 
-PTR(Val) FunVal::call(PTR(Val) actual_arg) {
+Value FunVal::call(const Value &actual_arg) {
+    eval_tick();
+    EvalContext *context = EvalContext::current();
+    CallDepth depth(context);
+    if (context != nullptr && context->memo != nullptr) {
+        return context->memo->call(*this, actual_arg);
+    }
+    return this->apply(actual_arg);
+}
+
+Value FunVal::apply(const Value &actual_arg) {
+    Value result;
+    if (this->jit != nullptr && this->jit->run(*this, actual_arg, result)) {
+        return result;
+    }
+    if (this->frame_size >= 0) {
+        PTR(FrameEnv) frame = NEW(FrameEnv)(this->frame_size, std::static_pointer_cast<FrameEnv>(this->env));
+        frame->slots[0] = actual_arg;
+        return this->body->interp(frame);
+    }
     return this->body->interp(NEW(ExtendedEnv)(this->formal_arg, actual_arg, this->env));
 }
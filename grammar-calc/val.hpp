@@ -4,86 +4,156 @@
 
 class Expr;
 class Env;
+class Val;
+class JitFunction;
 
 #include "pointer.h"
+#include <cstdint>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
-CLASS(Val) {
+// Result of evaluation. Numbers that fit in 64 bits and booleans are stored
+// inline; closures, and numbers too large for an int64_t (BigNumVal in
+// big_num.h), live on the heap as a Val.
+class Value {
 public:
-    virtual PTR(Val) add_to(PTR(Val) other_val) = 0;
+    enum kind_t : uint8_t {
+        kind_num,
+        kind_bool,
+        kind_heap,
+    };
 
-    virtual PTR(Val) mult_with(PTR(Val) other_val) = 0;
+    Value() : kind(kind_num), num_rep(0) {}
 
-    virtual bool equals(PTR(Val) other_val) = 0;
+    explicit Value(PTR(Val) heap) : kind(kind_heap), num_rep(0), heap(std::move(heap)) {}
 
-    virtual std::string to_string() = 0;
+    static Value from_num(int64_t rep) {
+        Value value;
+        value.num_rep = rep;
+        return value;
+    }
 
-    virtual bool is_true() = 0;
+    static Value from_bool(bool rep) {
+        Value value;
+        value.kind = kind_bool;
+        value.bool_rep = rep;
+        return value;
+    }
 
-    virtual PTR(Val) call(PTR(Val) actual_arg) = 0;
+    bool is_num() const {
+        return kind == kind_num;
+    }
 
-    virtual ~Val() = default;
-};
+    bool is_bool() const {
+        return kind == kind_bool;
+    }
 
-class NumVal : public Val {
-public:
-    int rep;
+    bool is_heap() const {
+        return kind == kind_heap;
+    }
 
-    explicit NumVal(int rep);
+    int64_t as_num() const {
+        return num_rep;
+    }
 
-    PTR(Val) add_to(PTR(Val) other_val);
+    bool as_bool() const {
+        return bool_rep;
+    }
 
-    PTR(Val) mult_with(PTR(Val) other_val);
+    const PTR(Val) &as_heap() const {
+        return heap;
+    }
 
-    bool equals(PTR(Val) other_val);
+    Value add_to(const Value &other_val) const;
 
-    std::string to_string();
+    Value mult_with(const Value &other_val) const;
 
-    bool is_true();
+    bool equals(const Value &other_val) const;
+
+    std::string to_string() const;
+
+    bool is_true() const;
+
+    Value call(const Value &actual_arg) const;
 
-    PTR(Val) call(PTR(Val) actual_arg);
+private:
+    kind_t kind;
+    union {
+        int64_t num_rep;
+        bool bool_rep;
+    };
+    PTR(Val) heap;
 };
 
+enum val_kind_t : uint8_t {
+    val_fun,
+    val_vm_closure,
+    val_flat_fun,
+    val_big_num,
+};
 
-class BoolVal : public Val {
+CLASS(Val) {
 public:
-    bool rep;
+    const val_kind_t kind;
 
-    explicit BoolVal(bool rep);
+    // counts against the current evaluation's allocation limit
+    explicit Val(val_kind_t kind);
 
-    PTR(Val) add_to(PTR(Val) other_val);
+    virtual Value add_to(const Value &other_val) = 0;
 
-    PTR(Val) mult_with(PTR(Val) other_val);
+    virtual Value mult_with(const Value &other_val) = 0;
 
-    bool equals(PTR(Val) other_val);
+    virtual bool equals(const Value &other_val) = 0;
 
-    std::string to_string();
+    virtual std::string to_string() = 0;
 
-    bool is_true();
+    virtual bool is_true() = 0;
 
-    PTR(Val) call(PTR(Val) actual_arg);
+    virtual Value call(const Value &actual_arg) = 0;
+
+    virtual ~Val() = default;
 };
 
+// downcast of a heap value by kind tag, nullptr when it is not a T
+template<typename T>
+T *val_cast(const Value &value) {
+    if (!value.is_heap() || value.as_heap()->kind != T::static_kind) {
+        return nullptr;
+    }
+    return static_cast<T *>(value.as_heap().get());
+}
+
 class FunVal : public Val {
 public:
+    static const val_kind_t static_kind = val_fun;
+
     std::string formal_arg;
     PTR(Expr) body;
     PTR(Env) env;
+    // >= 0 when body was resolved, calls then run in a FrameEnv of this size
+    int frame_size;
+    // native code for body, shared by the closures of one FunExpr; nullptr
+    // when the body is not compiled
+    PTR(JitFunction) jit;
 
-    explicit FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env = nullptr);
+    explicit FunVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env = nullptr, int frame_size = -1,
+                    PTR(JitFunction) jit = nullptr);
 
-    PTR(Val) add_to(PTR(Val) other_val);
+    Value add_to(const Value &other_val);
 
-    PTR(Val) mult_with(PTR(Val) other_val);
+    Value mult_with(const Value &other_val);
 
-    bool equals(PTR(Val) other_val);
+    bool equals(const Value &other_val);
 
     std::string to_string();
 
     bool is_true();
 
-    PTR(Val) call(PTR(Val) actual_arg);
+    Value call(const Value &actual_arg);
+
+    // runs the body, bypassing any memo cache
+    Value apply(const Value &actual_arg);
 };
 
 #endif // VAL_HPP
@@ -0,0 +1,115 @@
+#ifndef VISITOR_H
+#define VISITOR_H
+
+#include "expr.hpp"
+#include <stdexcept>
+
+// Switch-based dispatch over the Expr hierarchy, so passes (printers,
+// optimizers, compilers, ...) don't need a new virtual method on every
+// class. Derive with CRTP and implement the visit_* methods the pass
+// cares about; the rest fall through to visit_expr, which throws.
+//
+//   class CallCounter : public ExprVisitor<CallCounter, int> {
+//   public:
+//       int visit_call(CallExpr *expr) { return 1 + visit(expr->to_be_called) + visit(expr->actual_arg); }
+//       int visit_expr(Expr *expr) { ... }
+//   };
+template<typename Derived, typename R>
+class ExprVisitor {
+public:
+    R visit(Expr *expr) {
+        Derived &self = static_cast<Derived &>(*this);
+        switch (expr->kind) {
+            case expr_num:
+                return self.visit_num(static_cast<NumExpr *>(expr));
+            case expr_add:
+                return self.visit_add(static_cast<AddExpr *>(expr));
+            case expr_mult:
+                return self.visit_mult(static_cast<MultExpr *>(expr));
+            case expr_var:
+                return self.visit_var(static_cast<VarExpr *>(expr));
+            case expr_let:
+                return self.visit_let(static_cast<LetExpr *>(expr));
+            case expr_bool:
+                return self.visit_bool(static_cast<BoolExpr *>(expr));
+            case expr_if:
+                return self.visit_if(static_cast<IfExpr *>(expr));
+            case expr_eq:
+                return self.visit_eq(static_cast<EqExpr *>(expr));
+            case expr_fun:
+                return self.visit_fun(static_cast<FunExpr *>(expr));
+            case expr_call:
+                return self.visit_call(static_cast<CallExpr *>(expr));
+        }
+        throw std::runtime_error("invalid expression kind");
+    }
+
+    R visit(const PTR(Expr) &expr) {
+        return visit(expr.get());
+    }
+
+    R visit_num(NumExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_add(AddExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_mult(MultExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_var(VarExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_let(LetExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_bool(BoolExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_if(IfExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_eq(EqExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_fun(FunExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_call(CallExpr *expr) { return static_cast<Derived &>(*this).visit_expr(expr); }
+
+    R visit_expr(Expr *expr) {
+        throw std::runtime_error("unsupported expression");
+    }
+};
+
+// calls f on each direct child of expr, in evaluation order
+template<typename F>
+void for_each_child(Expr *expr, F f) {
+    switch (expr->kind) {
+        case expr_num:
+        case expr_var:
+        case expr_bool:
+            break;
+        case expr_add:
+            f(static_cast<AddExpr *>(expr)->lhs);
+            f(static_cast<AddExpr *>(expr)->rhs);
+            break;
+        case expr_mult:
+            f(static_cast<MultExpr *>(expr)->lhs);
+            f(static_cast<MultExpr *>(expr)->rhs);
+            break;
+        case expr_let:
+            f(static_cast<LetExpr *>(expr)->rhs);
+            f(static_cast<LetExpr *>(expr)->body);
+            break;
+        case expr_if:
+            f(static_cast<IfExpr *>(expr)->condition);
+            f(static_cast<IfExpr *>(expr)->then_expr);
+            f(static_cast<IfExpr *>(expr)->else_expr);
+            break;
+        case expr_eq:
+            f(static_cast<EqExpr *>(expr)->lhs);
+            f(static_cast<EqExpr *>(expr)->rhs);
+            break;
+        case expr_fun:
+            f(static_cast<FunExpr *>(expr)->body);
+            break;
+        case expr_call:
+            f(static_cast<CallExpr *>(expr)->to_be_called);
+            f(static_cast<CallExpr *>(expr)->actual_arg);
+            break;
+    }
+}
+
+#endif // VISITOR_H
@@ -0,0 +1,196 @@
+#include "vm.h"
+#include "expr.hpp"
+#include "eval_context.h"
+
+#include <utility>
+
+Frame::Frame(int size, PTR(Frame) parent) {
+    eval_allocate();
+    this->parent = std::move(parent);
+    if (size > inline_size) {
+        this->extra_slots.resize(size - inline_size);
+    }
+}
+
+void Frame::clear() {
+    this->parent.reset();
+    for (Value &slot : this->inline_slots) {
+        slot = Value();
+    }
+    this->extra_slots.clear();
+}
+
+void Frame::reuse(int size, PTR(Frame) parent) {
+    eval_allocate();
+    this->parent = std::move(parent);
+    if (size > inline_size) {
+        this->extra_slots.resize(size - inline_size);
+    }
+}
+
+VMClosure::VMClosure(PTR(Program) program, int proto, PTR(Frame) frame) : Val(static_kind) {
+    this->program = std::move(program);
+    this->proto = proto;
+    this->frame = std::move(frame);
+}
+
+Value VMClosure::add_to(const Value &other_val) {
+    throw std::runtime_error("cannot add to a fun val");
+}
+
+Value VMClosure::mult_with(const Value &other_val) {
+    throw std::runtime_error("cannot mult with a fun val");
+}
+
+bool VMClosure::equals(const Value &other_val) {
+    auto other_closure = val_cast<VMClosure>(other_val);
+    if (other_closure == nullptr) {
+        return false;
+    }
+    const FunProto &fun = this->program->protos[this->proto];
+    const FunProto &other_fun = other_closure->program->protos[other_closure->proto];
+    return fun.formal_arg == other_fun.formal_arg && fun.body->equals(other_fun.body);
+}
+
+std::string VMClosure::to_string() {
+    return "[function]";
+}
+
+bool VMClosure::is_true() {
+    throw std::runtime_error("a fun val cannot be interpreted as a bool val");
+}
+
+Value VMClosure::call(const Value &actual_arg) {
+    eval_tick();
+    CallDepth depth(EvalContext::current());
+    const FunProto &fun = this->program->protos[this->proto];
+    PTR(Frame) callee_frame = NEW(Frame)(fun.frame_size, this->frame);
+    callee_frame->slot(0) = actual_arg;
+    return vm_run(this->program, fun.entry, callee_frame);
+}
+
+namespace {
+
+// cleared frames vm_run keeps for its next calls
+const size_t max_spare_frames = 256;
+
+struct ReturnAddress {
+    size_t pc;
+    PTR(Frame) frame;
+};
+
+Value pop(std::vector<Value> &stack) {
+    Value top = std::move(stack.back());
+    stack.pop_back();
+    return top;
+}
+
+}
+
+// calls between closures of the same program stay inside this loop, so the C++ stack does not grow with recursion
+Value vm_run(const PTR(Program) &program, size_t entry, PTR(Frame) frame) {
+    const int32_t *code = program->code.data();
+    size_t pc = entry;
+    std::vector<Value> stack;
+    std::vector<ReturnAddress> calls;
+    // frames of returned calls that no closure captured, each saving a
+    // heap allocation on a later call
+    std::vector<PTR(Frame)> spare;
+    EvalContext *context = EvalContext::current();
+
+    while (true) {
+        switch (code[pc++]) {
+            case op_num:
+                stack.push_back(Value::from_num(code[pc++]));
+                break;
+            case op_const:
+                stack.push_back(program->constants[code[pc++]]);
+                break;
+            case op_bool:
+                stack.push_back(Value::from_bool(code[pc++] != 0));
+                break;
+            case op_load: {
+                Frame *target = frame.get();
+                for (int depth = code[pc]; depth > 0; depth--) {
+                    target = target->parent.get();
+                }
+                stack.push_back(target->slot(code[pc + 1]));
+                pc += 2;
+                break;
+            }
+            case op_free:
+                throw std::runtime_error("free variable: " + program->names[code[pc]]);
+            case op_store:
+                frame->slot(code[pc++]) = pop(stack);
+                break;
+            case op_add: {
+                Value rhs = pop(stack);
+                stack.back() = stack.back().add_to(rhs);
+                break;
+            }
+            case op_mult: {
+                Value rhs = pop(stack);
+                stack.back() = stack.back().mult_with(rhs);
+                break;
+            }
+            case op_eq: {
+                Value rhs = pop(stack);
+                stack.back() = Value::from_bool(stack.back().equals(rhs));
+                break;
+            }
+            case op_jump:
+                pc = code[pc];
+                break;
+            case op_jump_if_false:
+                pc = pop(stack).is_true() ? pc + 1 : code[pc];
+                break;
+            case op_closure:
+                stack.push_back(Value(NEW(VMClosure)(program, code[pc++], frame)));
+                break;
+            case op_call: {
+                Value actual_arg = pop(stack);
+                Value callee = pop(stack);
+                auto *closure = val_cast<VMClosure>(callee);
+                if (closure == nullptr || closure->program != program) {
+                    stack.push_back(callee.call(actual_arg));
+                    break;
+                }
+                if (context != nullptr) {
+                    context->tick();
+                    context->check_depth(calls.size() + 1);
+                }
+                const FunProto &fun = program->protos[closure->proto];
+                calls.push_back(ReturnAddress{pc, std::move(frame)});
+                if (spare.empty()) {
+                    frame = NEW(Frame)(fun.frame_size, closure->frame);
+                } else {
+                    frame = std::move(spare.back());
+                    spare.pop_back();
+                    frame->reuse(fun.frame_size, closure->frame);
+                }
+                frame->slot(0) = std::move(actual_arg);
+                pc = fun.entry;
+                break;
+            }
+            case op_return:
+                if (calls.empty()) {
+                    return pop(stack);
+                }
+                if (frame.use_count() == 1 && spare.size() < max_spare_frames) {
+                    frame->clear();
+                    spare.push_back(std::move(frame));
+                }
+                pc = calls.back().pc;
+                frame = std::move(calls.back().frame);
+                calls.pop_back();
+                break;
+            default:
+                throw std::runtime_error("invalid bytecode");
+        }
+    }
+}
+
+Value vm_interp(PTR(Expr) expr) {
+    PTR(Program) program = compile(std::move(expr));
+    return vm_run(program, 0, NEW(Frame)(program->main_frame_size, nullptr));
+}
@@ -0,0 +1,60 @@
+#ifndef VM_H
+#define VM_H
+
+class Expr;
+
+#include "bytecode.h"
+#include "val.hpp"
+#include <vector>
+
+// most frames hold just the argument and a binding or two, keep those inline to save an allocation per call
+CLASS(Frame) {
+public:
+    static const int inline_size = 2;
+
+    PTR(Frame) parent;
+    Value inline_slots[inline_size];
+    std::vector<Value> extra_slots;
+
+    Frame(int size, PTR(Frame) parent);
+
+    // drops the parent and the slots' values once a call returns, so
+    // vm_run can reuse a frame nothing captured for another call
+    void clear();
+
+    void reuse(int size, PTR(Frame) parent);
+
+    Value &slot(int index) {
+        return index < inline_size ? inline_slots[index] : extra_slots[index - inline_size];
+    }
+};
+
+class VMClosure : public Val {
+public:
+    static const val_kind_t static_kind = val_vm_closure;
+
+    PTR(Program) program;
+    int proto;
+    PTR(Frame) frame;
+
+    VMClosure(PTR(Program) program, int proto, PTR(Frame) frame);
+
+    Value add_to(const Value &other_val);
+
+    Value mult_with(const Value &other_val);
+
+    bool equals(const Value &other_val);
+
+    std::string to_string();
+
+    bool is_true();
+
+    Value call(const Value &actual_arg);
+};
+
+Value vm_run(const PTR(Program) &program, size_t entry, PTR(Frame) frame);
+
+// alternative to expr->interp(): compiles to bytecode and runs it on the VM
+Value vm_interp(PTR(Expr) expr);
+
+#endif // VM_H